@@ -50,9 +50,33 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <math.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "csim.h"
+#include "csimTrace.h"
 
 #define MEM_BITS 64		// Number of memory address bits
 
+/*
+* Tag matching and the search for the LRU line work on LANES lines at a
+* time, with AVX2 or SSE2 where the compiler targets them (e.g.
+* -march=native) and with plain loops otherwise; -DCSIM_SCALAR forces the
+* plain loops
+*/
+#if defined(__AVX2__) && !defined(CSIM_SCALAR)
+#define CSIM_AVX2
+#elif defined(__SSE2__) && !defined(CSIM_SCALAR)
+#define CSIM_SSE2
+#endif
+#if defined(CSIM_AVX2) || defined(CSIM_SSE2)
+#include <immintrin.h>
+#endif
+#define LANES 8
+
 /****************************************************************************/
 /***** DO NOT MODIFY THESE VARIABLE NAMES ***********************************/
 
@@ -75,81 +99,67 @@ int evict_cnt = 0;
 
 int cacheSize;
 
-/* Type: Memory address
-* Use this type whenever dealing with addresses or address masks
-*/
-typedef unsigned long long int mem_addr_t;
-
-/* Type: Cache line
-*
-* next: pointer to the next line in the linked list LRU representation
-* prev: pointer to the prev line in the linked list LRU representation
-*/
-typedef struct cache_line {
-	char valid;
-	mem_addr_t tag;
-	struct cache_line * next;
-	struct cache_line * prev;
-} cache_line_t;
-
-/* Type: Cache set
+/* Type: Cache
 *
-* lines: an array of all the lines in the set
-* list: points to the head of a doubly linked list of lines in order of most recently used.
-* list_size: the size of the list
+* The lines of all sets live in contiguous arrays (structure of arrays)
+* Set i owns entries [i * stride, (i + 1) * stride) of tags and stamps,
+* where stride is E rounded up to a multiple of LANES, so every set starts
+* on a vector
+* tags: tag of each line; only the low 32 bits of a tag were ever compared,
+*       so only those are kept
+* stamps: when each line was last used, on a 16 bit clock of its own set;
+*       the LRU line has the smallest stamp. The padding lines past E hold
+*       STAMP_NEVER, so they never look least recently used
+* clock: last stamp handed out in each set; when it runs out the stamps of
+*       the set are renumbered, see renumberSet
+* fill: number of valid lines of each set; lines are filled in order and
+*       never invalidated, so line j of set i is valid iff j < fill[i]
 */
-typedef struct cache_set {
-	cache_line_t * lines;
-	cache_line_t * list;
-	int list_size;
-} cache_set;
+typedef struct cache {
+	uint32_t * tags;
+	int16_t * stamps;
+	int * clock;
+	int * fill;
+	int stride;
+} cache_t;
 
-typedef cache_set* cache_t;		// Pointer to cache set = entire cache
+#define STAMP_NEVER INT16_MAX
+#define STAMP_FIRST INT16_MIN
 
 cache_t cache;					/* The cache we are simulating */
 
 
-/* updateList -
-* Moves given line to head of the list located at the given set.
-* Updates new tail and old head.
-*/
-void updateList(cache_line_t * curr_line, int set) {
-	cache[set].list->prev = curr_line;
-	curr_line->next = cache[set].list;
-	curr_line->prev = NULL;
-	cache[set].list = curr_line;
-	return;
-}
-
 /* 
 * initCache -
 * Allocate data structures to hold info regrading the sets and cache lines
-* use struct "cache_line_t" here
-* Initialize valid and tag field with 0s.
+* Initialize tags and fill counts with 0s, and the stamps of the padding
+* lines with STAMP_NEVER
 * use S (= 2^s) and E while allocating the data structures here
 */
 void initCache() {
+	size_t lines;
+
 	B = 1 << b;		// size of block = 2 ^ b
 	S = 1 << s;		// # of sets = 2 ^ s
 
-	// Initialize cache as an array of sets
-	cache = (cache_set *)malloc(sizeof(cache_set) * S);
+	cache.stride = (E + LANES - 1) & ~(LANES - 1);
+	lines = (size_t)S * cache.stride;
 
-	// Initialize each set; 
-	// - lines points to size E array of lines
-	// - list points to NULL
-	// - list_size to 0
+	// Vector loads need the arrays aligned; their sizes are multiples of the alignment
+	cache.tags = (uint32_t*)aligned_alloc(LANES * sizeof(uint32_t), lines * sizeof(uint32_t));
+	cache.stamps = (int16_t*)aligned_alloc(LANES * sizeof(int16_t), lines * sizeof(int16_t));
+	cache.clock = (int*)malloc(S * sizeof(int));
+	cache.fill = (int*)calloc(S, sizeof(int));
+	if (cache.tags == NULL || cache.stamps == NULL || cache.clock == NULL || cache.fill == NULL) {
+		fprintf(stderr, "initCache: %s\n", strerror(ENOMEM));
+		exit(1);
+	}
+	memset(cache.tags, 0, lines * sizeof(uint32_t));
+	for (size_t i = 0; i < lines; i++) {
+		cache.stamps[i] = (i % cache.stride < (size_t)E) ? STAMP_FIRST : STAMP_NEVER;
+	}
 	for (int i = 0; i < S; i++) {
-		cache[i].lines = (cache_line_t*)malloc(sizeof(cache_line_t) * E);
-		cache[i].list = NULL;
-		cache[i].list_size = 0;
-		// Initialize each line; valid and tag to 0, next and prev to NULL
-		for (int j = 0; j < E; j++) {
-			cache[i].lines[j].valid = 0;
-			cache[i].lines[j].tag = 0;
-			cache[i].lines[j].next = NULL;
-			cache[i].lines[j].prev = NULL;
-		}
+		cache.clock[i] = STAMP_FIRST;
 	}
 }
 
@@ -158,14 +168,176 @@ void initCache() {
 * inside initCache() function
 */
 void freeCache() {
-	// Free each set's line array
-	for (int i = 0; i < S; i++) {
-		free(cache[i].lines);
+	free(cache.tags);
+	free(cache.stamps);
+	free(cache.clock);
+	free(cache.fill);
+	return;
+}
+
+/*
+* findTag -
+* Returns the index of the line among the first n of a set that holds tag,
+* or -1 if none does
+*/
+static inline int findTag(const uint32_t *tags, int n, uint32_t tag) {
+	unsigned int match;
+	int i;
+
+	for (i = 0; i < n; i += LANES) {
+#if defined(CSIM_AVX2)
+		__m256i v = _mm256_load_si256((const __m256i*)(tags + i));
+		match = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, _mm256_set1_epi32((int)tag))));
+#elif defined(CSIM_SSE2)
+		__m128i key = _mm_set1_epi32((int)tag);
+		match = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128((const __m128i*)(tags + i)), key)));
+		match |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_load_si128((const __m128i*)(tags + i + 4)), key))) << 4;
+#else
+		match = 0;
+		for (int j = 0; j < LANES; j++) {
+			match |= (unsigned int)(tags[i + j] == tag) << j;
+		}
+#endif
+		if (match != 0) {
+			// Lines past the valid ones may hold zero tags; the valid ones come first
+			i += __builtin_ctz(match);
+			return i < n ? i : -1;
+		}
 	}
+	return -1;
+}
 
-	// Free the cache's set array
-	free(cache);
-	return;
+/*
+* findOldest -
+* Returns the index of the least recently used line of a full set
+*/
+static inline int findOldest(const int16_t *stamps) {
+	int oldest;
+	int i;
+
+#if defined(CSIM_AVX2) || defined(CSIM_SSE2)
+	// The minimum of the set, spread over all lanes, then its position
+	__m128i min = _mm_load_si128((const __m128i*)stamps);
+	for (i = LANES; i < cache.stride; i += LANES) {
+		min = _mm_min_epi16(min, _mm_load_si128((const __m128i*)(stamps + i)));
+	}
+	min = _mm_min_epi16(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(1, 0, 3, 2)));
+	min = _mm_min_epi16(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(2, 3, 0, 1)));
+	min = _mm_min_epi16(min, _mm_shufflelo_epi16(_mm_shufflehi_epi16(min, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1)));
+	for (i = 0; ; i += LANES) {
+		unsigned int match = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128((const __m128i*)(stamps + i)), min));
+		if (match != 0) {
+			return i + __builtin_ctz(match) / 2;
+		}
+	}
+#else
+	oldest = 0;
+	for (i = 1; i < E; i++) {
+		if (stamps[i] < stamps[oldest]) {
+			oldest = i;
+		}
+	}
+#endif
+	return oldest;
+}
+
+/*
+* compareStamps - qsort comparison of the (stamp, line) keys of renumberSet
+*/
+static int compareStamps(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+* renumberSet -
+* Gives the n valid lines of a set the stamps STAMP_FIRST, STAMP_FIRST + 1, ...
+* in the order they were last used, so its clock can run again
+* Returns the last stamp handed out
+*/
+static __attribute__((noinline)) int renumberSet(int16_t *stamps, int n) {
+	uint32_t *keys = (uint32_t*)malloc(n * sizeof(uint32_t));
+	int i;
+
+	if (keys == NULL) {
+		fprintf(stderr, "renumberSet: %s\n", strerror(ENOMEM));
+		exit(1);
+	}
+	// Stamps are distinct, so sorting them with the line in the low bits orders the lines
+	for (i = 0; i < n; i++) {
+		keys[i] = ((uint32_t)(stamps[i] - STAMP_FIRST) << 16) | (uint32_t)i;
+	}
+	qsort(keys, n, sizeof(uint32_t), compareStamps);
+	for (i = 0; i < n; i++) {
+		stamps[keys[i] & 0xFFFF] = (int16_t)(STAMP_FIRST + i);
+	}
+	free(keys);
+	return STAMP_FIRST + n - 1;
+}
+
+/*
+* touchLine -
+* Makes a line the most recently used one of its set by giving it the next
+* stamp of the set's clock
+*/
+static inline void touchLine(int16_t *stamps, int set, int line) {
+	int now = cache.clock[set] + 1;
+
+	if (now == STAMP_NEVER) {
+		now = renumberSet(stamps, cache.fill[set]) + 1;
+	}
+	stamps[line] = (int16_t)now;
+	cache.clock[set] = now;
+}
+
+/* Outcomes of an access */
+#define ACCESS_HIT 0
+#define ACCESS_MISS 1
+#define ACCESS_EVICT 2
+
+/*
+* accessLine -
+* Accesses the line of addr, bringing it into the cache on a miss
+* Touches nothing but the set of addr, so accesses to different sets may
+* run on different threads
+* Returns ACCESS_HIT, ACCESS_MISS, or ACCESS_EVICT for a miss that evicts
+*/
+static inline int accessLine(mem_addr_t addr) {
+	// Bit mask the address to find the set.
+	// Shift address to the right b bits then bitwise AND with (2 ^ s) - 1.
+	int set = (addr >> b) & ((1 << s) - 1);
+
+	// Shift the address to the right b + s bits.
+	uint32_t tag = (uint32_t)(addr >> (b + s));
+
+	uint32_t *tags = cache.tags + (size_t)set * cache.stride;
+	int16_t *stamps = cache.stamps + (size_t)set * cache.stride;
+	int fill = cache.fill[set];
+	int line = findTag(tags, fill, tag);
+
+	int outcome;
+
+	if (line >= 0) {
+		// Hit
+		outcome = ACCESS_HIT;
+	}
+	else if (fill < E) {
+		// Cold miss; no eviction is necessary. Take the next unused line
+		outcome = ACCESS_MISS;
+		line = fill;
+		tags[line] = tag;
+		cache.fill[set] = fill + 1;
+	}
+	else {
+		// Capacity miss; the least recently used line is evicted
+		outcome = ACCESS_EVICT;
+		line = findOldest(stamps);
+		tags[line] = tag;
+	}
+	touchLine(stamps, set, line);
+	return outcome;
 }
 
 /* 
@@ -176,164 +348,734 @@ void freeCache() {
 *   you will manipulate data structures allocated in initCache() here
 */
 void accessData(mem_addr_t addr) {
-	// Bit mask the address to find the set.
-	// Shift address to the right b bits then bitwise AND with (2 ^ s) - 1.
+	int outcome = accessLine(addr);
+
+	hit_cnt += (outcome == ACCESS_HIT);
+	miss_cnt += (outcome != ACCESS_HIT);
+	evict_cnt += (outcome == ACCESS_EVICT);
+}
+
+/*
+* Parallel simulation
+*
+* Sets never share lines, so they can be simulated on different threads.
+* Each worker owns a contiguous range of sets. The thread that decodes the
+* trace routes every access to the worker of its set, in batches, through
+* a ring of QUEUE_BATCHES batches per worker. A worker sees the accesses to
+* its sets in trace order and counts its own hits, misses and evictions;
+* stopWorkers adds them up, so the counts are those of a single thread
+*/
+#define QUEUE_BATCHES 8		// Batches in the ring of each worker
+#define BATCH_SIZE 4096		// Accesses in a batch
+
+/* Type: Worker
+* batches: QUEUE_BATCHES batches of BATCH_SIZE addresses, used in turn
+* len: number of addresses in each batch
+* head: batches handed to the worker so far; the decoder fills batch
+*       head % QUEUE_BATCHES
+* tail: batches the worker has finished
+* done: set once the decoder has handed over the last batch
+*/
+typedef struct worker {
+	pthread_t thread;
+	mem_addr_t * batches;
+	int len[QUEUE_BATCHES];
+	unsigned long head;
+	unsigned long tail;
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int hits;
+	int misses;
+	int evictions;
+} worker_t;
+
+/* Type: Workers of a parallel simulation
+* on: set while replayTrace routes accesses to the workers
+*/
+typedef struct parallel {
+	int on;
+	int nworkers;
+	worker_t * workers;
+} parallel_t;
+
+parallel_t parallel;			/* The workers, when run with -j */
+
+/*
+* runWorker - body of a worker thread
+* Simulates the batches of the worker as they come in, until the decoder
+* is done
+*/
+static void* runWorker(void *arg) {
+	worker_t *w = (worker_t*)arg;
+	mem_addr_t *batch;
+	int hits = 0, misses = 0, evictions = 0;
+	int outcome, n, i;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->tail == w->head && !w->done) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (w->tail == w->head) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		pthread_mutex_unlock(&w->lock);
+
+		batch = w->batches + (w->tail % QUEUE_BATCHES) * BATCH_SIZE;
+		n = w->len[w->tail % QUEUE_BATCHES];
+		for (i = 0; i < n; i++) {
+			outcome = accessLine(batch[i]);
+			hits += (outcome == ACCESS_HIT);
+			misses += (outcome != ACCESS_HIT);
+			evictions += (outcome == ACCESS_EVICT);
+		}
+
+		pthread_mutex_lock(&w->lock);
+		w->tail++;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	w->hits = hits;
+	w->misses = misses;
+	w->evictions = evictions;
+	return NULL;
+}
+
+/*
+* handOver -
+* Hands the batch the decoder has filled to its worker, and waits until
+* the next batch of the ring is free
+*/
+static void handOver(worker_t *w) {
+	pthread_mutex_lock(&w->lock);
+	w->head++;
+	pthread_cond_signal(&w->cond);
+	while (w->head - w->tail == QUEUE_BATCHES) {
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	w->len[w->head % QUEUE_BATCHES] = 0;
+}
+
+/*
+* startWorkers -
+* Starts n worker threads on the cache set up by initCache, at most one
+* per set. Until stopWorkers, replayTrace hands the accesses to them
+*/
+void startWorkers(int n) {
+	worker_t *w;
+
+	if (n > S) {
+		n = S;
+	}
+	parallel.nworkers = n;
+	parallel.workers = (worker_t*)calloc(n, sizeof(worker_t));
+	if (parallel.workers == NULL) {
+		fprintf(stderr, "startWorkers: %s\n", strerror(ENOMEM));
+		exit(1);
+	}
+	for (int i = 0; i < n; i++) {
+		w = &parallel.workers[i];
+		w->batches = (mem_addr_t*)malloc(QUEUE_BATCHES * BATCH_SIZE * sizeof(mem_addr_t));
+		if (w->batches == NULL) {
+			fprintf(stderr, "startWorkers: %s\n", strerror(ENOMEM));
+			exit(1);
+		}
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		if ((errno = pthread_create(&w->thread, NULL, runWorker, w)) != 0) {
+			fprintf(stderr, "startWorkers: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	parallel.on = 1;
+}
+
+/*
+* routeData -
+* Queues an access for the worker that owns its set
+*/
+static inline void routeData(mem_addr_t addr) {
 	int set = (addr >> b) & ((1 << s) - 1);
+	worker_t *w = &parallel.workers[((unsigned long)set * parallel.nworkers) >> s];
+	int slot = w->head % QUEUE_BATCHES;
 
-	// Shift the address to the right b + s bits.
-	int tag = (addr >> (b + s));
-
-	// Cold miss - empty set; change unused line's tag to address's tag. 
-	// Move to head of empty list. The chosen line is the first line 
-	// in the lines array as all lines are unused.
-	if (cache[set].list_size == 0) {
-		cache[set].list = &(cache[set].lines[0]);
-		cache[set].list->tag = tag;
-		cache[set].list->valid = 1;
-		cache[set].list_size++;
-
-		miss_cnt++;
+	w->batches[slot * BATCH_SIZE + w->len[slot]] = addr;
+	if (++w->len[slot] == BATCH_SIZE) {
+		handOver(w);
+	}
+}
+
+/*
+* stopWorkers -
+* Hands the workers their last batches, waits for them to finish and adds
+* their counts to hit_cnt, miss_cnt and evict_cnt
+*/
+void stopWorkers() {
+	worker_t *w;
+
+	for (int i = 0; i < parallel.nworkers; i++) {
+		w = &parallel.workers[i];
+		pthread_mutex_lock(&w->lock);
+		if (w->len[w->head % QUEUE_BATCHES] != 0) {
+			w->head++;
+		}
+		w->done = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+	for (int i = 0; i < parallel.nworkers; i++) {
+		w = &parallel.workers[i];
+		pthread_join(w->thread, NULL);
+		hit_cnt += w->hits;
+		miss_cnt += w->misses;
+		evict_cnt += w->evictions;
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+		free(w->batches);
+	}
+	free(parallel.workers);
+	memset(&parallel, 0, sizeof(parallel));
+}
+
+/*
+* Sweep
+*
+* LRU is a stack algorithm: a set with E lines holds exactly the E tags
+* most recently used in it. So an access hits in every cache whose E is
+* larger than its stack distance, the number of other tags of its set used
+* since its own tag was last used. A sweep therefore replays the trace once
+* and keeps, for each pair of s and b, one LRU stack per set, cut off at
+* the largest E, and a histogram of the stack distances
+*
+* A miss evicts unless its set still has unused lines, and the set of a
+* cache with E lines has unused lines until min(E, tags seen in it) lines
+* are filled. So the evictions of E are its misses less the sum over the
+* sets of min(E, depth of the set's stack)
+*
+* Tags are the same 32 bits accessData compares, so the counts match
+* those of separate runs exactly
+*/
+
+/* Type: Sweep of one pair of s and b
+* stacks: stride tags per set, most recently used first
+* depth: number of tags on each stack, at most sweep.max_E
+* dist: dist[d] is the number of accesses at stack distance d < max_E;
+*       dist[max_E] counts all others, which miss in every cache
+*/
+typedef struct sweep_cfg {
+	int s;
+	int b;
+	uint32_t * stacks;
+	int * depth;
+	unsigned long long * dist;
+} sweep_cfg_t;
+
+/* Type: State of a sweep
+* on: set while a sweep replays a trace instead of accessData
+* cfgs: one sweep_cfg_t for each s from 1 to max_s and b from 1 to max_b
+*/
+typedef struct sweep {
+	int on;
+	int max_s;
+	int max_E;
+	int max_b;
+	int stride;
+	int ncfgs;
+	sweep_cfg_t * cfgs;
+} sweep_t;
+
+sweep_t sweep;					/* The sweep, when run with --sweep */
+
+/*
+* initSweep -
+* Allocates the stacks and histograms of every pair of s and b, for E up
+* to max_E
+*/
+void initSweep(int max_s, int max_E, int max_b) {
+	sweep_cfg_t *cfg;
+	size_t sets;
+
+	sweep.max_s = max_s;
+	sweep.max_E = max_E;
+	sweep.max_b = max_b;
+	sweep.stride = (max_E + LANES - 1) & ~(LANES - 1);
+	sweep.ncfgs = max_s * max_b;
+	sweep.cfgs = (sweep_cfg_t*)calloc(sweep.ncfgs, sizeof(sweep_cfg_t));
+	if (sweep.cfgs == NULL) {
+		fprintf(stderr, "initSweep: %s\n", strerror(ENOMEM));
+		exit(1);
+	}
+	for (int i = 0; i < sweep.ncfgs; i++) {
+		cfg = &sweep.cfgs[i];
+		cfg->s = 1 + i / max_b;
+		cfg->b = 1 + i % max_b;
+		sets = (size_t)1 << cfg->s;
+		// findTag reads whole vectors; tags past the depth of a stack are never matched
+		cfg->stacks = (uint32_t*)aligned_alloc(LANES * sizeof(uint32_t), sets * sweep.stride * sizeof(uint32_t));
+		cfg->depth = (int*)calloc(sets, sizeof(int));
+		cfg->dist = (unsigned long long*)calloc(max_E + 1, sizeof(unsigned long long));
+		if (cfg->stacks == NULL || cfg->depth == NULL || cfg->dist == NULL) {
+			fprintf(stderr, "initSweep: %s\n", strerror(ENOMEM));
+			exit(1);
+		}
+		memset(cfg->stacks, 0, sets * sweep.stride * sizeof(uint32_t));
+	}
+	sweep.on = 1;
+}
+
+/*
+* freeSweep - frees what initSweep allocated
+*/
+void freeSweep() {
+	for (int i = 0; i < sweep.ncfgs; i++) {
+		free(sweep.cfgs[i].stacks);
+		free(sweep.cfgs[i].depth);
+		free(sweep.cfgs[i].dist);
+	}
+	free(sweep.cfgs);
+	memset(&sweep, 0, sizeof(sweep));
+}
+
+/*
+* sweepData -
+* Counts the stack distance of an access to addr in every pair of s and b,
+* and moves its tag to the top of its stacks
+*/
+static void sweepData(mem_addr_t addr) {
+	sweep_cfg_t *cfg;
+	uint32_t *stack, tag;
+	int set, d, i;
+
+	for (i = 0; i < sweep.ncfgs; i++) {
+		cfg = &sweep.cfgs[i];
+		set = (addr >> cfg->b) & ((1 << cfg->s) - 1);
+		tag = (uint32_t)(addr >> (cfg->b + cfg->s));
+		stack = cfg->stacks + (size_t)set * sweep.stride;
+
+		d = findTag(stack, cfg->depth[set], tag);
+		if (d < 0) {
+			// Not among the max_E most recent tags; a new tag deepens the stack, an old one falls off the bottom
+			cfg->dist[sweep.max_E]++;
+			if (cfg->depth[set] < sweep.max_E) {
+				cfg->depth[set]++;
+			}
+			d = cfg->depth[set] - 1;
+		}
+		else {
+			cfg->dist[d]++;
+		}
+		memmove(stack + 1, stack, d * sizeof(uint32_t));
+		stack[0] = tag;
+	}
+}
+
+/*
+* printSweep -
+* Prints the hits, misses and evictions of every cache with s, E and b
+* between 1 and their maxima, one line each
+*/
+void printSweep() {
+	unsigned long long total, hits, misses, filled;
+	unsigned long long *full;
+	sweep_cfg_t *cfg;
+	size_t sets, set;
+	int e;
+
+	// full[e]: sets whose stack is at least e deep
+	full = (unsigned long long*)calloc(sweep.max_E + 2, sizeof(unsigned long long));
+	if (full == NULL) {
+		fprintf(stderr, "printSweep: %s\n", strerror(ENOMEM));
+		exit(1);
+	}
+	printf("%4s %6s %4s %14s %14s %14s\n", "s", "E", "b", "hits", "misses", "evictions");
+	for (int i = 0; i < sweep.ncfgs; i++) {
+		cfg = &sweep.cfgs[i];
+		sets = (size_t)1 << cfg->s;
+		total = 0;
+		for (e = 0; e <= sweep.max_E; e++) {
+			total += cfg->dist[e];
+			full[e] = 0;
+		}
+		for (set = 0; set < sets; set++) {
+			full[cfg->depth[set]]++;
+		}
+		for (e = sweep.max_E - 1; e >= 0; e--) {
+			full[e] += full[e + 1];
+		}
+
+		hits = 0;
+		filled = 0;
+		for (e = 1; e <= sweep.max_E; e++) {
+			// Lines filled without an eviction: min(e, depth) summed over the sets
+			hits += cfg->dist[e - 1];
+			filled += full[e];
+			misses = total - hits;
+			printf("%4d %6d %4d %14llu %14llu %14llu\n", cfg->s, e, cfg->b, hits, misses, misses - filled);
+		}
+	}
+	free(full);
+}
+
+/*
+* Trace parsing
+*
+* A trace is parsed in place: regular files are mapped with mmap, and pipes
+* are read by a thread into two buffers, so reading one overlaps with
+* parsing the other (see replayStream). Both hand replayLines whole lines
+* that end in '\n'
+*/
+#define STREAM_BUF_SIZE (1 << 20)	// Bytes read into each buffer of a stream
+#define MAX_LINE 1024				// Longest partial line carried between buffers
+
+/*
+* replayData -
+* Feeds one access to the sweep, the workers or the cache, whichever is
+* running
+*/
+static inline void replayData(mem_addr_t addr) {
+	if (sweep.on) {
+		sweepData(addr);
+	}
+	else if (parallel.on) {
+		routeData(addr);
+	}
+	else {
+		accessData(addr);
+	}
+}
+
+/*
+* replayAccess -
+* Replays one access of a trace; L and S are one access, M a load followed
+* by a store to the same address
+*/
+static inline void replayAccess(int op, mem_addr_t addr, unsigned int len) {
+	if (verbosity)
+		printf("%c %llx,%u ", traceOpName[op], addr, len);
+
+	replayData(addr);
+	if (op == TRACE_MODIFY) {
+		replayData(addr);
+	}
+
+	if (verbosity)
+		printf("\n");
+}
+
+/*
+* replayLines -
+* Replays the lines of a text trace in [p, end); the last one must end in
+* '\n'
+*/
+static void replayLines(const char *p, const char *end) {
+	uint64_t addr;
+	unsigned int len;
+	int op;
+
+	while (p < end) {
+		p = traceParseLine(p, &op, &addr, &len);
+		if (op != 0) {
+			replayAccess(op, addr, len);
+		}
+		p = (const char*)memchr(p, '\n', end - p) + 1;
+	}
+}
+
+/*
+* replayBinary -
+* Replays a binary trace of size bytes at base, chunk after chunk
+*/
+static void replayBinary(char* trace_fn, const char *base, size_t size) {
+	trace_header_t header;
+	trace_chunk_t chunk;
+	const unsigned char *p, *end;
+	uint64_t addr, i, c;
+	unsigned int len;
+	int op;
+
+	traceGetHeader((const unsigned char*)base, &header);
+	if (header.index > size || header.chunks > (size - header.index) / TRACE_CHUNK_SIZE) {
+		fprintf(stderr, "%s: corrupt trace index\n", trace_fn);
+		exit(1);
+	}
+	for (c = 0; c < header.chunks; c++) {
+		traceGetChunk((const unsigned char*)base + header.index + c * TRACE_CHUNK_SIZE, &chunk);
+		if (chunk.offset > size || chunk.size > size - chunk.offset) {
+			fprintf(stderr, "%s: corrupt chunk %llu\n", trace_fn, (unsigned long long)c);
+			exit(1);
+		}
+		p = (const unsigned char*)base + chunk.offset;
+		end = p + chunk.size;
+		addr = 0;
+		for (i = 0; i < chunk.records; i++) {
+			if (traceGetRecord(&p, end, &op, &len, &addr) != 0) {
+				fprintf(stderr, "%s: corrupt chunk %llu\n", trace_fn, (unsigned long long)c);
+				exit(1);
+			}
+			replayAccess(op, addr, len);
+		}
+	}
+}
+
+/*
+* replayMapped -
+* Replays a regular file of size bytes by mapping it
+* Binary traces are told apart by their magic bytes. A last line of a text
+* trace without '\n' is copied out and given one
+*/
+static void replayMapped(char* trace_fn, int fd, size_t size) {
+	const char *base = (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	const char *last;
+	char *tail;
+
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", trace_fn, strerror(errno));
+		exit(1);
+	}
+	madvise((void*)base, size, MADV_SEQUENTIAL);
+
+	if (size >= TRACE_HEADER_SIZE && memcmp(base, TRACE_MAGIC, TRACE_MAGIC_SIZE) == 0) {
+		replayBinary(trace_fn, base, size);
+		munmap((void*)base, size);
 		return;
 	}
 
-	// Pointer to the current line in the linked list
-	cache_line_t *curr_line = cache[set].list;	
-
-	// Traverse the list searching for a line with a valid bit of 1 and a matching tag
-	for (int i = 0; i < cache[set].list_size; i++) {
-		if ((curr_line->valid == 1) && (curr_line->tag == tag)) {
-			// Hit 
-			hit_cnt++;
-
-			// Determine if current line is tail of list
-			if ((curr_line->next == NULL) && (curr_line->prev != NULL)) {
-				// Since current line is tail, no changes to next
-				// Update prev neighbor
-				curr_line->prev->next = NULL;
-
-				// Move current to head
-				updateList(curr_line, set);
-			
-			// Determine if current line is neither head nor tail
-			} else if ((curr_line->next != NULL) && (curr_line->prev != NULL)) {
-				// Must update both neighbors
-				curr_line->prev->next = curr_line->next;
-				curr_line->next->prev = curr_line->prev;
-
-				// Move current to head
-				updateList(curr_line, set);
+	last = base + size;
+	while (last > base && last[-1] != '\n') {
+		last--;
+	}
+	replayLines(base, last);
+	if (last < base + size) {
+		tail = (char*)malloc(base + size - last + 1);
+		if (tail == NULL) {
+			fprintf(stderr, "%s: %s\n", trace_fn, strerror(ENOMEM));
+			exit(1);
+		}
+		memcpy(tail, last, base + size - last);
+		tail[base + size - last] = '\n';
+		replayLines(tail, tail + (base + size - last) + 1);
+		free(tail);
+	}
+	munmap((void*)base, size);
+}
+
+/* Type: Buffer of a stream
+* data: room for a partial line carried over from the other buffer, then
+*       the bytes read, then a '\n' added after the last line
+* len: number of bytes read into data + MAX_LINE; 0 at end of file
+* full: set by the reader once len is valid, cleared by the parser when
+*       it is done with the buffer
+*/
+typedef struct stream_buf {
+	char data[MAX_LINE + STREAM_BUF_SIZE + 1];
+	size_t len;
+	int full;
+} stream_buf_t;
+
+/* Type: Stream read by a thread into two buffers in turn */
+typedef struct stream {
+	char* name;
+	int fd;
+	stream_buf_t buf[2];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} stream_t;
+
+/*
+* readStream - body of the reader thread of a stream
+* Fills the buffers in turn, each as soon as the parser has released it,
+* until end of file
+*/
+static void* readStream(void *arg) {
+	stream_t *st = (stream_t*)arg;
+	stream_buf_t *buf;
+	size_t len;
+	ssize_t got;
+	int k;
+
+	for (k = 0; ; k ^= 1) {
+		buf = &st->buf[k];
+		pthread_mutex_lock(&st->lock);
+		while (buf->full) {
+			pthread_cond_wait(&st->cond, &st->lock);
+		}
+		pthread_mutex_unlock(&st->lock);
+
+		// Pipes return a little at a time; fill the whole buffer
+		for (len = 0; len < STREAM_BUF_SIZE; len += got) {
+			got = read(st->fd, buf->data + MAX_LINE + len, STREAM_BUF_SIZE - len);
+			if (got == 0) {
+				break;
+			}
+			if (got < 0 && errno != EINTR) {
+				fprintf(stderr, "%s: %s\n", st->name, strerror(errno));
+				exit(1);
+			}
+			if (got < 0) {
+				got = 0;
 			}
-			return;
 		}
-		// Increment curr_line
-		// If the for loop is about to exit, ensure curr_line will point to the tail
-		if (i != cache[set].list_size - 1) {
-			curr_line = curr_line->next;
+
+		pthread_mutex_lock(&st->lock);
+		buf->len = len;
+		buf->full = 1;
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+		if (len == 0) {
+			return NULL;
 		}
 	}
+}
 
-	// If the function does not return inside of the for loop, a miss has occurred. 
-	miss_cnt++;
+/*
+* replayStream -
+* Replays a trace that cannot be mapped, such as a pipe
+* A reader thread fills one buffer while the lines of the other are
+* replayed. A line split between two buffers is carried into the room in
+* front of the second one; a line longer than MAX_LINE is skipped
+*/
+static void replayStream(char* trace_fn, int fd) {
+	stream_t *st = (stream_t*)calloc(1, sizeof(stream_t));
+	stream_buf_t *buf, *prev = NULL;
+	const char *carry = NULL;
+	size_t carry_len = 0;
+	int skip = 0;
+	char *start, *end, *last;
+	pthread_t reader;
+	int k;
 
-	// Handle each type of miss accordingly
+	if (st == NULL) {
+		fprintf(stderr, "%s: %s\n", trace_fn, strerror(ENOMEM));
+		exit(1);
+	}
+	st->name = trace_fn;
+	st->fd = fd;
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+	if ((errno = pthread_create(&reader, NULL, readStream, st)) != 0) {
+		fprintf(stderr, "%s: %s\n", trace_fn, strerror(errno));
+		exit(1);
+	}
 
-	// Check for a capacity miss
-	if (cache[set].list_size == E) {
-		// Eviction must occur. Line at tail of list must be evicted
-		// as it is the LRU.
-		curr_line->tag = tag;
-		evict_cnt++;
+	for (k = 0; ; k ^= 1) {
+		buf = &st->buf[k];
+		pthread_mutex_lock(&st->lock);
+		while (!buf->full) {
+			pthread_cond_wait(&st->cond, &st->lock);
+		}
+		pthread_mutex_unlock(&st->lock);
+		if (buf->len == 0) {
+			break;
+		}
 
-		if (curr_line->prev != NULL) {
-			// Update neighbor
-			curr_line->prev->next = NULL;
+		// The partial line still sits in the previous buffer; move it, then let the reader have that buffer
+		start = buf->data + MAX_LINE - carry_len;
+		if (prev != NULL) {
+			memcpy(start, carry, carry_len);
+			pthread_mutex_lock(&st->lock);
+			prev->full = 0;
+			pthread_cond_broadcast(&st->cond);
+			pthread_mutex_unlock(&st->lock);
 		}
 
-		// Move "new" line to head
-		updateList(curr_line, set);
-	
-	// Check for a cold miss - nonempty set
-	} else if (cache[set].list_size < E) {
-		// No eviction is necessary. Simply initialize an unused line from 
-		// the lines array.
-		curr_line = &(cache[set].lines[cache[set].list_size]);
-		curr_line->valid = 1;
-		curr_line->tag = tag;
-		cache[set].list_size++;
+		end = buf->data + MAX_LINE + buf->len;
+		// Binary traces need their index at the end, so they have to be mapped
+		if (prev == NULL && end - start >= TRACE_MAGIC_SIZE && memcmp(start, TRACE_MAGIC, TRACE_MAGIC_SIZE) == 0) {
+			fprintf(stderr, "%s: binary traces must be read from a file\n", trace_fn);
+			exit(1);
+		}
+		if (skip) {
+			start = (char*)memchr(start, '\n', end - start);
+			skip = (start == NULL);
+			start = skip ? end : start + 1;
+		}
+		last = end;
+		while (last > start && last[-1] != '\n') {
+			last--;
+		}
+		replayLines(start, last);
 
-		// Move new line to head 
-		updateList(curr_line, set);
+		carry = last;
+		carry_len = end - last;
+		if (carry_len > MAX_LINE) {
+			skip = 1;
+			carry_len = 0;
+		}
+		prev = buf;
+	}
 
-	// This code should never be reached.
-	} else {
-		printf("Error occurred in accessData.");
-		exit(0);
+	// A last line without '\n'; the previous buffer has room for one more byte
+	if (carry_len != 0 && !skip) {
+		((char*)carry)[carry_len] = '\n';
+		replayLines(carry, carry + carry_len + 1);
 	}
 
-	return;
+	pthread_join(reader, NULL);
+	pthread_mutex_destroy(&st->lock);
+	pthread_cond_destroy(&st->cond);
+	free(st);
 }
 
 /*
 * replayTrace - replays the given trace file against the cache
-* reads the input trace file line by line
 * extracts the type of each memory access : L/S/M
 * YOU MUST TRANSLATE one "L" as a load i.e. 1 memory access
 * YOU MUST TRANSLATE one "S" as a store i.e. 1 memory access
 * YOU MUST TRANSLATE one "M" as a load followed by a store i.e. 2 memory accesses
+* Text traces and the binary traces of csim-convert are told apart by
+* their first bytes, see csimTrace.h
+* A trace_fn of "-" reads standard input, so that valgrind can be piped in:
+*   valgrind --tool=lackey --trace-mem=yes --log-fd=1 ./prog | csim ... -t -
+* Regular files are mapped, everything else is streamed
 */
 void replayTrace(char* trace_fn) {
-	char buf[1000];
-	mem_addr_t addr = 0;
-	unsigned int len = 0;
-	FILE* trace_fp = fopen(trace_fn, "r");
+	struct stat st;
+	int fd = (strcmp(trace_fn, "-") == 0) ? STDIN_FILENO : open(trace_fn, O_RDONLY);
 
-	if (!trace_fp) {
+	if (fd < 0 || fstat(fd, &st) != 0) {
 		fprintf(stderr, "%s: %s\n", trace_fn, strerror(errno));
 		exit(1);
 	}
+	traceInitParser();
 
-	while (fgets(buf, 1000, trace_fp) != NULL) {
-		if (buf[1] == 'S' || buf[1] == 'L' || buf[1] == 'M') {
-			sscanf(buf + 3, "%llx,%u", &addr, &len);
-
-			if (verbosity)
-				printf("%c %llx,%u ", buf[1], addr, len);
-
-			// now you have: 
-			// 1. address accessed in variable - addr 
-			// 2. type of acccess(S/L/M)  in variable - buf[1] 
-			// call accessData function here depending on type of access
-			if (buf[1] == 'S' || buf[1] == 'L') {
-				accessData(addr);
-			}
-			else if (buf[1] == 'M') {
-				accessData(addr);
-				accessData(addr);
-			}
-
-			if (verbosity)
-				printf("\n");
+	if (S_ISREG(st.st_mode)) {
+		if (st.st_size > 0) {
+			replayMapped(trace_fn, fd, st.st_size);
 		}
 	}
+	else {
+		replayStream(trace_fn, fd);
+	}
 
-	fclose(trace_fp);
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
 }
 
 /*
 * printUsage - Print usage info
 */
 void printUsage(char* argv[]) {
-	printf("Usage: %s [-hv] -s <num> -E <num> -b <num> -t <file>\n", argv[0]);
+	printf("Usage: %s [-hv] [-j <num>] -s <num> -E <num> -b <num> -t <file>\n", argv[0]);
 	printf("Options:\n");
 	printf("  -h         Print this help message.\n");
 	printf("  -v         Optional verbose flag.\n");
 	printf("  -s <num>   Number of set index bits.\n");
 	printf("  -E <num>   Number of lines per set.\n");
 	printf("  -b <num>   Number of block offset bits.\n");
-	printf("  -t <file>  Trace file.\n");
+	printf("  -t <file>  Trace file, or - for standard input.\n");
+	printf("  -j <num>   Number of threads to simulate the sets on; not with --sweep.\n");
+	printf("  --sweep    Simulate every cache with 1 to s set index bits, 1 to E lines\n");
+	printf("             per set and 1 to b block offset bits in one pass.\n");
 	printf("\nExamples:\n");
 	printf("  linux>  %s -s 4 -E 1 -b 4 -t traces/yi.trace\n", argv[0]);
 	printf("  linux>  %s -v -s 8 -E 2 -b 4 -t traces/yi.trace\n", argv[0]);
+	printf("  linux>  %s -j 4 -s 12 -E 8 -b 6 -t traces/yi.trace\n", argv[0]);
+	printf("  linux>  %s --sweep -s 8 -E 16 -b 6 -t traces/yi.trace\n", argv[0]);
 	exit(0);
 }
 
@@ -351,12 +1093,21 @@ void printSummary(int hits, int misses, int evictions) {
 
 /*
 * main - Main routine
+* Leave it out with -DCSIM_LIBRARY_ONLY when linking the simulator into
+* another program, e.g. csimBench.c
 */
+#ifndef CSIM_LIBRARY_ONLY
 int main(int argc, char* argv[]) {
+	static const struct option long_opts[] = {
+		{ "sweep", no_argument, NULL, 'w' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int sweeping = 0;
+	int threads = 1;
 	char c;
 
-	// Parse the command line arguments: -h, -v, -s, -E, -b, -t 
-	while ((c = getopt(argc, argv, "s:E:b:t:vh")) != -1) {
+	// Parse the command line arguments: -h, -v, -s, -E, -b, -t, -j, --sweep
+	while ((c = getopt_long(argc, argv, "s:E:b:t:j:vh", long_opts, NULL)) != -1) {
 		switch (c) {
 		case 'b':
 			b = atoi(optarg);
@@ -367,6 +1118,9 @@ int main(int argc, char* argv[]) {
 		case 'h':
 			printUsage(argv);
 			exit(0);
+		case 'j':
+			threads = atoi(optarg);
+			break;
 		case 's':
 			s = atoi(optarg);
 			break;
@@ -376,6 +1130,9 @@ int main(int argc, char* argv[]) {
 		case 'v':
 			verbosity = 1;
 			break;
+		case 'w':
+			sweeping = 1;
+			break;
 		default:
 			printUsage(argv);
 			exit(1);
@@ -388,15 +1145,41 @@ int main(int argc, char* argv[]) {
 		printUsage(argv);
 		exit(1);
 	}
+	if (E < 0 || E > MAX_E) {
+		printf("%s: -E must be between 1 and %d\n", argv[0], MAX_E);
+		exit(1);
+	}
+	if (threads < 1) {
+		printf("%s: -j must be at least 1\n", argv[0]);
+		exit(1);
+	}
+	if (sweeping && threads > 1) {
+		printf("%s: -j does not apply to --sweep\n", argv[0]);
+		exit(1);
+	}
 
+	if (sweeping) {
+		initSweep(s, E, b);
+		replayTrace(trace_file);
+		printSweep();
+		freeSweep();
+		return 0;
+	}
 
 	initCache();
 
-	replayTrace(trace_file);
+	if (threads > 1) {
+		startWorkers(threads);
+		replayTrace(trace_file);
+		stopWorkers();
+	}
+	else {
+		replayTrace(trace_file);
+	}
 
 	freeCache();
 
 	printSummary(hit_cnt, miss_cnt, evict_cnt);
 	return 0;
 }
-
+#endif
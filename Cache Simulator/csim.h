@@ -0,0 +1,53 @@
+#ifndef CSIM_H
+#define CSIM_H
+
+/*
+* Interface of the cache simulator in csim.c, for programs that link it in
+* with -DCSIM_LIBRARY_ONLY, e.g. csimBench.c
+*
+* Set s, E and b, call initCache, then feed addresses to accessData (or a
+* whole trace to replayTrace) and read hit_cnt, miss_cnt and evict_cnt.
+* freeCache releases the cache again
+*/
+
+/* Type: Memory address
+* Use this type whenever dealing with addresses or address masks
+*/
+typedef unsigned long long int mem_addr_t;
+
+/* Largest associativity; LRU stamps are kept in 16 bits */
+#define MAX_E 32767
+
+extern int s;
+extern int E;
+extern int b;
+extern int verbosity;
+
+extern int hit_cnt;
+extern int miss_cnt;
+extern int evict_cnt;
+
+void initCache();
+void freeCache();
+void accessData(mem_addr_t addr);
+void replayTrace(char* trace_fn);
+
+/*
+* Parallel simulation: between startWorkers and stopWorkers, replayTrace
+* hands each access to one of n threads, by set. stopWorkers adds their
+* counts to hit_cnt, miss_cnt and evict_cnt
+*/
+void startWorkers(int n);
+void stopWorkers();
+
+/*
+* Sweep of every cache with 1 to max_s set index bits, 1 to max_E lines per
+* set and 1 to max_b block offset bits: between initSweep and freeSweep,
+* replayTrace feeds the sweep instead of the cache, and printSweep prints
+* the counts of all of them
+*/
+void initSweep(int max_s, int max_E, int max_b);
+void printSweep();
+void freeSweep();
+
+#endif
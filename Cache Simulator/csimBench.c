@@ -0,0 +1,389 @@
+/*
+* csimBench.c - Benchmarks for the cache simulator in csim.c
+*
+* Build:
+*   gcc -O2 -march=native -pthread -DCSIM_LIBRARY_ONLY csim.c csimBench.c -o csimBench -lm
+*
+* Usage: csimBench <benchmark> [args]
+*   assoc [N]       N synthetic accesses (default 4000000) through accessData
+*                   for associativities from 1 to 64, in accesses per second
+*   parse [N]       A synthetic valgrind trace of N lines (default 4000000)
+*                   replayed with fgets and sscanf, from a mapped file,
+*                   from a pipe and as a binary trace, in MB and lines per
+*                   second
+*   threads [N]     A binary trace of 4000000 lines simulated on 1 to N
+*                   threads (default 8), with the speedup over one thread
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "csim.h"
+#include "csimTrace.h"
+
+#define ASSOC_SETS_BITS 6
+#define ASSOC_BLOCK_BITS 6
+#define ASSOC_ROUNDS 5
+#define PARSE_ROUNDS 3
+#define THREAD_LINES 4000000
+#define THREAD_SETS_BITS 10
+#define THREAD_ASSOC 32
+
+/* Function that returns a monotonic timestamp in nanoseconds */
+static double nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+* Function that fills addrs with a synthetic access stream: mostly a hot
+* working set that fits caches of high associativity, plus a sequential
+* sweep and random addresses that miss in all of them
+* Argument - addrs: Where to write
+* Argument - n: Number of addresses
+*/
+static void makeStream(mem_addr_t *addrs, size_t n) {
+	unsigned seed = 354;
+	size_t i;
+	int r;
+
+	for (i = 0; i < n; i++) {
+		r = rand_r(&seed) % 100;
+		if (r < 70) {
+			//About 3000 hot blocks
+			addrs[i] = 0x601000 + ((mem_addr_t)(rand_r(&seed) % 3000) << ASSOC_BLOCK_BITS);
+		}
+		else if (r < 85) {
+			addrs[i] = 0x7ff000000ULL + (i & 0xFFFFF) * 8;
+		}
+		else {
+			addrs[i] = ((mem_addr_t)rand_r(&seed) << 16) ^ (mem_addr_t)rand_r(&seed);
+		}
+	}
+}
+
+/*
+* assoc - Runs the same access stream through caches of 2^ASSOC_SETS_BITS
+* sets and growing associativity, and reports the best of ASSOC_ROUNDS runs
+* of each in millions of accesses per second
+*/
+static int benchAssoc(size_t n) {
+	static const int assocs[] = { 1, 2, 4, 8, 16, 32, 64 };
+	mem_addr_t *addrs = malloc(n * sizeof(mem_addr_t));
+	double start, elapsed, best;
+	size_t t, i;
+	int r;
+
+	if (n == 0 || addrs == NULL) {
+		fprintf(stderr, "cannot hold %zu addresses\n", n);
+		return 1;
+	}
+	makeStream(addrs, n);
+
+	s = ASSOC_SETS_BITS;
+	b = ASSOC_BLOCK_BITS;
+	printf("%6s %14s %10s\n", "E", "Maccesses/s", "hit rate");
+	for (t = 0; t < sizeof(assocs) / sizeof(assocs[0]); t++) {
+		E = assocs[t];
+		best = 0;
+		for (r = 0; r < ASSOC_ROUNDS; r++) {
+			initCache();
+			hit_cnt = miss_cnt = evict_cnt = 0;
+			start = nowNs();
+			for (i = 0; i < n; i++) {
+				accessData(addrs[i]);
+			}
+			elapsed = nowNs() - start;
+			freeCache();
+			if (best == 0 || elapsed < best) {
+				best = elapsed;
+			}
+		}
+		printf("%6d %14.1f %9.1f%%\n", E, n / best * 1e3, 100.0 * hit_cnt / n);
+	}
+	free(addrs);
+	return 0;
+}
+
+/*
+* Function that writes n lines of a synthetic valgrind trace to a
+* temporary file: instruction loads, and loads, stores and modifies of the
+* makeStream addresses
+* Argument - binary: Write the same accesses as a binary trace instead
+* Argument - bytes: Size of the file
+* Returns the file descriptor, with the file already unlinked, or -1
+*/
+static int makeTrace(size_t n, int binary, size_t *bytes) {
+	static const char ops[] = "LLLSSM";
+	char path[] = "/tmp/csimBenchXXXXXX";
+	int fd = mkstemp(path);
+	mem_addr_t *addrs = malloc(n * sizeof(mem_addr_t));
+	unsigned char *chunk = malloc(TRACE_CHUNK_RECORDS * TRACE_MAX_RECORD);
+	trace_chunk_t *index = calloc(n / TRACE_CHUNK_RECORDS + 1, sizeof(trace_chunk_t));
+	trace_header_t header;
+	unsigned char entry[TRACE_HEADER_SIZE > TRACE_CHUNK_SIZE ? TRACE_HEADER_SIZE : TRACE_CHUNK_SIZE];
+	uint64_t prev = 0;
+	unsigned seed = 354;
+	FILE *fp;
+	size_t i, len = 0, records = 0;
+	int op, size;
+
+	// The stream gets a descriptor of its own, so closing it leaves fd open
+	if (fd < 0 || addrs == NULL || chunk == NULL || index == NULL || (fp = fdopen(dup(fd), "w")) == NULL) {
+		return -1;
+	}
+	unlink(path);
+	makeStream(addrs, n);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+	if (binary) {
+		tracePutHeader(entry, &header);
+		fwrite(entry, TRACE_HEADER_SIZE, 1, fp);
+	}
+	for (i = 0; i < n; i++) {
+		op = ops[rand_r(&seed) % 6];
+		size = 1 << (rand_r(&seed) % 4);
+		if (!binary && i % 3 == 0) {
+			fprintf(fp, "I  %08llx,%d\n", 0x400000ULL + 4 * i, 3);
+		}
+		else if (!binary) {
+			fprintf(fp, " %c %llx,%d\n", op, addrs[i], size);
+		}
+		else if (i % 3 != 0) {
+			op = (op == 'L') ? TRACE_LOAD : (op == 'S') ? TRACE_STORE : TRACE_MODIFY;
+			len += tracePutRecord(chunk + len, op, size, addrs[i], prev);
+			prev = addrs[i];
+			records++;
+		}
+		if (binary && (records == TRACE_CHUNK_RECORDS || (i == n - 1 && records != 0))) {
+			index[header.chunks].offset = ftell(fp);
+			index[header.chunks].size = len;
+			index[header.chunks].records = records;
+			header.chunks++;
+			fwrite(chunk, 1, len, fp);
+			len = records = prev = 0;
+		}
+	}
+	if (binary) {
+		header.index = ftell(fp);
+		for (i = 0; i < header.chunks; i++) {
+			tracePutChunk(entry, &index[i]);
+			fwrite(entry, TRACE_CHUNK_SIZE, 1, fp);
+		}
+		fseek(fp, 0, SEEK_SET);
+		tracePutHeader(entry, &header);
+		fwrite(entry, TRACE_HEADER_SIZE, 1, fp);
+		fseek(fp, 0, SEEK_END);
+	}
+	*bytes = ftell(fp);
+	fclose(fp);
+	free(addrs);
+	free(chunk);
+	free(index);
+	return fd;
+}
+
+/*
+* Function that replays a trace the way replayTrace used to, with fgets
+* and sscanf on every line
+*/
+static void replaySscanf(char *path) {
+	char buf[1000];
+	mem_addr_t addr = 0;
+	unsigned int len = 0;
+	FILE *fp = fopen(path, "r");
+
+	while (fgets(buf, 1000, fp) != NULL) {
+		if (buf[1] == 'S' || buf[1] == 'L' || buf[1] == 'M') {
+			sscanf(buf + 3, "%llx,%u", &addr, &len);
+			accessData(addr);
+			if (buf[1] == 'M') {
+				accessData(addr);
+			}
+		}
+	}
+	fclose(fp);
+}
+
+/*
+* Function that replays the trace in fd through a pipe: a child process
+* copies it into the pipe, which replayTrace reads as standard input
+*/
+static void replayPipe(int fd) {
+	char buf[65536];
+	int pipefd[2];
+	int saved = dup(STDIN_FILENO);
+	ssize_t got;
+
+	if (pipe(pipefd) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	fflush(stdout);
+	if (fork() == 0) {
+		close(pipefd[0]);
+		lseek(fd, 0, SEEK_SET);
+		while ((got = read(fd, buf, sizeof(buf))) > 0) {
+			if (write(pipefd[1], buf, got) != got) {
+				_exit(1);
+			}
+		}
+		_exit(0);
+	}
+	close(pipefd[1]);
+	dup2(pipefd[0], STDIN_FILENO);
+	close(pipefd[0]);
+	replayTrace("-");
+	dup2(saved, STDIN_FILENO);
+	close(saved);
+	wait(NULL);
+}
+
+/*
+* parse - Replays the same synthetic trace with the old fgets and sscanf
+* loop, from a mapped file, from a pipe and as a binary trace, into a
+* small direct-mapped cache, and reports the best of PARSE_ROUNDS runs of
+* each
+*/
+static int benchParse(size_t n) {
+	static const char *readers[] = { "sscanf", "mmap", "pipe", "binary" };
+	char path[64], bin_path[64];
+	size_t bytes, bin_bytes;
+	double start, elapsed, best;
+	int fd = n != 0 ? makeTrace(n, 0, &bytes) : -1;
+	int bin_fd = n != 0 ? makeTrace(n, 1, &bin_bytes) : -1;
+	int t, r;
+
+	if (fd < 0 || bin_fd < 0) {
+		fprintf(stderr, "cannot write a trace of %zu lines\n", n);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	snprintf(bin_path, sizeof(bin_path), "/proc/self/fd/%d", bin_fd);
+
+	s = 4;
+	E = 1;
+	b = 4;
+	printf("%8s %10s %10s %12s %14s\n", "reader", "MB", "MB/s", "Mlines/s", "hits");
+	for (t = 0; t < 4; t++) {
+		best = 0;
+		for (r = 0; r < PARSE_ROUNDS; r++) {
+			initCache();
+			hit_cnt = miss_cnt = evict_cnt = 0;
+			start = nowNs();
+			if (t == 0) {
+				replaySscanf(path);
+			}
+			else if (t == 1) {
+				replayTrace(path);
+			}
+			else if (t == 2) {
+				replayPipe(fd);
+			}
+			else {
+				replayTrace(bin_path);
+			}
+			elapsed = nowNs() - start;
+			freeCache();
+			if (best == 0 || elapsed < best) {
+				best = elapsed;
+			}
+		}
+		printf("%8s %10.1f %10.1f %12.2f %14d\n", readers[t], (t < 3 ? bytes : bin_bytes) / 1e6,
+			(t < 3 ? bytes : bin_bytes) / best * 1e3, n / best * 1e3, hit_cnt);
+	}
+	close(fd);
+	close(bin_fd);
+	return 0;
+}
+
+/*
+* threads - Simulates a binary trace on 1 to max_threads threads, the best
+* of PARSE_ROUNDS runs each, and checks that every thread count gives the
+* counts of the single threaded run
+*/
+static int benchThreads(int max_threads) {
+	char path[64];
+	size_t bytes;
+	double start, elapsed, best, base = 0;
+	int fd = makeTrace(THREAD_LINES, 1, &bytes);
+	int hits = 0, misses = 0, evictions = 0;
+	int t, r;
+
+	if (fd < 0 || max_threads < 1) {
+		fprintf(stderr, "cannot write a trace of %d lines\n", THREAD_LINES);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	s = THREAD_SETS_BITS;
+	E = THREAD_ASSOC;
+	b = 6;
+	printf("%8s %14s %10s %8s\n", "threads", "Maccesses/s", "speedup", "counts");
+	for (t = 1; t <= max_threads; t++) {
+		best = 0;
+		for (r = 0; r < PARSE_ROUNDS; r++) {
+			initCache();
+			hit_cnt = miss_cnt = evict_cnt = 0;
+			start = nowNs();
+			if (t > 1) {
+				startWorkers(t);
+				replayTrace(path);
+				stopWorkers();
+			}
+			else {
+				replayTrace(path);
+			}
+			elapsed = nowNs() - start;
+			freeCache();
+			if (best == 0 || elapsed < best) {
+				best = elapsed;
+			}
+		}
+		if (t == 1) {
+			base = best;
+			hits = hit_cnt;
+			misses = miss_cnt;
+			evictions = evict_cnt;
+		}
+		printf("%8d %14.1f %10.2f %8s\n", t, (hit_cnt + miss_cnt) / best * 1e3, base / best,
+			(hit_cnt == hits && miss_cnt == misses && evict_cnt == evictions) ? "same" : "DIFFER");
+	}
+	close(fd);
+	return 0;
+}
+
+/* Function that prints the list of benchmarks */
+static int usage(char *prog) {
+	fprintf(stderr, "Usage: %s <benchmark> [args]\n", prog);
+	fprintf(stderr, "  assoc [N]       N accesses (default 4000000) for E from 1 to 64, in accesses per second\n");
+	fprintf(stderr, "  parse [N]       an N line trace (default 4000000) through sscanf, mmap, a pipe and binary\n");
+	fprintf(stderr, "  threads [N]     a binary trace simulated on 1 to N threads (default 8)\n");
+	return 1;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		return usage(argv[0]);
+	}
+
+	if (strcmp(argv[1], "assoc") == 0) {
+		return benchAssoc(argc > 2 ? strtoul(argv[2], NULL, 0) : 4000000);
+	}
+
+	if (strcmp(argv[1], "parse") == 0) {
+		return benchParse(argc > 2 ? strtoul(argv[2], NULL, 0) : 4000000);
+	}
+
+	if (strcmp(argv[1], "threads") == 0) {
+		return benchThreads(argc > 2 ? atoi(argv[2]) : 8);
+	}
+
+	return usage(argv[0]);
+}
@@ -0,0 +1,229 @@
+/*
+* csimConvert.c - Converts valgrind text traces into the binary traces of
+* csimTrace.h
+*
+* Build:
+*   gcc -O2 csimConvert.c -o csim-convert
+*
+* Usage: csim-convert <in.trace> <out.ctrace>
+*   in.trace may be - for standard input, so valgrind can be piped in:
+*     valgrind --tool=lackey --trace-mem=yes --log-fd=1 ./prog | csim-convert - prog.ctrace
+*   out.ctrace must be a file, since the header is written last
+*
+* csim reads either format with -t and tells them apart by their first
+* bytes. Instruction loads and other lines csim skips are left out
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "csimTrace.h"
+
+#define READ_SIZE (1 << 20)		// Bytes read at a time
+#define MAX_LINE 1024			// Longest line kept whole across reads
+
+/* State of the binary trace being written */
+typedef struct writer {
+	FILE *fp;
+	char *name;
+	unsigned char *buf;			// Records of the current chunk
+	size_t len;					// Bytes in buf
+	uint64_t records;			// Records in buf
+	uint64_t prev;				// Address of the last record in buf
+	uint64_t offset;			// File offset of the next chunk
+	trace_chunk_t *chunks;		// Index of the chunks written so far
+	uint64_t nchunks;
+	uint64_t total;				// Records written so far
+} writer_t;
+
+/* Function that reports a failed write and exits */
+static void writeFailed(writer_t *w) {
+	fprintf(stderr, "%s: %s\n", w->name, strerror(errno));
+	exit(1);
+}
+
+/* Function that writes the current chunk out and starts a new one */
+static void flushChunk(writer_t *w) {
+	trace_chunk_t *chunks;
+
+	if (w->records == 0) {
+		return;
+	}
+	if ((w->nchunks & (w->nchunks - 1)) == 0) {
+		chunks = realloc(w->chunks, (w->nchunks ? 2 * w->nchunks : 1) * sizeof(trace_chunk_t));
+		if (chunks == NULL) {
+			errno = ENOMEM;
+			writeFailed(w);
+		}
+		w->chunks = chunks;
+	}
+	w->chunks[w->nchunks].offset = w->offset;
+	w->chunks[w->nchunks].size = w->len;
+	w->chunks[w->nchunks].records = w->records;
+	w->nchunks++;
+
+	if (fwrite(w->buf, 1, w->len, w->fp) != w->len) {
+		writeFailed(w);
+	}
+	w->offset += w->len;
+	w->total += w->records;
+	w->len = 0;
+	w->records = 0;
+	w->prev = 0;
+}
+
+/*
+* Function that converts the text lines in [p, end); the last one must end
+* in '\n'
+*/
+static void convertLines(writer_t *w, const char *p, const char *end) {
+	uint64_t addr;
+	unsigned int size;
+	int op;
+
+	while (p < end) {
+		p = traceParseLine(p, &op, &addr, &size);
+		if (op != 0) {
+			w->len += tracePutRecord(w->buf + w->len, op, size, addr, w->prev);
+			w->prev = addr;
+			if (++w->records == TRACE_CHUNK_RECORDS) {
+				flushChunk(w);
+			}
+		}
+		p = (const char*)memchr(p, '\n', end - p) + 1;
+	}
+}
+
+/* Function that writes the header of the trace */
+static void writeHeader(writer_t *w, const trace_header_t *header) {
+	unsigned char buf[TRACE_HEADER_SIZE];
+
+	tracePutHeader(buf, header);
+	if (fwrite(buf, sizeof(buf), 1, w->fp) != 1) {
+		writeFailed(w);
+	}
+}
+
+/* Function that writes the index entry of a chunk */
+static void writeChunk(writer_t *w, const trace_chunk_t *chunk) {
+	unsigned char buf[TRACE_CHUNK_SIZE];
+
+	tracePutChunk(buf, chunk);
+	if (fwrite(buf, sizeof(buf), 1, w->fp) != 1) {
+		writeFailed(w);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	trace_header_t header;
+	writer_t w;
+	uint64_t c;
+	char *buf, *start, *end, *last;
+	size_t carry = 0;
+	uint64_t in_bytes = 0;
+	ssize_t got;
+	int skip = 0;
+	int fd;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <in.trace> <out.ctrace>\n", argv[0]);
+		return 1;
+	}
+	fd = (strcmp(argv[1], "-") == 0) ? STDIN_FILENO : open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.name = argv[2];
+	w.fp = fopen(argv[2], "wb");
+	if (w.fp == NULL) {
+		writeFailed(&w);
+	}
+	w.buf = malloc(TRACE_CHUNK_RECORDS * TRACE_MAX_RECORD);
+	// Room for a partial line in front of each read, and for a '\n' after the last one
+	buf = malloc(MAX_LINE + READ_SIZE + 1);
+	if (w.buf == NULL || buf == NULL) {
+		fprintf(stderr, "%s\n", strerror(ENOMEM));
+		return 1;
+	}
+
+	// The header is rewritten once the index is known
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_SIZE);
+	writeHeader(&w, &header);
+	w.offset = TRACE_HEADER_SIZE;
+	traceInitParser();
+
+	for (;;) {
+		got = read(fd, buf + MAX_LINE, READ_SIZE);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+			return 1;
+		}
+		if (got == 0) {
+			break;
+		}
+		if (in_bytes == 0 && got >= TRACE_MAGIC_SIZE && memcmp(buf + MAX_LINE, TRACE_MAGIC, TRACE_MAGIC_SIZE) == 0) {
+			fprintf(stderr, "%s: already a binary trace\n", argv[1]);
+			return 1;
+		}
+		in_bytes += got;
+
+		start = buf + MAX_LINE - carry;
+		end = buf + MAX_LINE + got;
+		if (skip) {
+			start = memchr(start, '\n', end - start);
+			skip = (start == NULL);
+			start = skip ? end : start + 1;
+		}
+		last = end;
+		while (last > start && last[-1] != '\n') {
+			last--;
+		}
+		convertLines(&w, start, last);
+
+		// Keep the partial last line for the next read; skip lines too long to keep
+		carry = end - last;
+		if (carry > MAX_LINE) {
+			skip = 1;
+			carry = 0;
+		}
+		memmove(buf + MAX_LINE - carry, last, carry);
+	}
+	if (carry != 0 && !skip) {
+		buf[MAX_LINE] = '\n';
+		convertLines(&w, buf + MAX_LINE - carry, buf + MAX_LINE + 1);
+	}
+	flushChunk(&w);
+
+	header.chunks = w.nchunks;
+	header.index = w.offset;
+	for (c = 0; c < w.nchunks; c++) {
+		writeChunk(&w, &w.chunks[c]);
+	}
+	if (fseek(w.fp, 0, SEEK_SET) != 0) {
+		writeFailed(&w);
+	}
+	writeHeader(&w, &header);
+	if (fclose(w.fp) != 0) {
+		writeFailed(&w);
+	}
+
+	fprintf(stderr, "%llu accesses, %llu bytes in, %llu bytes out (%.1fx smaller)\n",
+		(unsigned long long)w.total, (unsigned long long)in_bytes,
+		(unsigned long long)(w.offset + w.nchunks * TRACE_CHUNK_SIZE),
+		(double)in_bytes / (w.offset + w.nchunks * TRACE_CHUNK_SIZE));
+	free(w.chunks);
+	free(w.buf);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,251 @@
+#ifndef CSIM_TRACE_H
+#define CSIM_TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+* Trace formats of the cache simulator
+*
+* Text traces are the output of valgrind --tool=lackey --trace-mem=yes, one
+* access per line:
+*    L 04f6b868,8
+*    S 7ff0005c8,8
+*    M 0421c7f0,4
+*   I  0400d7d4,8
+* A line is an access if its second character is L, S or M; instruction
+* loads and valgrind's own messages are skipped. traceParseLine reads them
+*
+* Binary traces are written by csim-convert (csimConvert.c) and hold the
+* same accesses in a fraction of the space. A trace is a header of
+* TRACE_HEADER_SIZE bytes (trace_header_t), then chunks of records, then an
+* index at header.index of TRACE_CHUNK_SIZE bytes per chunk (trace_chunk_t).
+* Each record is two unsigned LEB128 varints:
+*   (size << 2) | op       op is one of TRACE_LOAD, TRACE_STORE, TRACE_MODIFY
+*   zigzag(addr - prev)    prev is the address of the previous record of
+*                          the chunk, and 0 for its first record
+* Every chunk starts again from address 0, so the index lets chunks be
+* decoded independently, e.g. in parallel. The 64-bit fields of the header
+* and the index are stored little-endian, see tracePutHeader and friends
+*/
+#define TRACE_MAGIC "CSIMTRC1"
+#define TRACE_MAGIC_SIZE 8
+
+#define TRACE_LOAD 1
+#define TRACE_STORE 2
+#define TRACE_MODIFY 3
+
+/* Records per chunk written by csim-convert */
+#define TRACE_CHUNK_RECORDS 65536
+
+/* Longest encoding of a record: two 64-bit varints */
+#define TRACE_MAX_RECORD (2 * 10)
+
+/* Bytes of the header and of each index entry in a file */
+#define TRACE_HEADER_SIZE (TRACE_MAGIC_SIZE + 2 * 8)
+#define TRACE_CHUNK_SIZE (3 * 8)
+
+typedef struct trace_header {
+	char magic[TRACE_MAGIC_SIZE];
+	uint64_t chunks;		// Number of chunks
+	uint64_t index;			// File offset of the index
+} trace_header_t;
+
+typedef struct trace_chunk {
+	uint64_t offset;		// File offset of the first record
+	uint64_t size;			// Bytes of records
+	uint64_t records;		// Number of records
+} trace_chunk_t;
+
+/* Function that stores a 64-bit value little-endian in 8 bytes */
+static inline void tracePutU64(unsigned char *buf, uint64_t value) {
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		buf[i] = (unsigned char)(value >> (8 * i));
+	}
+}
+
+/* Function that loads a 64-bit value stored little-endian in 8 bytes */
+static inline uint64_t traceGetU64(const unsigned char *buf) {
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		value |= (uint64_t)buf[i] << (8 * i);
+	}
+	return value;
+}
+
+/*
+* Functions that encode a header into TRACE_HEADER_SIZE bytes and decode it
+* again; traceGetHeader leaves the magic bytes for the caller to check
+*/
+static inline void tracePutHeader(unsigned char *buf, const trace_header_t *header) {
+	memcpy(buf, header->magic, TRACE_MAGIC_SIZE);
+	tracePutU64(buf + TRACE_MAGIC_SIZE, header->chunks);
+	tracePutU64(buf + TRACE_MAGIC_SIZE + 8, header->index);
+}
+
+static inline void traceGetHeader(const unsigned char *buf, trace_header_t *header) {
+	memcpy(header->magic, buf, TRACE_MAGIC_SIZE);
+	header->chunks = traceGetU64(buf + TRACE_MAGIC_SIZE);
+	header->index = traceGetU64(buf + TRACE_MAGIC_SIZE + 8);
+}
+
+/* Functions that encode an index entry into TRACE_CHUNK_SIZE bytes and decode it again */
+static inline void tracePutChunk(unsigned char *buf, const trace_chunk_t *chunk) {
+	tracePutU64(buf, chunk->offset);
+	tracePutU64(buf + 8, chunk->size);
+	tracePutU64(buf + 16, chunk->records);
+}
+
+static inline void traceGetChunk(const unsigned char *buf, trace_chunk_t *chunk) {
+	chunk->offset = traceGetU64(buf);
+	chunk->size = traceGetU64(buf + 8);
+	chunk->records = traceGetU64(buf + 16);
+}
+
+/* Letter of each op in text traces */
+static const char traceOpName[4] = { 0, 'L', 'S', 'M' };
+
+static unsigned char traceHexDigit[256];	// Value of each hex digit; 0xFF for other bytes
+static unsigned char traceOpCode[256];		// Op of each letter; 0 for lines to skip
+
+/* Function that fills the lookup tables of traceParseLine */
+static inline void traceInitParser() {
+	int i;
+
+	memset(traceHexDigit, 0xFF, sizeof(traceHexDigit));
+	for (i = 0; i < 10; i++) {
+		traceHexDigit['0' + i] = i;
+	}
+	for (i = 0; i < 6; i++) {
+		traceHexDigit['a' + i] = traceHexDigit['A' + i] = 10 + i;
+	}
+	traceOpCode['L'] = TRACE_LOAD;
+	traceOpCode['S'] = TRACE_STORE;
+	traceOpCode['M'] = TRACE_MODIFY;
+}
+
+/*
+* Function that parses one line of a text trace
+* Argument - p: Start of the line, which must end in '\n'
+* Argument - op: Op of the access, or 0 if the line is not one
+* Argument - addr, size: Address and size of the access
+* Returns where parsing stopped, at or before the end of the line
+*/
+static inline const char* traceParseLine(const char *p, int *op, uint64_t *addr, unsigned int *size) {
+	const char *q = p + 2;
+	uint64_t a = 0;
+	unsigned int len = 0;
+	unsigned int d;
+
+	// An empty line has no second character
+	*op = (p[0] != '\n') ? traceOpCode[(unsigned char)p[1]] : 0;
+	if (*op == 0) {
+		return p;
+	}
+	while (*q == ' ') {
+		q++;
+	}
+	// '\n' is neither a hex nor a decimal digit, so neither loop leaves the line
+	while ((d = traceHexDigit[(unsigned char)*q]) < 16) {
+		a = (a << 4) | d;
+		q++;
+	}
+	if (*q == ',') {
+		while ((d = (unsigned char)*++q - '0') < 10) {
+			len = len * 10 + d;
+		}
+	}
+	*addr = a;
+	*size = len;
+	return q;
+}
+
+/*
+* Function that appends a varint to a buffer
+* Argument - buf: Where to write; must have room for 10 bytes
+* Argument - value: Value to encode
+* Returns the number of bytes written
+*/
+static inline int tracePutVarint(unsigned char *buf, uint64_t value) {
+	int n = 0;
+
+	while (value >= 0x80) {
+		buf[n++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	buf[n++] = (unsigned char)value;
+	return n;
+}
+
+/*
+* Function that reads a varint from a buffer
+* Argument - pos: Read position, advanced past the varint
+* Argument - end: End of the buffer
+* Argument - value: Decoded value
+* Returns 0 on success and -1 if the varint is cut off or too long
+*/
+static inline int traceGetVarint(const unsigned char **pos, const unsigned char *end, uint64_t *value) {
+	const unsigned char *p = *pos;
+	uint64_t v = 0;
+	int shift;
+
+	// Most varints of a record are a single byte
+	if (p < end && *p < 0x80) {
+		*value = *p;
+		*pos = p + 1;
+		return 0;
+	}
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		v |= (uint64_t)(*p & 0x7F) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*pos = p;
+			*value = v;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+* Function that encodes one record
+* Argument - buf: Where to write; must have room for TRACE_MAX_RECORD bytes
+* Argument - op: One of the TRACE_* ops
+* Argument - size: Size of the access
+* Argument - addr: Address of the access
+* Argument - prev: Address of the previous record of the chunk, or 0
+* Returns the number of bytes written
+*/
+static inline int tracePutRecord(unsigned char *buf, int op, unsigned int size, uint64_t addr, uint64_t prev) {
+	int64_t delta = (int64_t)(addr - prev);
+	int n;
+
+	n = tracePutVarint(buf, ((uint64_t)size << 2) | (uint64_t)op);
+	n += tracePutVarint(buf + n, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	return n;
+}
+
+/*
+* Function that decodes one record
+* Argument - pos: Read position, advanced past the record
+* Argument - end: End of the chunk
+* Argument - op, size: Op and size of the access
+* Argument - addr: Address of the previous record on entry, of this one on return
+* Returns 0 on success and -1 if the record is cut off or has no valid op
+*/
+static inline int traceGetRecord(const unsigned char **pos, const unsigned char *end, int *op, unsigned int *size, uint64_t *addr) {
+	uint64_t head, zigzag;
+
+	if (traceGetVarint(pos, end, &head) != 0 || traceGetVarint(pos, end, &zigzag) != 0 || (head & 3) == 0) {
+		return -1;
+	}
+	*op = (int)(head & 3);
+	*size = (unsigned int)(head >> 2);
+	*addr += (zigzag >> 1) ^ (0 - (zigzag & 1));
+	return 0;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef MEM_ALLOCATOR_HPP
+#define MEM_ALLOCATOR_HPP
+
+/*
+* C++ adapters for the allocator implemented in memLibrary.c
+*
+* mem::Allocator<T> meets the standard Allocator requirements, so it can be
+* handed to any standard container:
+*   std::map<int, int, std::less<int>, mem::Allocator<std::pair<const int, int>>> m;
+* mem::MemoryResource is a std::pmr::memory_resource on the same heap:
+*   std::pmr::list<int> l(mem::resource());
+*
+* Mem_Init must have been called before either allocates; both throw
+* std::bad_alloc when the allocator returns NULL
+*
+* Containers of nodes allocate one node at a time, and the node type is
+* known at compile time, so such allocations are routed straight to their
+* size class with Mem_AllocClass. Arrays and the memory resource, whose
+* sizes are only known at run time, go through Mem_Alloc
+*
+* Requires C++17
+*/
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+#include "memLibrary.h"
+
+namespace mem {
+
+/*
+* Function that allocates Size bytes aligned to Align, picking the path at
+* compile time: the size class of small blocks, Mem_Alloc for larger ones,
+* and Mem_AlignedAlloc for alignments beyond MEM_ALIGNMENT
+* Returns the payload address, or nullptr on failure
+*/
+template <std::size_t Size, std::size_t Align = MEM_ALIGNMENT>
+inline void* allocFixed() {
+	if constexpr (Align > MEM_ALIGNMENT) {
+		return Mem_AlignedAlloc(Align, Size);
+	}
+	else if constexpr (MEM_SIZE_CLASS(Size) != 0) {
+		return Mem_AllocClass(MEM_SIZE_CLASS(Size));
+	}
+	else {
+		return Mem_Alloc(Size);
+	}
+}
+
+/*
+* Function that allocates n objects of type T
+* A single object takes the compile time path of allocFixed
+* Throws std::bad_alloc on failure or if the size overflows
+*/
+template <class T>
+inline T* allocObjects(std::size_t n) {
+	void *ptr;
+
+	if (n == 1) {
+		ptr = allocFixed<sizeof(T), alignof(T)>();
+	}
+	else if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+		throw std::bad_array_new_length();
+	}
+	else if constexpr (alignof(T) > MEM_ALIGNMENT) {
+		ptr = Mem_AlignedAlloc(alignof(T), n * sizeof(T));
+	}
+	else {
+		//Mem_Alloc returns NULL for 0 bytes; an empty array still needs an address
+		ptr = Mem_Alloc(n != 0 ? n * sizeof(T) : 1);
+	}
+	if (ptr == nullptr) {
+		throw std::bad_alloc();
+	}
+	return static_cast<T*>(ptr);
+}
+
+/*
+* Standard allocator on top of the Mem_* calls
+* It is stateless: every instance allocates from the same heap, so any
+* instance can free what another one allocated
+*/
+template <class T>
+class Allocator {
+public:
+	using value_type = T;
+	using is_always_equal = std::true_type;
+
+	Allocator() noexcept = default;
+
+	template <class U>
+	Allocator(const Allocator<U>&) noexcept {}
+
+	T* allocate(std::size_t n) {
+		return allocObjects<T>(n);
+	}
+
+	void deallocate(T *ptr, std::size_t) noexcept {
+		Mem_Free(ptr);
+	}
+};
+
+template <class T, class U>
+inline bool operator==(const Allocator<T>&, const Allocator<U>&) noexcept {
+	return true;
+}
+
+template <class T, class U>
+inline bool operator!=(const Allocator<T>&, const Allocator<U>&) noexcept {
+	return false;
+}
+
+/*
+* Memory resource on top of the Mem_* calls, for the std::pmr containers
+* Every instance allocates from the same heap, so all of them compare equal
+*/
+class MemoryResource : public std::pmr::memory_resource {
+protected:
+	void* do_allocate(std::size_t bytes, std::size_t align) override {
+		void *ptr;
+
+		if (align > MEM_ALIGNMENT) {
+			ptr = Mem_AlignedAlloc(align, bytes != 0 ? bytes : 1);
+		}
+		else {
+			ptr = Mem_Alloc(bytes != 0 ? bytes : 1);
+		}
+		if (ptr == nullptr) {
+			throw std::bad_alloc();
+		}
+		return ptr;
+	}
+
+	void do_deallocate(void *ptr, std::size_t, std::size_t) override {
+		Mem_Free(ptr);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+		return dynamic_cast<const MemoryResource*>(&other) != nullptr;
+	}
+};
+
+/* Function that returns a memory resource shared by the whole program */
+inline MemoryResource* resource() noexcept {
+	static MemoryResource shared;
+	return &shared;
+}
+
+}
+
+#endif
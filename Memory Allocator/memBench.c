@@ -0,0 +1,1115 @@
+/*
+* memBench.c - Micro benchmarks for the allocator in memLibrary.c
+*
+* Build:
+*   gcc -O2 -pthread -DMEM_LIBRARY_ONLY memLibrary.c memBench.c -o memBench
+*
+* Usage: memBench <benchmark> [args]
+*   latency         Allocation latency as the number of live blocks grows
+*   threads [N]     Random alloc/free throughput from 1 to N threads (default 8)
+*   remote [P]      P producer/consumer pairs (default 2) with and without
+*                   the lock-free remote free queues
+*   realloc [V]     V growing vectors (default 4), bytes copied with
+*                   alloc+copy+free and with Mem_Realloc
+*   request         Request-scoped objects freed one by one against a
+*                   Mem_Arena reset after every request
+*   batch [N]       Batches of N same-sized nodes (default 256), single
+*                   calls against Mem_AllocBatch/Mem_FreeBatch
+*   trim            Resident set after a burst, after freeing it, and after
+*                   Mem_Trim and the background trim thread
+*   tlb [huge]      Random walk over a large heap, with huge pages if asked;
+*                   reports dTLB misses where perf counters are available
+*   sample          Random alloc/free cost at several sampling intervals,
+*                   and the live bytes the profile estimates
+*   shared [P]      1 to P processes (default 4) allocating from one shared
+*                   heap, then a process killed in the middle of its work
+*   extents [N]     Best fit allocation latency as the number of free large
+*                   extents grows to N (default 64000)
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "memLibrary.h"
+
+#define HEAP_SIZE (64 * 1024 * 1024)
+#define MAX_LIVE 32000
+#define BATCH 64
+#define ROUNDS 200
+
+#define THREAD_OPS 1000000
+#define THREAD_SLOTS 1024
+
+#define RING_SIZE 1024
+#define PIPE_ITEMS 500000
+
+#define VEC_MAX_VECS 64
+#define VEC_TARGET (1024 * 1024)
+#define VEC_ROUNDS 20
+
+#define REQ_OBJECTS_MAX 4096
+#define REQ_TOTAL (1 << 23)
+
+#define BATCH_MAX 65536
+#define BATCH_TOTAL (1 << 22)
+
+#define TRIM_BLOCKS 100000
+#define TRIM_KEEP 64
+#define TRIM_INTERVAL_MS 100
+
+#define TLB_NODES (4 * 1024 * 1024)
+#define TLB_STEPS (32 * 1024 * 1024)
+
+#define SAMPLE_SLOTS 16384
+#define SAMPLE_OPS (8 * 1024 * 1024)
+
+#define SHARED_PATH "/dev/shm/memBench.heap"
+#define SHARED_SIZE (64 * 1024 * 1024)
+#define SHARED_SLOTS 4096
+#define SHARED_OPS (1024 * 1024)
+
+#define EXTENT_MIN 520
+#define EXTENT_MAX 2560
+#define EXTENT_SEPARATOR 520	//Too large for the thread cache, so it lands right after its extent
+#define EXTENT_OPS 20000
+#define EXTENTS_MAX (1 << 18)
+
+/* Function that returns a monotonic timestamp in nanoseconds */
+static double nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Function that times ROUNDS batches of allocations of lo..hi bytes
+* Every batch is freed again untimed
+* Returns the average latency of one Mem_Alloc call in nanoseconds
+*/
+static double timeAllocs(int lo, int hi) {
+	void *batch[BATCH];
+	double start;
+	double total = 0;
+	int r, j;
+
+	for (r = 0; r < ROUNDS; r++) {
+		start = nowNs();
+		for (j = 0; j < BATCH; j++) {
+			batch[j] = Mem_Alloc(lo + rand() % (hi - lo + 1));
+		}
+		total += nowNs() - start;
+		for (j = BATCH - 1; j >= 0; j--) {
+			Mem_Free(batch[j]);
+		}
+	}
+	return total / (ROUNDS * BATCH);
+}
+
+/*
+* latency - Grows the number of live blocks step by step and measures the
+* average Mem_Alloc latency at every step
+* Every step allocates some extra blocks and frees them again in random
+* order, so the heap holds small free holes as well
+* - small: requests of the same sizes as the live blocks
+* - large: requests no hole can satisfy
+*/
+static int benchLatency() {
+	static void *live[MAX_LIVE + MAX_LIVE / 4];
+	int nlive = 0;
+	int target;
+	int i;
+
+	if (Mem_Init(HEAP_SIZE) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+	srand(354);
+
+	printf("%12s %12s %12s\n", "live blocks", "small ns", "large ns");
+	for (target = 1000; target <= MAX_LIVE; target *= 2) {
+		//Grow the live set, then punch random holes into it
+		while (nlive < target + target / 4) {
+			if ((live[nlive] = Mem_Alloc(rand() % 128 + 1)) == NULL) {
+				fprintf(stderr, "heap exhausted at %d live blocks\n", nlive);
+				return 1;
+			}
+			nlive++;
+		}
+		while (nlive > target) {
+			i = rand() % nlive;
+			Mem_Free(live[i]);
+			live[i] = live[--nlive];
+		}
+
+		printf("%12d %12.1f", target, timeAllocs(1, 128));
+		printf(" %12.1f\n", timeAllocs(1024, 4088));
+	}
+	return 0;
+}
+
+/*
+* Worker of the threads benchmark
+* Picks a random slot THREAD_OPS times; frees the slot if it holds a block,
+* otherwise allocates a mostly small block into it
+* Argument - arg: Seed for rand_r
+*/
+static void* threadWorker(void *arg) {
+	void *slots[THREAD_SLOTS];
+	unsigned int seed = (unsigned int)(size_t)arg;
+	int i, op, size;
+
+	memset(slots, 0, sizeof(slots));
+	for (op = 0; op < THREAD_OPS; op++) {
+		i = rand_r(&seed) % THREAD_SLOTS;
+		if (slots[i] != NULL) {
+			Mem_Free(slots[i]);
+			slots[i] = NULL;
+		}
+		else {
+			size = (rand_r(&seed) % 10 == 0) ? rand_r(&seed) % 4088 + 1 : rand_r(&seed) % 256 + 1;
+			slots[i] = Mem_Alloc(size);
+		}
+	}
+
+	for (i = 0; i < THREAD_SLOTS; i++) {
+		if (slots[i] != NULL) {
+			Mem_Free(slots[i]);
+		}
+	}
+	return NULL;
+}
+
+/*
+* threads - Runs threadWorker on 1 to max_threads threads at once and
+* reports the total throughput and the speedup over a single thread
+*/
+static int benchThreads(int max_threads) {
+	pthread_t *tids;
+	double start, elapsed, mops, base = 0;
+	int t, i;
+
+	if (Mem_Init(HEAP_SIZE) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+	tids = malloc(sizeof(pthread_t) * max_threads);
+
+	printf("%8s %12s %10s\n", "threads", "Mops/s", "speedup");
+	for (t = 1; t <= max_threads; t++) {
+		start = nowNs();
+		for (i = 0; i < t; i++) {
+			pthread_create(&tids[i], NULL, threadWorker, (void*)(size_t)(i + 1));
+		}
+		for (i = 0; i < t; i++) {
+			pthread_join(tids[i], NULL);
+		}
+		elapsed = nowNs() - start;
+
+		mops = (double)t * THREAD_OPS / elapsed * 1e3;
+		if (t == 1) {
+			base = mops;
+		}
+		printf("%8d %12.2f %10.2f\n", t, mops, mops / base);
+	}
+
+	free(tids);
+	return 0;
+}
+
+/*
+* Ring of buffers handed from one producer to one consumer
+* A NULL slot is empty; the producer fills slots in order, the consumer
+* empties them in the same order
+*/
+typedef struct pipe {
+	_Atomic(void *) slots[RING_SIZE];
+	double free_ns;		//Time the consumer spent in Mem_Free
+} pipe_t;
+
+/* Producer: allocates buffers too big for the thread cache and sends them off */
+static void* pipeProducer(void *arg) {
+	pipe_t *p = (pipe_t*)arg;
+	unsigned int seed = (unsigned int)(size_t)p;
+	void *buf;
+	int n;
+
+	for (n = 0; n < PIPE_ITEMS; n++) {
+		while ((buf = Mem_Alloc(512 + rand_r(&seed) % 3577)) == NULL) {
+			sched_yield();
+		}
+		*(int*)buf = n;
+
+		while (atomic_load_explicit(&p->slots[n % RING_SIZE], memory_order_acquire) != NULL) {
+			sched_yield();
+		}
+		atomic_store_explicit(&p->slots[n % RING_SIZE], buf, memory_order_release);
+	}
+	return NULL;
+}
+
+/* Consumer: receives buffers and frees them, timing every Mem_Free */
+static void* pipeConsumer(void *arg) {
+	pipe_t *p = (pipe_t*)arg;
+	void *buf;
+	double start;
+	int n;
+
+	p->free_ns = 0;
+	for (n = 0; n < PIPE_ITEMS; n++) {
+		while ((buf = atomic_load_explicit(&p->slots[n % RING_SIZE], memory_order_acquire)) == NULL) {
+			sched_yield();
+		}
+		atomic_store_explicit(&p->slots[n % RING_SIZE], NULL, memory_order_relaxed);
+
+		start = nowNs();
+		Mem_Free(buf);
+		p->free_ns += nowNs() - start;
+	}
+	return NULL;
+}
+
+/*
+* remote - Runs pairs of producer/consumer threads, where every buffer is
+* freed by a different thread than the one that allocated it
+* The run is done once with the remote free queues off (the consumer
+* takes the producer's arena lock) and once with them on
+*/
+static int benchRemote(int pairs) {
+	pipe_t *pipes;
+	pthread_t *tids;
+	double start, elapsed, free_ns;
+	int remote, i;
+
+	if (Mem_Init(HEAP_SIZE) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+	pipes = calloc(pairs, sizeof(pipe_t));
+	tids = malloc(sizeof(pthread_t) * 2 * pairs);
+
+	printf("%8s %12s %12s %14s\n", "remote", "time ms", "Mops/s", "ns/Mem_Free");
+	for (remote = 0; remote <= 1; remote++) {
+		Mem_SetOption(MEM_OPT_REMOTE_FREE, remote);
+
+		start = nowNs();
+		for (i = 0; i < pairs; i++) {
+			pthread_create(&tids[2 * i], NULL, pipeProducer, &pipes[i]);
+			pthread_create(&tids[2 * i + 1], NULL, pipeConsumer, &pipes[i]);
+		}
+		free_ns = 0;
+		for (i = 0; i < pairs; i++) {
+			pthread_join(tids[2 * i], NULL);
+			pthread_join(tids[2 * i + 1], NULL);
+			free_ns += pipes[i].free_ns;
+		}
+		elapsed = nowNs() - start;
+
+		printf("%8s %12.1f %12.2f %14.1f\n", remote ? "on" : "off", elapsed / 1e6,
+			(double)pairs * PIPE_ITEMS / elapsed * 1e3, free_ns / ((double)pairs * PIPE_ITEMS));
+	}
+
+	free(tids);
+	free(pipes);
+	return 0;
+}
+
+/*
+* A growing array of bytes, like a std::vector<char> or a string builder
+*/
+typedef struct vec {
+	char *data;
+	size_t len;
+	size_t cap;
+} vec_t;
+
+/*
+* Function that appends n bytes to a vector, growing it if it is full
+* Argument - use_realloc: Grow with Mem_Realloc rather than alloc+copy+free
+* Argument - step: 0 grows the capacity by half, otherwise by step bytes
+* Argument - copied: Incremented by the number of payload bytes moved
+* Returns 0 on success and -1 if the heap is exhausted
+*/
+static int vecAppend(vec_t *v, size_t n, int use_realloc, size_t step, size_t *copied) {
+	size_t cap;
+	char *data;
+
+	if (v->len + n > v->cap) {
+		cap = step ? v->cap + step : v->cap + v->cap / 2 + 16;
+		if (cap < v->len + n) {
+			cap = v->len + n;
+		}
+
+		if (use_realloc) {
+			data = Mem_Realloc(v->data, cap);
+			if (data == NULL) {
+				return -1;
+			}
+			//Mem_Realloc only moves the payload when it could not resize in place
+			if (data != v->data) {
+				*copied += v->len;
+			}
+		}
+		else {
+			data = Mem_Alloc(cap);
+			if (data == NULL) {
+				return -1;
+			}
+			memcpy(data, v->data, v->len);
+			*copied += v->len;
+			Mem_Free(v->data);
+		}
+		v->data = data;
+		v->cap = cap;
+	}
+
+	memset(v->data + v->len, (int)v->len, n);
+	v->len += n;
+	return 0;
+}
+
+/*
+* realloc - Grows nvecs vectors side by side to VEC_TARGET bytes each,
+* appending a few bytes at a time, then frees them; VEC_ROUNDS times
+* Every run is done with alloc+copy+free and with Mem_Realloc, once with
+* the capacity growing by half and once by a fixed 4 KB
+* The mmap threshold is raised so all vectors stay in the heap, where every
+* move is a real copy
+*/
+static int benchRealloc(int nvecs) {
+	static vec_t vecs[VEC_MAX_VECS];
+	static const size_t steps[2] = { 0, 4096 };
+	double start, elapsed;
+	size_t copied;
+	int use_realloc, s, r, i, done;
+
+	if (nvecs < 1 || nvecs > VEC_MAX_VECS) {
+		fprintf(stderr, "between 1 and %d vectors\n", VEC_MAX_VECS);
+		return 1;
+	}
+	if (Mem_Init(HEAP_SIZE) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+	Mem_SetOption(MEM_OPT_MMAP_THRESHOLD, 16 * 1024 * 1024);
+	srand(354);
+
+	printf("%8s %14s %12s %14s\n", "growth", "method", "time ms", "MB copied");
+	for (s = 0; s < 2; s++) {
+		for (use_realloc = 0; use_realloc <= 1; use_realloc++) {
+			copied = 0;
+			start = nowNs();
+			for (r = 0; r < VEC_ROUNDS; r++) {
+				memset(vecs, 0, sizeof(vecs));
+
+				//Append to the vectors in random order until all are full
+				for (done = 0; done < nvecs; ) {
+					i = rand() % nvecs;
+					if (vecs[i].len >= VEC_TARGET) {
+						continue;
+					}
+					if (vecAppend(&vecs[i], rand() % 64 + 1, use_realloc, steps[s], &copied) == -1) {
+						fprintf(stderr, "heap exhausted\n");
+						return 1;
+					}
+					if (vecs[i].len >= VEC_TARGET) {
+						done++;
+					}
+				}
+				for (i = 0; i < nvecs; i++) {
+					Mem_Free(vecs[i].data);
+				}
+			}
+			elapsed = nowNs() - start;
+
+			printf("%8s %14s %12.1f %14.1f\n", steps[s] ? "+4 KB" : "x1.5",
+				use_realloc ? "Mem_Realloc" : "alloc+copy", elapsed / 1e6, copied / 1e6);
+		}
+	}
+	return 0;
+}
+
+/*
+* Function that serves one simulated request: allocates n objects of the
+* given sizes, links them into a list and walks it
+* Argument - arena: Arena to allocate from, NULL for Mem_Alloc
+* Argument - objs: Where the objects are recorded for Mem_Free
+* Returns the checksum of the walk, or -1 if the heap is exhausted
+*/
+static long serveRequest(Mem_Arena *arena, void **objs, const int *sizes, int n) {
+	void **prev = NULL;
+	void **obj;
+	long sum = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		obj = arena ? Mem_ArenaAlloc(arena, sizes[i]) : Mem_Alloc(sizes[i]);
+		if (obj == NULL) {
+			return -1;
+		}
+		obj[0] = prev;
+		obj[1] = (void*)(long)sizes[i];
+		objs[i] = obj;
+		prev = obj;
+	}
+	for (obj = prev; obj != NULL; obj = obj[0]) {
+		sum += (long)obj[1];
+	}
+	return sum;
+}
+
+/*
+* request - Serves requests that each allocate n small objects (16 to 256
+* bytes) and drop them all at the end, for n from 16 to REQ_OBJECTS_MAX
+* The objects are freed one by one with Mem_Free, or all at once with
+* Mem_ArenaReset on an arena that lives across requests
+*/
+static int benchRequest() {
+	static void *objs[REQ_OBJECTS_MAX];
+	static int sizes[REQ_OBJECTS_MAX];
+	Mem_Arena *arena;
+	double start, elapsed[2];
+	int n, i, r, rounds, use_arena;
+
+	if (Mem_Init(HEAP_SIZE) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+	arena = Mem_ArenaCreate(0);
+	if (arena == NULL) {
+		fprintf(stderr, "Mem_ArenaCreate failed\n");
+		return 1;
+	}
+	srand(354);
+	for (i = 0; i < REQ_OBJECTS_MAX; i++) {
+		sizes[i] = 16 + rand() % 241;
+	}
+
+	printf("%10s %16s %16s %8s\n", "objects", "Mem_Free ns/obj", "arena ns/obj", "speedup");
+	for (n = 16; n <= REQ_OBJECTS_MAX; n *= 4) {
+		rounds = REQ_TOTAL / n;
+		for (use_arena = 0; use_arena <= 1; use_arena++) {
+			start = nowNs();
+			for (r = 0; r < rounds; r++) {
+				if (serveRequest(use_arena ? arena : NULL, objs, sizes, n) == -1) {
+					fprintf(stderr, "heap exhausted\n");
+					return 1;
+				}
+				if (use_arena) {
+					Mem_ArenaReset(arena);
+				}
+				else {
+					for (i = 0; i < n; i++) {
+						Mem_Free(objs[i]);
+					}
+				}
+			}
+			elapsed[use_arena] = nowNs() - start;
+		}
+		printf("%10d %16.1f %16.1f %7.1fx\n", n, elapsed[0] / REQ_TOTAL, elapsed[1] / REQ_TOTAL,
+			elapsed[0] / elapsed[1]);
+	}
+
+	Mem_ArenaDestroy(arena);
+	return 0;
+}
+
+/*
+* batch - Allocates batches of n nodes of the same size and frees them in
+* random order, the way a pipeline stage hands its nodes on
+* Every batch is done with loops of Mem_Alloc/Mem_Free and with
+* Mem_AllocBatch/Mem_FreeBatch, for small nodes that fit the thread cache
+* and for larger ones that do not
+*/
+static int benchBatch(int n) {
+	static void *ptrs[BATCH_MAX];
+	static const size_t node_sizes[2] = { 48, 1024 };
+	double start, alloc_ns[2], free_ns[2];
+	size_t size;
+	void *tmp;
+	int s, use_batch, r, rounds, i, j;
+
+	if (n < 1 || n > BATCH_MAX) {
+		fprintf(stderr, "between 1 and %d nodes\n", BATCH_MAX);
+		return 1;
+	}
+	if (Mem_Init(HEAP_SIZE) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+	srand(354);
+	rounds = BATCH_TOTAL / n > 0 ? BATCH_TOTAL / n : 1;
+
+	printf("%8s %8s %16s %16s %16s %16s\n", "size", "nodes", "alloc loop ns", "AllocBatch ns",
+		"free loop ns", "FreeBatch ns");
+	for (s = 0; s < 2; s++) {
+		size = node_sizes[s];
+		for (use_batch = 0; use_batch <= 1; use_batch++) {
+			alloc_ns[use_batch] = 0;
+			free_ns[use_batch] = 0;
+			for (r = 0; r < rounds; r++) {
+				start = nowNs();
+				if (use_batch) {
+					if (Mem_AllocBatch(size, n, ptrs) != (size_t)n) {
+						fprintf(stderr, "heap exhausted\n");
+						return 1;
+					}
+				}
+				else {
+					for (i = 0; i < n; i++) {
+						if ((ptrs[i] = Mem_Alloc(size)) == NULL) {
+							fprintf(stderr, "heap exhausted\n");
+							return 1;
+						}
+					}
+				}
+				alloc_ns[use_batch] += nowNs() - start;
+
+				//The nodes come back in no particular order
+				for (i = n - 1; i > 0; i--) {
+					j = rand() % (i + 1);
+					tmp = ptrs[i];
+					ptrs[i] = ptrs[j];
+					ptrs[j] = tmp;
+				}
+
+				start = nowNs();
+				if (use_batch) {
+					Mem_FreeBatch(ptrs, n);
+				}
+				else {
+					for (i = 0; i < n; i++) {
+						Mem_Free(ptrs[i]);
+					}
+				}
+				free_ns[use_batch] += nowNs() - start;
+			}
+		}
+		printf("%8zu %8d %16.1f %16.1f %16.1f %16.1f\n", size, n,
+			alloc_ns[0] / ((double)rounds * n), alloc_ns[1] / ((double)rounds * n),
+			free_ns[0] / ((double)rounds * n), free_ns[1] / ((double)rounds * n));
+	}
+	return 0;
+}
+
+/*
+* Function that reads a field of /proc/self/status or smaps_rollup in KB
+* Argument - file: File to read
+* Argument - field: Name of the field, colon included
+* Returns the value, or -1 if the field is missing
+*/
+static long procKb(const char *file, const char *field) {
+	char line[256];
+	long kb = -1;
+	FILE *f = fopen(file, "r");
+
+	if (f == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, field, strlen(field)) == 0) {
+			kb = atol(line + strlen(field));
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+/*
+* Function that fills the heap with a burst of blocks of 64 bytes to 4 KB
+* and frees all but every TRIM_KEEP-th of them, which stay scattered over
+* the heap
+* Argument - blocks: Where the blocks are recorded
+* Returns 0 on success and -1 if the heap is exhausted
+*/
+static int trimBurst(char **blocks) {
+	int i;
+
+	for (i = 0; i < TRIM_BLOCKS; i++) {
+		blocks[i] = Mem_Alloc(64 + rand() % 4033);
+		if (blocks[i] == NULL) {
+			return -1;
+		}
+		memset(blocks[i], 1, 64);
+	}
+	printf("%-28s %8ld MB\n", "after the burst", procKb("/proc/self/status", "VmRSS:") / 1024);
+
+	for (i = 0; i < TRIM_BLOCKS; i++) {
+		if (i % TRIM_KEEP != 0) {
+			Mem_Free(blocks[i]);
+		}
+	}
+	printf("%-28s %8ld MB\n", "after freeing it", procKb("/proc/self/status", "VmRSS:") / 1024);
+	return 0;
+}
+
+/*
+* trim - Shows how much of a burst's footprint Mem_Trim gives back, once
+* called by hand and once from the trim thread
+*/
+static int benchTrim() {
+	static char *blocks[TRIM_BLOCKS];
+	double start;
+	size_t released;
+	int i;
+
+	if (Mem_Init(HEAP_SIZE) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+	srand(354);
+
+	printf("%-28s %8ld MB\n", "at start", procKb("/proc/self/status", "VmRSS:") / 1024);
+	if (trimBurst(blocks) != 0) {
+		fprintf(stderr, "heap exhausted\n");
+		return 1;
+	}
+	start = nowNs();
+	released = Mem_Trim();
+	printf("%-28s %8ld MB  (%zu MB released in %.2f ms)\n", "after Mem_Trim",
+		procKb("/proc/self/status", "VmRSS:") / 1024, released >> 20, (nowNs() - start) / 1e6);
+
+	//Give the survivors back too and start over, this time with the trim thread
+	for (i = 0; i < TRIM_BLOCKS; i += TRIM_KEEP) {
+		Mem_Free(blocks[i]);
+	}
+	if (trimBurst(blocks) != 0) {
+		fprintf(stderr, "heap exhausted\n");
+		return 1;
+	}
+	Mem_SetOption(MEM_OPT_TRIM_INTERVAL, TRIM_INTERVAL_MS);
+	usleep(3 * TRIM_INTERVAL_MS * 1000);
+	printf("%-28s %8ld MB\n", "after the trim thread ran", procKb("/proc/self/status", "VmRSS:") / 1024);
+	Mem_SetOption(MEM_OPT_TRIM_INTERVAL, 0);
+	return 0;
+}
+
+/*
+* Function that opens a counter of the data TLB misses of this thread
+* Returns the descriptor, or -1 if there are no perf counters
+*/
+static int openTlbCounter() {
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+/*
+* tlb - Links TLB_NODES small blocks into one random cycle and follows it
+* for TLB_STEPS steps; nearly every step lands on another page
+* Argument - huge: Back the heap with transparent huge pages
+*/
+static int benchTlb(int huge) {
+	void ***nodes;
+	void **node;
+	void **tmp;
+	double start, elapsed;
+	uint64_t misses = 0;
+	int fd;
+	long i, j;
+
+	nodes = malloc(TLB_NODES * sizeof(void**));
+	if (nodes == NULL) {
+		return 1;
+	}
+	Mem_SetOption(MEM_OPT_HUGE_PAGES, huge);
+	if (Mem_Init((size_t)TLB_NODES * 64) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+	srand(354);
+
+	for (i = 0; i < TLB_NODES; i++) {
+		nodes[i] = Mem_Alloc(48);
+		if (nodes[i] == NULL) {
+			fprintf(stderr, "heap exhausted\n");
+			return 1;
+		}
+	}
+	for (i = TLB_NODES - 1; i > 0; i--) {
+		j = ((long)rand() * RAND_MAX + rand()) % (i + 1);
+		tmp = nodes[i];
+		nodes[i] = nodes[j];
+		nodes[j] = tmp;
+	}
+	for (i = 0; i < TLB_NODES; i++) {
+		*nodes[i] = nodes[(i + 1) % TLB_NODES];
+	}
+
+	fd = openTlbCounter();
+	if (fd != -1) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	start = nowNs();
+	for (node = nodes[0], i = 0; i < TLB_STEPS; i++) {
+		node = *node;
+	}
+	elapsed = nowNs() - start;
+	if (fd != -1) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+			misses = 0;
+		}
+		close(fd);
+	}
+
+	printf("huge pages %s: %.1f ns/step, AnonHugePages %ld MB, ", huge ? "on" : "off",
+		elapsed / TLB_STEPS + (node == NULL), procKb("/proc/self/smaps_rollup", "AnonHugePages:") / 1024);
+	if (fd != -1) {
+		printf("%.3f dTLB misses/step\n", (double)misses / TLB_STEPS);
+	}
+	else {
+		printf("dTLB misses n/a (no perf counters)\n");
+	}
+	return 0;
+}
+
+/*
+* sample - Random alloc/free of 16 to 1024 bytes over SAMPLE_SLOTS slots,
+* with the profiler off and at shrinking sampling intervals
+* Compares the live bytes of the heap profile with the real ones
+*/
+static int benchSample() {
+	static const long intervals[] = { 0, 1024 * 1024, 512 * 1024, 64 * 1024, 8 * 1024 };
+	static void *slots[SAMPLE_SLOTS];
+	static size_t sizes[SAMPLE_SLOTS];
+	size_t live_objs, live_bytes, alloc_objs, alloc_bytes, real_bytes;
+	double start, elapsed;
+	char line[256];
+	FILE *profile;
+	unsigned seed;
+	size_t t;
+	long i;
+	int k;
+
+	if (Mem_Init(HEAP_SIZE) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+
+	printf("%12s %10s %14s %14s\n", "interval", "ns/op", "live bytes", "profiled");
+	for (t = 0; t < sizeof(intervals) / sizeof(intervals[0]); t++) {
+		Mem_SetOption(MEM_OPT_SAMPLE_INTERVAL, intervals[t]);
+		seed = 354;
+		real_bytes = 0;
+		start = nowNs();
+		for (i = 0; i < SAMPLE_OPS; i++) {
+			k = rand_r(&seed) % SAMPLE_SLOTS;
+			if (slots[k] != NULL) {
+				Mem_Free(slots[k]);
+				real_bytes -= sizes[k];
+				slots[k] = NULL;
+			}
+			else {
+				sizes[k] = 16 + rand_r(&seed) % 1009;
+				if ((slots[k] = Mem_Alloc(sizes[k])) == NULL) {
+					fprintf(stderr, "heap exhausted\n");
+					return 1;
+				}
+				real_bytes += sizes[k];
+			}
+		}
+		elapsed = nowNs() - start;
+
+		//The first line of the heap profile has the totals
+		live_bytes = 0;
+		profile = tmpfile();
+		if (intervals[t] != 0 && profile != NULL && Mem_ProfileDump(profile, MEM_PROFILE_PPROF) == 0) {
+			rewind(profile);
+			if (fgets(line, sizeof(line), profile) == NULL ||
+				sscanf(line, "heap profile: %zu: %zu [%zu: %zu]", &live_objs, &live_bytes, &alloc_objs, &alloc_bytes) != 4) {
+				live_bytes = 0;
+			}
+		}
+		if (profile != NULL) {
+			fclose(profile);
+		}
+
+		//Start the next interval from an empty heap and profile
+		for (k = 0; k < SAMPLE_SLOTS; k++) {
+			Mem_Free(slots[k]);
+			slots[k] = NULL;
+		}
+		if (intervals[t] == 0) {
+			printf("%12s %10.1f %14zu %14s\n", "off", elapsed / SAMPLE_OPS, real_bytes, "-");
+		}
+		else {
+			printf("%12ld %10.1f %14zu %14zu\n", intervals[t], elapsed / SAMPLE_OPS, real_bytes, live_bytes);
+		}
+	}
+	return 0;
+}
+
+/* Root object of the shared heap */
+typedef struct shared_root {
+	atomic_long ops;		//Operations done by all processes so far
+} shared_root;
+
+/*
+* Function run by a process of the shared benchmark: attaches to the heap
+* and does random alloc/free of 16 to 1024 bytes, SHARED_OPS times or
+* forever if ops is negative
+* Returns the exit status of the process
+*/
+static int sharedWorker(unsigned seed, long ops) {
+	static void *slots[SHARED_SLOTS];
+	shared_root *root;
+	long i;
+	int k;
+
+	if (Mem_InitShared(SHARED_PATH, 0) == -1 || (root = Mem_SharedRoot()) == NULL) {
+		return 1;
+	}
+	for (i = 0; ops < 0 || i < ops; i++) {
+		k = rand_r(&seed) % SHARED_SLOTS;
+		if (slots[k] != NULL) {
+			Mem_Free(slots[k]);
+			slots[k] = NULL;
+		}
+		else if ((slots[k] = Mem_Alloc(16 + rand_r(&seed) % 1009)) == NULL) {
+			return 1;
+		}
+		atomic_fetch_add_explicit(&root->ops, 1, memory_order_relaxed);
+	}
+	for (k = 0; k < SHARED_SLOTS; k++) {
+		Mem_Free(slots[k]);
+	}
+	return 0;
+}
+
+/* Function that forks a process running sharedWorker; returns its pid */
+static pid_t sharedSpawn(unsigned seed, long ops) {
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		_exit(sharedWorker(seed, ops));
+	}
+	return pid;
+}
+
+/*
+* shared - A heap in a file under /dev/shm, laid out by one process and
+* attached by 1 to procs worker processes after it has exited
+* Finally a worker is killed while it allocates, which may leave the lock
+* of the heap held; the heap must still be usable afterwards
+*/
+static int benchShared(int procs) {
+	shared_root *root;
+	double start, elapsed;
+	pid_t pids[64];
+	int status;
+	int failed = 0;
+	int n, i;
+	void *probe;
+
+	if (procs < 1 || procs > 64) {
+		fprintf(stderr, "between 1 and 64 processes\n");
+		return 1;
+	}
+	unlink(SHARED_PATH);
+
+	//The process that lays out the heap is gone before anyone attaches
+	pids[0] = fork();
+	if (pids[0] == 0) {
+		if (Mem_InitShared(SHARED_PATH, SHARED_SIZE) == -1 || (root = Mem_Calloc(1, sizeof(shared_root))) == NULL) {
+			_exit(1);
+		}
+		_exit(Mem_SharedSetRoot(root) == 0 ? 0 : 1);
+	}
+	if (waitpid(pids[0], &status, 0) == -1 || status != 0) {
+		fprintf(stderr, "cannot set up %s\n", SHARED_PATH);
+		return 1;
+	}
+
+	printf("%10s %12s %12s\n", "processes", "ns/op", "Mops/s");
+	for (n = 1; n <= procs; n++) {
+		start = nowNs();
+		for (i = 0; i < n; i++) {
+			pids[i] = sharedSpawn(354 + i, SHARED_OPS);
+		}
+		for (i = 0; i < n; i++) {
+			if (waitpid(pids[i], &status, 0) == -1 || status != 0) {
+				failed++;
+			}
+		}
+		elapsed = nowNs() - start;
+		printf("%10d %12.1f %12.2f\n", n, elapsed / ((double)n * SHARED_OPS), (double)n * SHARED_OPS * 1000 / elapsed);
+	}
+
+	//Kill a worker in the middle of its work, likely with the lock held
+	pids[0] = sharedSpawn(1, -1);
+	usleep(200 * 1000);
+	kill(pids[0], SIGKILL);
+	waitpid(pids[0], &status, 0);
+
+	if (Mem_InitShared(SHARED_PATH, 0) == -1 || (root = Mem_SharedRoot()) == NULL) {
+		fprintf(stderr, "cannot attach to %s\n", SHARED_PATH);
+		return 1;
+	}
+	probe = Mem_Alloc(1024);
+	printf("after the kill: %s, %ld operations in all, %d workers failed\n",
+		probe != NULL ? "heap usable" : "heap NOT usable", (long)atomic_load(&root->ops), failed);
+	Mem_Free(probe);
+	unlink(SHARED_PATH);
+	return probe == NULL || failed != 0;
+}
+
+/*
+* Function that times EXTENT_OPS allocations of lo..hi bytes, each freed
+* again at once, so the set of free extents stays the same
+* Returns the average latency of one Mem_Alloc call in nanoseconds
+*/
+static double timeExtentFits(int lo, int hi) {
+	double total = 0;
+	double start;
+	void *ptr;
+	int i;
+
+	for (i = 0; i < EXTENT_OPS; i++) {
+		start = nowNs();
+		ptr = Mem_Alloc(lo + rand() % (hi - lo + 1));
+		total += nowNs() - start;
+		Mem_Free(ptr);
+	}
+	return total / EXTENT_OPS;
+}
+
+/*
+* extents - Leaves a growing number of free large extents of EXTENT_MIN to
+* EXTENT_MAX bytes in the heap, each kept from its neighbours by a busy
+* separator, and measures the Mem_Alloc latency at every step
+* - fit: requests the free extents can satisfy
+* - miss: requests larger than every extent, but in the size range of the
+*   largest ones, served from the end of the heap
+*/
+static int benchExtents(int max_extents) {
+	static void *extents[EXTENTS_MAX];
+	int nextents = 0;
+	int target;
+	int i;
+
+	if (max_extents < 1 || max_extents > EXTENTS_MAX) {
+		fprintf(stderr, "between 1 and %d extents\n", EXTENTS_MAX);
+		return 1;
+	}
+	if (Mem_Init(HEAP_SIZE) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+	srand(354);
+
+	printf("%12s %12s %12s\n", "free extents", "fit ns", "miss ns");
+	for (target = 1000; ; target *= 2) {
+		if (target > max_extents) {
+			target = max_extents;
+		}
+
+		//All new extents are allocated before any is freed, or they would be
+		//handed out again; the separators are never freed, so the extents
+		//cannot coalesce
+		for (i = nextents; i < target; i++) {
+			extents[i] = Mem_Alloc(EXTENT_MIN + rand() % (EXTENT_MAX - EXTENT_MIN + 1));
+			if (extents[i] == NULL || Mem_Alloc(EXTENT_SEPARATOR) == NULL) {
+				fprintf(stderr, "heap exhausted at %d extents\n", i);
+				return 1;
+			}
+		}
+		for (; nextents < target; nextents++) {
+			Mem_Free(extents[nextents]);
+		}
+
+		//Untimed, so the new extents are sorted into the trees of their bins
+		timeExtentFits(EXTENT_MIN, EXTENT_MAX + 448);
+
+		printf("%12d %12.1f", nextents, timeExtentFits(EXTENT_MIN, EXTENT_MAX - 64));
+		printf(" %12.1f\n", timeExtentFits(EXTENT_MAX + 64, EXTENT_MAX + 448));
+		if (target == max_extents) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Function that prints the list of benchmarks */
+static int usage(char *prog) {
+	fprintf(stderr, "Usage: %s <benchmark> [args]\n", prog);
+	fprintf(stderr, "  latency         Allocation latency as the number of live blocks grows\n");
+	fprintf(stderr, "  threads [N]     Random alloc/free throughput from 1 to N threads (default 8)\n");
+	fprintf(stderr, "  remote [P]      P producer/consumer pairs (default 2), remote free queues off and on\n");
+	fprintf(stderr, "  realloc [V]     V growing vectors (default 4), alloc+copy+free against Mem_Realloc\n");
+	fprintf(stderr, "  request         Request-scoped objects, Mem_Free one by one against Mem_ArenaReset\n");
+	fprintf(stderr, "  batch [N]       Batches of N nodes (default 256), single calls against Mem_AllocBatch/Mem_FreeBatch\n");
+	fprintf(stderr, "  trim            Resident set after a burst, after freeing it and after trimming\n");
+	fprintf(stderr, "  tlb [huge]      Random walk over a large heap, with huge pages if asked\n");
+	fprintf(stderr, "  sample          Alloc/free cost at several sampling intervals, profiled against real live bytes\n");
+	fprintf(stderr, "  shared [P]      1 to P processes (default 4) on one shared heap, then one killed mid-work\n");
+	fprintf(stderr, "  extents [N]     Best fit latency as the number of free large extents grows to N (default 64000)\n");
+	return 1;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 2) {
+		return usage(argv[0]);
+	}
+
+	if (strcmp(argv[1], "latency") == 0) {
+		return benchLatency();
+	}
+	if (strcmp(argv[1], "threads") == 0) {
+		return benchThreads(argc > 2 ? atoi(argv[2]) : 8);
+	}
+	if (strcmp(argv[1], "remote") == 0) {
+		return benchRemote(argc > 2 ? atoi(argv[2]) : 2);
+	}
+	if (strcmp(argv[1], "realloc") == 0) {
+		return benchRealloc(argc > 2 ? atoi(argv[2]) : 4);
+	}
+	if (strcmp(argv[1], "request") == 0) {
+		return benchRequest();
+	}
+	if (strcmp(argv[1], "batch") == 0) {
+		return benchBatch(argc > 2 ? atoi(argv[2]) : 256);
+	}
+	if (strcmp(argv[1], "trim") == 0) {
+		return benchTrim();
+	}
+	if (strcmp(argv[1], "tlb") == 0) {
+		return benchTlb(argc > 2 && strcmp(argv[2], "huge") == 0);
+	}
+	if (strcmp(argv[1], "sample") == 0) {
+		return benchSample();
+	}
+	if (strcmp(argv[1], "shared") == 0) {
+		return benchShared(argc > 2 ? atoi(argv[2]) : 4);
+	}
+	if (strcmp(argv[1], "extents") == 0) {
+		return benchExtents(argc > 2 ? atoi(argv[2]) : 64000);
+	}
+
+	return usage(argv[0]);
+}
@@ -0,0 +1,146 @@
+/*
+* memBenchCpp.cpp - Standard containers on the allocator against the
+* default allocator
+*
+* Build:
+*   gcc -O2 -pthread -DMEM_LIBRARY_ONLY -c memLibrary.c
+*   g++ -O2 -std=c++17 -pthread memLibrary.o memBenchCpp.cpp -o memBenchCpp
+*
+* Usage: memBenchCpp [N]
+*   Runs every workload on N elements (default 200000) with
+*     std          std::allocator, i.e. the C library's malloc
+*     mem          mem::Allocator, nodes routed to their size class
+*     pmr          std::pmr containers on mem::resource()
+*   Workloads:
+*     map          random inserts into a std::map, then erase/insert churn
+*     list         push_back, erase every other element, refill, clear
+*     unordered    random inserts into a std::unordered_map, then churn
+*   and reports nanoseconds per container operation
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "memAllocator.hpp"
+
+#define HEAP_SIZE (64 * 1024 * 1024)
+#define ROUNDS 5
+
+/* Function that returns a monotonic timestamp in nanoseconds */
+static double nowNs() {
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+* map - Inserts n random keys, then erases a random present key and inserts
+* a new one n times, and finally destroys the map
+* Returns the time per operation in nanoseconds
+*/
+template <class Map>
+static double benchMap(Map &m, const std::vector<int> &keys) {
+	std::size_t n = keys.size();
+	double start = nowNs();
+	std::size_t i;
+
+	for (i = 0; i < n; i++) {
+		m.emplace(keys[i], (int)i);
+	}
+	for (i = 0; i < n; i++) {
+		m.erase(keys[(i * 7919) % n]);
+		m.emplace(keys[(i * 7919) % n] + 1, (int)i);
+	}
+	m.clear();
+	return (nowNs() - start) / (3 * n);
+}
+
+/*
+* list - Appends n elements, erases every other one, appends n / 2 again
+* and clears the list
+* Returns the time per operation in nanoseconds
+*/
+template <class List>
+static double benchList(List &l, std::size_t n) {
+	double start = nowNs();
+	std::size_t i;
+
+	for (i = 0; i < n; i++) {
+		l.push_back((int)i);
+	}
+	for (auto it = l.begin(); it != l.end(); ) {
+		it = l.erase(it);
+		if (it != l.end()) {
+			++it;
+		}
+	}
+	for (i = 0; i < n / 2; i++) {
+		l.push_front((int)i);
+	}
+	l.clear();
+	return (nowNs() - start) / (n + n / 2 + n / 2 + n);
+}
+
+/* Function that prints one row of the table */
+static void report(const char *workload, double ns[3]) {
+	std::printf("%-12s %10.1f %10.1f %10.1f %9.2fx\n", workload, ns[0], ns[1], ns[2], ns[0] / ns[1]);
+}
+
+/* Function that keeps the best of ROUNDS runs of a workload */
+static double best(const std::function<double()> &run) {
+	double min = run();
+	double t;
+	int r;
+
+	for (r = 1; r < ROUNDS; r++) {
+		if ((t = run()) < min) {
+			min = t;
+		}
+	}
+	return min;
+}
+
+int main(int argc, char *argv[]) {
+	std::size_t n = argc > 1 ? std::strtoul(argv[1], nullptr, 0) : 200000;
+	std::vector<int> keys(n);
+	std::mt19937 rng(354);
+	double ns[3];
+	std::size_t i;
+
+	if (n == 0 || Mem_Init(HEAP_SIZE) == -1) {
+		std::fprintf(stderr, "Usage: %s [N]\n", argv[0]);
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		keys[i] = (int)(rng() & 0x3FFFFFFF) * 2;
+	}
+
+	std::printf("%-12s %10s %10s %10s %10s\n", "ns/op", "std", "mem", "pmr", "std/mem");
+
+	using Pair = std::pair<const int, int>;
+	ns[0] = best([&] { std::map<int, int> m; return benchMap(m, keys); });
+	ns[1] = best([&] { std::map<int, int, std::less<int>, mem::Allocator<Pair>> m; return benchMap(m, keys); });
+	ns[2] = best([&] { std::pmr::map<int, int> m(mem::resource()); return benchMap(m, keys); });
+	report("map", ns);
+
+	ns[0] = best([&] { std::list<int> l; return benchList(l, n); });
+	ns[1] = best([&] { std::list<int, mem::Allocator<int>> l; return benchList(l, n); });
+	ns[2] = best([&] { std::pmr::list<int> l(mem::resource()); return benchList(l, n); });
+	report("list", ns);
+
+	ns[0] = best([&] { std::unordered_map<int, int> m; return benchMap(m, keys); });
+	ns[1] = best([&] {
+		std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, mem::Allocator<Pair>> m;
+		return benchMap(m, keys);
+	});
+	ns[2] = best([&] { std::pmr::unordered_map<int, int> m(mem::resource()); return benchMap(m, keys); });
+	report("unordered", ns);
+	return 0;
+}
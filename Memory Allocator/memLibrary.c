@@ -1,5 +1,9 @@
 
-#include "stdafx.h"
+/* mremap is a GNU extension */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -8,20 +12,55 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+
+#include "memLibrary.h"
+
+/*
+* Requests larger than mmap_threshold bytes bypass the heap; each of them
+* gets a mapping of its own, which Mem_Free unmaps again
+* The threshold can be changed with Mem_SetOption(MEM_OPT_MMAP_THRESHOLD, ...)
+*/
+#define MMAP_THRESHOLD (128 * 1024)
+#define MAX_MMAP_THRESHOLD (16 * 1024 * 1024)
 
+/*
+* Header layout
+* By default headers and footers are 8 bytes wide and payloads are 16 byte
+* aligned, as x86-64 SIMD types expect; a chunk can then be of any size
+* Building with -DMEM_COMPACT_HDR keeps the original 4 byte headers and
+* 8 byte alignment, which saves memory on heaps of many small blocks
+*/
+#ifdef MEM_COMPACT_HDR
+typedef int blk_size_t;
+#define BLK_SIZE_MAX INT_MAX
+#define ALIGNMENT 8
+#else
+typedef size_t blk_size_t;
+#define BLK_SIZE_MAX SIZE_MAX
+#define ALIGNMENT 16
+#endif
 
-#define MAXSIZE 4088
-#define MIN_BLK_SIZE 8
 /*
 * This structure serves as the header for each allocated and free block
 * It also serves as the footer for each free block
 * The blocks are ordered in the increasing order of addresses
 */
 typedef struct blk_hdr {
-	int size_status;
+	blk_size_t size_status;
 
 	/*
-	* Size of the block is always a multiple of 8
+	* Size of the block is always a multiple of ALIGNMENT (at least 8)
 	* => last two bits are always zero - can be used to store other information
 	*
 	* LSB -> Least Significant Bit (Last Bit)
@@ -32,10 +71,13 @@ typedef struct blk_hdr {
 	* SLB = 1 => previous block is allocated/busy
 	*
 	* When used as the footer the last two bits should be zero
+	*
+	* The third last bit is only ever set for blocks that have a mapping of
+	* their own (MMAPPED); see mapLarge
 	*/
 
 	/*
-	* Examples:
+	* Examples (with the compact 4 byte header):
 	*
 	* For a busy block with a payload of 20 bytes (i.e. 20 bytes data + an additional 4 bytes for header)
 	* Header:
@@ -52,9 +94,314 @@ typedef struct blk_hdr {
 	*/
 } blk_hdr;
 
-/* Global variable - This will always point to the first block
-* i.e. the block with the lowest address */
-blk_hdr *first_blk = NULL;
+/*
+* Free blocks are additionally kept on explicit doubly linked lists.
+* The links live in the first bytes of the payload, right after the header,
+* so a free block must be large enough to hold header + links + footer.
+*/
+typedef struct free_links {
+	blk_hdr *next;	//Next free block in the same bin
+	blk_hdr *prev;	//Previous free block in the same bin
+} free_links;
+
+#define MIN_BLK_SIZE ((blk_size_t)((2 * sizeof(blk_hdr) + sizeof(free_links) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)))
+
+/* Mask the two LSBs to get the size of a block */
+#define BLK_SIZE(blk) ((blk)->size_status & ~(blk_size_t)3)
+
+/*
+* A large block is laid out as
+*   [pad][map_size][pad][header][payload ...]
+* in its own mapping. The header holds just MMAPPED + busy, and map_size
+* holds the size of the whole mapping
+* map_size sits MMAP_HDR_SIZE bytes before the payload, and the mapping
+* starts at the page holding map_size. Normally the payload is MMAP_HDR_SIZE
+* bytes into the mapping; it is further in for Mem_AlignedAlloc
+*/
+#define MMAPPED 4
+#define MMAP_HDR_SIZE 16
+
+/* Size and start of the mapping of a large block */
+#define MMAP_SIZE(ptr) (*(size_t*)((char*)(ptr) - MMAP_HDR_SIZE))
+#define MMAP_BASE(ptr) ((char*)(((uintptr_t)(ptr) - MMAP_HDR_SIZE) & ~((uintptr_t)pagesize - 1)))
+
+/* Location of the free list links of a free block */
+#define LINKS(blk) ((free_links *)((char *)(blk) + sizeof(blk_hdr)))
+
+/*
+* The free blocks of every large bin are also kept in a tree, ordered by
+* size and then by address, so the best fit is found in O(log n) however
+* many large blocks are free. The tree is a treap: a node's priority is a
+* hash of its address, which keeps the tree balanced with high probability
+* and needs no room in the block. Its links follow the free list links
+* A block freed into a large bin is not added to the tree right away; it is
+* marked TREE_UNSORTED and the next best fit search of the bin adds it. Most
+* freed blocks are coalesced again or taken off the bin head first, and the
+* other placement policies never search the trees. New blocks go to the bin
+* head, so the unsorted blocks of a bin always come before the sorted ones
+*/
+typedef struct tree_links {
+	blk_hdr *left;	//Free blocks ordered before this one
+	blk_hdr *right;	//Free blocks ordered after this one
+	blk_hdr *parent;	//NULL at the root
+} tree_links;
+
+#define TREE(blk) ((tree_links *)((char *)(blk) + sizeof(blk_hdr) + sizeof(free_links)))
+#define TREE_UNSORTED ((blk_hdr *)1)	//In TREE(blk)->left of a block not in the tree yet
+
+/* Bytes at the start of a free block's payload that hold its links */
+#define FREE_LINKS_SIZE (sizeof(free_links) + sizeof(tree_links))
+
+/*
+* Size classes (bins) for the free lists
+* - Block sizes up to SMALL_BIN_MAX get one bin per multiple of ALIGNMENT,
+*   so every block in such a bin has exactly the same size
+* - Larger sizes get two bins per power of two, the last bin holds everything
+*   that does not fit anywhere else
+*/
+#define NUM_BINS 64
+#define SMALL_BIN_MAX (32 * ALIGNMENT)
+#define FIRST_LARGE_BIN (SMALL_BIN_MAX / ALIGNMENT + 1)
+
+/*
+* The heap is made of chunks mapped with mmap; each chunk belongs to one arena
+* Every arena has its own chunks, bins and lock, so threads that are
+* mapped to different arenas never contend with each other
+* Mem_Init gives every arena an equal share of the requested region, and an
+* arena that runs out of space maps another chunk of at least GROW_SIZE bytes
+* A block freed by a thread of another arena is pushed onto the arena's
+* remote_frees stack without taking the lock; the stack is drained in one
+* batch the next time a thread allocates from the arena
+*/
+#define MAX_ARENAS 16
+#define ARENAS_PER_CPU 2
+#define MIN_ARENA_SIZE (64 * 1024)
+
+/*
+* Deferred coalescing
+* Small blocks freed into an arena are parked on LIFO quick lists, one per
+* exact size, without being coalesced. They stay marked busy, so the
+* prev-busy bits of their neighbours need no change, and allocBlk hands
+* them out again before searching the bins
+* The quick lists are merged into the bins (consolidateQuick) when a
+* search of the bins fails, once they hold more than QUICK_MAX_BYTES, and
+* when a block of QUICK_CONSOLIDATE_SIZE bytes or more is freed
+* Mem_SetOption(MEM_OPT_DEFER_COALESCE, 0) turns the quick lists off
+*/
+#define QUICK_MAX_SIZE SMALL_BIN_MAX
+#define QUICK_BINS (QUICK_MAX_SIZE / ALIGNMENT + 1)
+#define QUICK_MAX_BYTES (64 * 1024)
+#define QUICK_CONSOLIDATE_SIZE (64 * 1024)
+
+typedef struct chunk chunk_t;
+
+typedef struct arena {
+	pthread_mutex_t lock;
+	chunk_t *chunks;		//Chunks of this arena in the order they were mapped
+	chunk_t *last_chunk;
+	blk_hdr *bins[NUM_BINS];
+	uint64_t bin_map;		//bin_map has bit i set if and only if bins[i] is non-empty
+	blk_hdr *rovers[NUM_BINS];	//Where the next search of a bin starts, for MEM_PLACE_NEXT
+	blk_hdr *trees[NUM_BINS];	//Roots of the trees of the large bins; see tree_links
+	_Atomic(blk_hdr *) remote_frees;	//Busy blocks waiting to be freed, linked through LINKS(blk)->next
+	blk_hdr *quick[QUICK_BINS];	//Freed blocks not coalesced yet, linked through LINKS(blk)->next
+	size_t quick_bytes;		//Bytes of the blocks on the quick lists
+
+	//Statistics, kept up to date under the lock; see Mem_GetStats
+	size_t heap_bytes;		//Bytes of all blocks of the arena's chunks
+	size_t busy_bytes;
+	size_t splits;
+	size_t coalesces;
+	size_t busy_hist[NUM_BINS];		//Busy blocks per bin their size maps to
+	size_t free_hist[NUM_BINS];		//Number of blocks in every bin
+} arena_t;
+
+arena_t arenas[MAX_ARENAS];
+int num_arenas = 0;
+
+/*
+* Header at the start of every chunk
+* Chunks are aligned to CHUNK_ALIGN and never larger than that, so the chunk
+* of any block is found by rounding the block's address down
+* The header is followed by a pad word for payload alignment, the first
+* block, and an end mark in the last word of the chunk
+*/
+struct chunk {
+	chunk_t *next;			//Next chunk of the same arena
+	arena_t *arena;			//Arena owning the chunk
+	size_t size;			//Size of the mapping in bytes
+	char *fresh;			//End of the highest block ever handed out, see zeroBlk
+};
+
+#define CHUNK_SHIFT 26
+#define CHUNK_ALIGN (1 << CHUNK_SHIFT)
+#define CHUNK_HDR_SIZE ((size_t)((sizeof(chunk_t) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)))
+#define GROW_SIZE (1024 * 1024)
+
+/* First block of a chunk */
+#define CHUNK_FIRST_BLK(c) ((blk_hdr *)((char *)(c) + CHUNK_HDR_SIZE + ALIGNMENT - sizeof(blk_hdr)))
+
+/* Chunk of a heap block */
+#define CHUNK_OF(blk) ((chunk_t *)((uintptr_t)(blk) & ~((uintptr_t)CHUNK_ALIGN - 1)))
+
+/*
+* Registry of all chunks, used to tell whether a pointer belongs to the heap
+* Open addressing on the chunk's base address; entries are only ever added,
+* under chunk_lock, so lookups need no lock
+*/
+#define CHUNK_TABLE_SIZE 8192
+
+_Atomic(chunk_t *) chunk_table[CHUNK_TABLE_SIZE];
+int num_chunks = 0;
+pthread_mutex_t chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int pagesize = 4096;
+
+/* Set by Mem_SetOption(MEM_OPT_REMOTE_FREE, ...) */
+int remote_free_enabled = 1;
+
+/* Set by Mem_SetOption(MEM_OPT_MMAP_THRESHOLD, ...) */
+size_t mmap_threshold = MMAP_THRESHOLD;
+
+/* Set by Mem_SetOption(MEM_OPT_DEFER_COALESCE, ...) */
+int defer_coalesce_enabled = 1;
+
+/*
+* Placement policy, set by Mem_SetOption(MEM_OPT_PLACEMENT, ...) before Mem_Init
+* The policies only differ for large bins; a small bin holds blocks of a
+* single size, so any of its blocks is the best fit. GOOD_FIT_PROBES bounds
+* the blocks good fit looks at, and a block that wastes at most
+* 1/GOOD_FIT_SLACK of the request ends its search early
+* Best fit looks at the first BEST_FIT_PROBES blocks of a large bin for a
+* perfect fit before it searches the bin's tree; recently freed blocks
+* sit there, and requests tend to repeat their sizes
+*/
+#define GOOD_FIT_PROBES 8
+#define GOOD_FIT_SLACK 16
+#define BEST_FIT_PROBES 8
+
+int placement = MEM_PLACE_BEST;
+
+/* Statistics that do not belong to an arena */
+atomic_size_t mapped_bytes = 0;
+atomic_size_t mapped_blocks = 0;
+atomic_size_t alloc_failures = 0;
+
+/*
+* Background thread that runs a task at a fixed interval, see periodicSet
+* One runs Mem_StatsPeriodic's dumps and one MEM_OPT_TRIM_INTERVAL's trims
+*/
+typedef struct periodic {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	long interval_ms;
+	void (*task)(void *arg);
+	void *arg;				//Passed to task
+} periodic_t;
+
+periodic_t stats_periodic = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+periodic_t trim_periodic = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/*
+* Huge pages
+* With Mem_SetOption(MEM_OPT_HUGE_PAGES, 1) chunks are mapped in multiples
+* of HUGE_PAGE_SIZE and marked for transparent huge pages, and Mem_Trim
+* only releases whole huge pages so it never splits one
+*/
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+int huge_pages_enabled = 0;
+
+/* Arena of the calling thread, assigned round robin on first use */
+_Thread_local arena_t *thread_arena = NULL;
+atomic_int next_arena = 0;
+
+/*
+* Per-thread cache of small blocks
+* Mem_Free parks blocks of up to TCACHE_MAX_SIZE bytes here and Mem_Alloc
+* hands them out again without taking any lock
+* A cached block stays marked busy in the heap. Its links hold the next
+* cached block and tcache_key, which lets Mem_Free spot double frees
+*/
+#define TCACHE_MAX_SIZE SMALL_BIN_MAX
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT + 1)
+#define TCACHE_COUNT 32
+#define TCACHE_REFILL 16		//Blocks an empty bin is refilled with at once
+
+/* memLibrary.h repeats the block layout for MEM_SIZE_CLASS */
+_Static_assert(MEM_ALIGNMENT == ALIGNMENT && MEM_HDR_SIZE == sizeof(blk_hdr) &&
+	MEM_MIN_BLOCK == MIN_BLK_SIZE && MEM_CLASS_MAX == TCACHE_MAX_SIZE,
+	"size classes in memLibrary.h do not match the block layout");
+
+typedef struct tcache tcache_t;
+
+struct tcache {
+	blk_hdr *entries[TCACHE_BINS];	//Singly linked through LINKS(blk)->next
+	int counts[TCACHE_BINS];
+	int registered;					//Set once the thread exit hook is armed
+	atomic_size_t bytes;			//Bytes of the cached blocks; only written by the owner
+	tcache_t *next;					//Caches of all threads, for Mem_GetStats
+	tcache_t *prev;
+};
+
+_Thread_local tcache_t tcache;
+blk_hdr *tcache_key = NULL;
+
+/* Stored in the links of blocks on the quick lists, like tcache_key */
+blk_hdr *quick_key = NULL;
+pthread_key_t tcache_exit_key;
+
+/* Registered thread caches */
+tcache_t *tcache_list = NULL;
+pthread_mutex_t tcache_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+* Sampling profiler, see Mem_SetOption(MEM_OPT_SAMPLE_INTERVAL, ...)
+* Every thread counts down the bytes it allocates; the allocation that
+* crosses zero has its call stack recorded, and the next gap is drawn
+* uniformly from 1 to twice sample_interval. A sample of size bytes stands
+* for max(size, sample_interval) bytes
+* Call sites live in an open addressing table keyed by their frames, and
+* sampled objects that are still live in another one keyed by address
+* sample_filter counts the live samples per hash of their address, so
+* Mem_Free only takes sample_lock for addresses that may have been sampled
+*/
+#define SAMPLE_DEPTH 32			//Frames recorded per call stack
+#define SAMPLE_SLACK 4			//Room for the frames of the allocator itself
+#define SAMPLE_SITES 4096
+#define SAMPLE_OBJS 65536
+#define SAMPLE_FILTER 16384
+
+typedef struct sample_site {
+	void *frames[SAMPLE_DEPTH];	//Innermost frame first
+	int depth;					//0 if the slot is empty
+	size_t live_bytes;			//Estimates, scaled up from the samples
+	size_t live_objs;
+	size_t alloc_bytes;
+	size_t alloc_objs;
+} sample_site;
+
+typedef struct sample_obj {
+	void *ptr;					//NULL if the slot is empty
+	size_t bytes;				//Bytes and objects the sample stands for
+	size_t objs;
+	int site;
+} sample_obj;
+
+long sample_interval = 0;
+sample_site *sample_sites = NULL;
+sample_obj *sample_objs = NULL;
+atomic_ushort *sample_filter = NULL;
+atomic_size_t sampled_live = 0;		//Entries of sample_objs
+size_t sample_dropped = 0;			//Samples lost to full tables
+struct timespec sample_start;
+pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+
+_Thread_local long sample_left = 0;		//Bytes until the next sample
+_Thread_local uint64_t sample_seed = 0;	//0 until the thread draws its first gap
+_Thread_local int sample_busy = 0;		//Set while recording; no nested samples
 
 /*
 * Note:
@@ -68,297 +415,3640 @@ blk_hdr *first_blk = NULL;
 */
 void createFooter(blk_hdr *ptr) {
 	//Mask two LSBs to find the size of the block
-	int size = (ptr->size_status) & 0xFFFFFFFC;
+	blk_size_t size = BLK_SIZE(ptr);
 
 	//Move pointer to footer location and initializes footer's size_status
 	ptr = (blk_hdr *)((char*)ptr + size - sizeof(blk_hdr));
 	ptr->size_status = size;
 }
 
+/* Function that returns the index of the highest set bit
+* Argument - x: Non-zero value
+*/
+int highBit(uint64_t x) {
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(x);
+#else
+	int bit = 0;
+	while (x >>= 1) {
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+/* Function that returns the index of the lowest set bit
+* Argument - x: Non-zero value
+*/
+int lowBit64(uint64_t x) {
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#else
+	int bit = 0;
+	while ((x & 1) == 0) {
+		x >>= 1;
+		bit++;
+	}
+	return bit;
+#endif
+}
+
+/* Function that maps a block size to the bin holding blocks of that size
+* Argument - size: Size of the block (a multiple of ALIGNMENT)
+*/
+int binIndex(blk_size_t size) {
+	int log2;
+	int bin;
+
+	//Small sizes have a bin of their own
+	if (size <= SMALL_BIN_MAX) {
+		return (int)(size / ALIGNMENT);
+	}
+
+	//Two bins per power of two above SMALL_BIN_MAX, picked by the bit below the highest set bit
+	log2 = highBit(size);
+	bin = FIRST_LARGE_BIN + 2 * (log2 - highBit(SMALL_BIN_MAX)) + (int)((size >> (log2 - 1)) & 1);
+
+	if (bin >= NUM_BINS) {
+		bin = NUM_BINS - 1;
+	}
+	return bin;
+}
+
+/* Function that returns the treap priority of a free block, a hash of its address */
+static inline uint32_t treePriority(blk_hdr *blk) {
+	return (uint32_t)((((uintptr_t)blk >> 4) * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+/* Function that tells if free block a is ordered before free block b in the tree */
+static inline int treeBefore(blk_hdr *a, blk_hdr *b) {
+	return BLK_SIZE(a) < BLK_SIZE(b) || (BLK_SIZE(a) == BLK_SIZE(b) && a < b);
+}
+
 /*
-* Function for allocating 'size' bytes
-* Returns address of allocated block on success
-* Returns NULL on failure
-* - Check for sanity of size - Return NULL when appropriate
-* - Round up size to a multiple of 8
-* - Traverse the list of blocks and allocate the best free block which can accommodate the requested size
-* - Also, when allocating a block - split it into two blocks
+* Function that adds a free block to a tree
+* The block goes below the last node on its search path with a priority at
+* least as high as its own, and the subtree it replaces is split around it
+* Argument - root: Root of the tree
+* Argument - blk: Header of the free block
+*/
+void treeInsert(blk_hdr **root, blk_hdr *blk) {
+	uint32_t priority = treePriority(blk);
+	blk_hdr **link = root;
+	blk_hdr *parent = NULL;
+	blk_hdr **left = &TREE(blk)->left;
+	blk_hdr **right = &TREE(blk)->right;
+	blk_hdr *left_parent = blk;
+	blk_hdr *right_parent = blk;
+	blk_hdr *rest;
+
+	while (*link != NULL && treePriority(*link) >= priority) {
+		parent = *link;
+		link = treeBefore(blk, parent) ? &TREE(parent)->left : &TREE(parent)->right;
+	}
+	rest = *link;
+	*link = blk;
+	TREE(blk)->parent = parent;
+
+	//Nodes ordered before blk go to its left subtree, the others to its right one
+	while (rest != NULL) {
+		if (treeBefore(rest, blk)) {
+			*left = rest;
+			TREE(rest)->parent = left_parent;
+			left_parent = rest;
+			left = &TREE(rest)->right;
+			rest = *left;
+		}
+		else {
+			*right = rest;
+			TREE(rest)->parent = right_parent;
+			right_parent = rest;
+			right = &TREE(rest)->left;
+			rest = *right;
+		}
+	}
+	*left = NULL;
+	*right = NULL;
+}
+
+/*
+* Function that takes a free block out of a tree and merges its two
+* subtrees in its place
+* Argument - root: Root of the tree
+* Argument - blk: Header of the free block
+*/
+void treeRemove(blk_hdr **root, blk_hdr *blk) {
+	blk_hdr *parent = TREE(blk)->parent;
+	blk_hdr *left = TREE(blk)->left;
+	blk_hdr *right = TREE(blk)->right;
+	blk_hdr **link;
+
+	if (parent == NULL) {
+		link = root;
+	}
+	else {
+		link = TREE(parent)->left == blk ? &TREE(parent)->left : &TREE(parent)->right;
+	}
+
+	//Every node of the left subtree is ordered before every node of the right one
+	while (left != NULL && right != NULL) {
+		if (treePriority(left) >= treePriority(right)) {
+			*link = left;
+			TREE(left)->parent = parent;
+			parent = left;
+			link = &TREE(left)->right;
+			left = *link;
+		}
+		else {
+			*link = right;
+			TREE(right)->parent = parent;
+			parent = right;
+			link = &TREE(right)->left;
+			right = *link;
+		}
+	}
+	*link = left != NULL ? left : right;
+	if (*link != NULL) {
+		TREE(*link)->parent = parent;
+	}
+}
+
+/*
+* Function that finds the smallest free block in a tree that is large enough
+* Argument - node: Root of the tree
+* Argument - size: Required block size
+* Returns the header of the block, or NULL if no block in the tree is large enough
+*/
+blk_hdr* treeFit(blk_hdr *node, blk_size_t size) {
+	blk_hdr *best_blk = NULL;
+
+	while (node != NULL) {
+		if (BLK_SIZE(node) >= size) {
+			//No need to continue searching if block size is perfect fit
+			if (BLK_SIZE(node) == size) {
+				return node;
+			}
+			best_blk = node;
+			node = TREE(node)->left;
+		}
+		else {
+			node = TREE(node)->right;
+		}
+	}
+	return best_blk;
+}
+
+/*
+* Function that adds the blocks of a large bin not in its tree yet to the tree
+* Argument - ar: Arena owning the bin
+* Argument - bin: Index of the bin
+* Returns the root of the bin's tree
+*/
+blk_hdr* sortBin(arena_t *ar, int bin) {
+	blk_hdr *blk;
+
+	for (blk = ar->bins[bin]; blk != NULL && TREE(blk)->left == TREE_UNSORTED; blk = LINKS(blk)->next) {
+		treeInsert(&ar->trees[bin], blk);
+	}
+	return ar->trees[bin];
+}
+
+/* Function that pushes a free block onto the head of its bin
+* A block of a large bin is left for sortBin to add to the bin's tree
+* Argument - ar: Arena owning the block
+* Argument - blk: Header of the free block
+*/
+void insertFreeBlk(arena_t *ar, blk_hdr *blk) {
+	int bin = binIndex(BLK_SIZE(blk));
+
+	LINKS(blk)->prev = NULL;
+	LINKS(blk)->next = ar->bins[bin];
+	if (ar->bins[bin] != NULL) {
+		LINKS(ar->bins[bin])->prev = blk;
+	}
+	ar->bins[bin] = blk;
+	ar->free_hist[bin]++;
+	if (bin >= FIRST_LARGE_BIN) {
+		TREE(blk)->left = TREE_UNSORTED;
+	}
+
+	//The bin is non-empty now
+	ar->bin_map |= (uint64_t)1 << bin;
+}
+
+/* Function that unlinks a free block from its bin, and from the bin's tree if it is in it
+* Must be called before the size of the block is changed
+* Argument - ar: Arena owning the block
+* Argument - blk: Header of the free block
+*/
+void removeFreeBlk(arena_t *ar, blk_hdr *blk) {
+	int bin = binIndex(BLK_SIZE(blk));
+	free_links *links = LINKS(blk);
+
+	if (links->prev != NULL) {
+		LINKS(links->prev)->next = links->next;
+	}
+	else {
+		ar->bins[bin] = links->next;
+	}
+	if (links->next != NULL) {
+		LINKS(links->next)->prev = links->prev;
+	}
+	if (ar->rovers[bin] == blk) {
+		ar->rovers[bin] = links->next;
+	}
+	ar->free_hist[bin]--;
+	if (bin >= FIRST_LARGE_BIN && TREE(blk)->left != TREE_UNSORTED) {
+		treeRemove(&ar->trees[bin], blk);
+	}
+
+	if (ar->bins[bin] == NULL) {
+		ar->bin_map &= ~((uint64_t)1 << bin);
+	}
+}
+
+/* Function that updates the busy block statistics of an arena
+* Argument - ar: Arena owning the blocks
+* Argument - size: Size of the blocks
+* Argument - n: Number of blocks that became busy, negative if they stopped being busy
+*/
+void countBusy(arena_t *ar, blk_size_t size, int n) {
+	ar->busy_bytes += (size_t)((long)n * (long)size);
+	ar->busy_hist[binIndex(size)] += n;
+}
+
+/* Function that finds the best fitting free block of an arena
+* Argument - ar: Arena to search
+* Argument - size: Required block size (header included, a multiple of ALIGNMENT)
+* Returns the header of the block, or NULL if no free block is large enough
+*/
+blk_hdr* findBestFit(arena_t *ar, blk_size_t size) {
+	int bin = binIndex(size);
+	uint64_t candidates;	//Non-empty bins whose blocks are all large enough
+	blk_hdr *best_blk;
+	int probes = 0;
+
+	//Blocks in a large bin differ in size, so the bin of the request itself
+	//may hold blocks that are too small; its tree finds the best fit if any
+	if (bin >= FIRST_LARGE_BIN) {
+		for (best_blk = ar->bins[bin]; best_blk != NULL && probes < BEST_FIT_PROBES; best_blk = LINKS(best_blk)->next) {
+			//No need to search the tree if block size is perfect fit
+			if (BLK_SIZE(best_blk) == size) {
+				return best_blk;
+			}
+			probes++;
+		}
+		if ((best_blk = treeFit(sortBin(ar, bin), size)) != NULL) {
+			return best_blk;
+		}
+		if (++bin == NUM_BINS) {
+			return NULL;
+		}
+	}
+
+	//Every block in the remaining bins is large enough;
+	//the lowest non-empty one holds the smallest blocks
+	candidates = ar->bin_map & (~(uint64_t)0 << bin);
+	if (candidates == 0) {
+		return NULL;
+	}
+	bin = lowBit64(candidates);
+
+	//All blocks of a small bin have the same size
+	if (bin < FIRST_LARGE_BIN) {
+		return ar->bins[bin];
+	}
+	//Its first node is the smallest
+	return treeFit(sortBin(ar, bin), 0);
+}
+
+/*
+* Function that finds the first free block of an arena that is large enough,
+* searching the bins from the one of the request upwards
+* Argument - ar: Arena to search
+* Argument - size: Required block size (header included, a multiple of ALIGNMENT)
+* Returns the header of the block, or NULL if no free block is large enough
+*/
+blk_hdr* findFirstFit(arena_t *ar, blk_size_t size) {
+	int bin = binIndex(size);
+	uint64_t candidates;
+	blk_hdr *curr_blk;
+
+	if (bin >= FIRST_LARGE_BIN) {
+		for (curr_blk = ar->bins[bin]; curr_blk != NULL; curr_blk = LINKS(curr_blk)->next) {
+			if (BLK_SIZE(curr_blk) >= size) {
+				return curr_blk;
+			}
+		}
+		if (++bin == NUM_BINS) {
+			return NULL;
+		}
+	}
+
+	//Every block in the remaining bins is large enough
+	candidates = ar->bin_map & (~(uint64_t)0 << bin);
+	if (candidates == 0) {
+		return NULL;
+	}
+	return ar->bins[lowBit64(candidates)];
+}
+
+/*
+* Function that finds a free block like findFirstFit, but resumes every
+* search of a bin where the previous one left off (next fit)
+* Every bin has a roving pointer to the block after the one taken last;
+* the search runs from there to the end of the bin and wraps around
+* Argument - ar: Arena to search
+* Argument - size: Required block size (header included, a multiple of ALIGNMENT)
+* Returns the header of the block, or NULL if no free block is large enough
+*/
+blk_hdr* findNextFit(arena_t *ar, blk_size_t size) {
+	int bin = binIndex(size);
+	uint64_t candidates;
+	blk_hdr *curr_blk;
+	blk_hdr *rover;
+
+	if (bin >= FIRST_LARGE_BIN) {
+		rover = ar->rovers[bin];
+		for (curr_blk = rover; curr_blk != NULL; curr_blk = LINKS(curr_blk)->next) {
+			if (BLK_SIZE(curr_blk) >= size) {
+				return curr_blk;
+			}
+		}
+		for (curr_blk = ar->bins[bin]; curr_blk != rover; curr_blk = LINKS(curr_blk)->next) {
+			if (BLK_SIZE(curr_blk) >= size) {
+				return curr_blk;
+			}
+		}
+		if (++bin == NUM_BINS) {
+			return NULL;
+		}
+	}
+
+	candidates = ar->bin_map & (~(uint64_t)0 << bin);
+	if (candidates == 0) {
+		return NULL;
+	}
+	bin = lowBit64(candidates);
+	return ar->rovers[bin] != NULL ? ar->rovers[bin] : ar->bins[bin];
+}
+
+/*
+* Function that finds the best of the first GOOD_FIT_PROBES free blocks
+* that are large enough (good fit)
+* Argument - ar: Arena to search
+* Argument - size: Required block size (header included, a multiple of ALIGNMENT)
+* Returns the header of the block, or NULL if no free block is large enough
+*/
+blk_hdr* findGoodFit(arena_t *ar, blk_size_t size) {
+	int bin = binIndex(size);
+	uint64_t candidates;
+	blk_hdr *curr_blk;
+	blk_hdr *best_blk = NULL;
+	blk_size_t best_size = BLK_SIZE_MAX;
+	blk_size_t curr_blk_size;
+	blk_size_t good_size = size + size / GOOD_FIT_SLACK;	//Close enough to stop looking
+	int probes = 0;
+
+	if (bin >= FIRST_LARGE_BIN) {
+		for (curr_blk = ar->bins[bin]; curr_blk != NULL && probes < GOOD_FIT_PROBES; curr_blk = LINKS(curr_blk)->next) {
+			curr_blk_size = BLK_SIZE(curr_blk);
+			if (curr_blk_size >= size) {
+				probes++;
+				if (curr_blk_size < best_size) {
+					best_blk = curr_blk;
+					best_size = curr_blk_size;
+					if (best_size <= good_size) {
+						break;
+					}
+				}
+			}
+		}
+		if (best_blk != NULL) {
+			return best_blk;
+		}
+		if (++bin == NUM_BINS) {
+			return NULL;
+		}
+	}
+
+	candidates = ar->bin_map & (~(uint64_t)0 << bin);
+	if (candidates == 0) {
+		return NULL;
+	}
+	bin = lowBit64(candidates);
+	if (bin < FIRST_LARGE_BIN) {
+		return ar->bins[bin];
+	}
+
+	//Every block here fits; the smallest of the first few will do
+	for (curr_blk = ar->bins[bin]; curr_blk != NULL && probes < GOOD_FIT_PROBES; curr_blk = LINKS(curr_blk)->next) {
+		probes++;
+		if (BLK_SIZE(curr_blk) < best_size) {
+			best_blk = curr_blk;
+			best_size = BLK_SIZE(curr_blk);
+		}
+	}
+	return best_blk;
+}
+
+/*
+* Function that finds a free block of an arena with the placement policy
+* chosen at Mem_Init
+* Argument - ar: Arena to search
+* Argument - size: Required block size (header included, a multiple of ALIGNMENT)
+* Returns the header of the block, or NULL if no free block is large enough
+*/
+blk_hdr* findFit(arena_t *ar, blk_size_t size) {
+	switch (placement) {
+	case MEM_PLACE_FIRST:
+		return findFirstFit(ar, size);
+	case MEM_PLACE_NEXT:
+		return findNextFit(ar, size);
+	case MEM_PLACE_GOOD:
+		return findGoodFit(ar, size);
+	default:
+		return findBestFit(ar, size);
+	}
+}
+
+/*
+* Function that finds the largest free block of an arena
+* Only the highest non-empty bin can hold it: it is the last node of the
+* bin's tree, or the head of the bin if it is a small one
+* Argument - ar: Arena to search
+* Returns the header of the block, or NULL if the arena has no free block
+*/
+blk_hdr* largestFree(arena_t *ar) {
+	int bin;
+	blk_hdr *blk;
+
+	if (ar->bin_map == 0) {
+		return NULL;
+	}
+	bin = highBit(ar->bin_map);
+	if (bin < FIRST_LARGE_BIN) {
+		return ar->bins[bin];
+	}
+	blk = sortBin(ar, bin);
+	while (TREE(blk)->right != NULL) {
+		blk = TREE(blk)->right;
+	}
+	return blk;
+}
+
+/* Defined further down */
+void drainRemoteFrees(arena_t *ar);
+void consolidateQuick(arena_t *ar);
+int growArena(arena_t *ar, size_t size);
+size_t carveBatch(arena_t *ar, blk_size_t size, size_t n, void **out);
+void tcacheRegister();
+typedef struct shared_hdr shared_hdr;
+shared_hdr *shared_heap = NULL;		//Set once Mem_InitShared has mapped the heap, see below
+void* sharedAlloc(size_t size);
+int sharedFree(void *ptr);
+void* sharedRealloc(void *ptr, size_t size);
+blk_hdr* sharedBlk(void *ptr);
+int sampleDue(size_t size);
+long sampleGap();
+void* sampleAlloc(size_t size, size_t align, int zero, void *caller);
+void sampleFree(void *ptr);
+
+/*
+* Function that returns the arena of the calling thread
+* Threads are spread over the arenas round robin when they first allocate
+*/
+arena_t* threadArena() {
+	if (thread_arena == NULL) {
+		thread_arena = &arenas[atomic_fetch_add(&next_arena, 1) % num_arenas];
+	}
+	return thread_arena;
+}
+
+/* Function that returns the slot of the chunk registry to probe first
+* Argument - base: Address of the chunk
+*/
+int chunkSlot(uintptr_t base) {
+	return (int)(((base >> CHUNK_SHIFT) * 0x9E3779B1u) & (CHUNK_TABLE_SIZE - 1));
+}
+
+/*
+* Function that returns the arena owning a block
+* Argument - blk: Header of the block
+* Returns NULL if the block is not inside the heap
+*/
+arena_t* arenaOf(blk_hdr *blk) {
+	uintptr_t base = (uintptr_t)blk & ~((uintptr_t)CHUNK_ALIGN - 1);
+	chunk_t *c;
+	int slot;
+
+	for (slot = chunkSlot(base); (c = atomic_load_explicit(&chunk_table[slot], memory_order_acquire)) != NULL;
+		slot = (slot + 1) & (CHUNK_TABLE_SIZE - 1)) {
+		if ((uintptr_t)c == base) {
+			//The block must lie between the first block and the end mark
+			if ((char*)blk < (char*)CHUNK_FIRST_BLK(c) || (char*)blk >= (char*)c + c->size - sizeof(blk_hdr)) {
+				return NULL;
+			}
+			return c->arena;
+		}
+	}
+	return NULL;
+}
+
+/*
+* Function that clears the payload of a block that was just carved out
+* Argument - blk: Header of the block
+* Argument - size: Size of the block
+* Memory of a chunk past chunk->fresh has never been handed out, so it is
+* still zero as the OS gave it to us, except for
+* - the header and links of the free block at chunk->fresh
+* - the footer of the free block that reaches the end of the chunk
+* Only those words need clearing when a block reaches past chunk->fresh
+*/
+void zeroBlk(blk_hdr *blk, blk_size_t size) {
+	chunk_t *c = CHUNK_OF(blk);
+	char *payload = (char*)blk + sizeof(blk_hdr);
+	char *end = (char*)blk + size;
+	char *dirty_end = c->fresh + sizeof(blk_hdr) + FREE_LINKS_SIZE;
+
+	if (dirty_end >= end) {
+		memset(payload, 0, end - payload);
+		return;
+	}
+	if (dirty_end > payload) {
+		memset(payload, 0, dirty_end - payload);
+	}
+	//The footer of the free block the payload was carved from, if it ended here
+	memset(end - sizeof(blk_hdr), 0, sizeof(blk_hdr));
+}
+
+/*
+* Function that cuts the leading slack off a free block so that the rest
+* starts with a payload aligned to align
+* The slack goes back to the bins as a free block of its own
+* Argument - ar: Arena owning the block
+* Argument - blk: Header of the free block, already removed from its bin
+* Argument - align: Power of two larger than ALIGNMENT
+* Returns the header of the rest, a free block that is not in any bin
+*/
+blk_hdr* splitLead(arena_t *ar, blk_hdr *blk, size_t align) {
+	uintptr_t payload = (uintptr_t)blk + sizeof(blk_hdr);
+	uintptr_t aligned = (payload + align - 1) & ~((uintptr_t)align - 1);
+	blk_hdr *rest;
+	blk_size_t lead;
+
+	//The slack must be able to stand on its own as a free block
+	while (aligned != payload && aligned - payload < MIN_BLK_SIZE) {
+		aligned += align;
+	}
+	lead = (blk_size_t)(aligned - payload);
+	if (lead == 0) {
+		return blk;
+	}
+
+	//The rest sees a free block before it
+	rest = (blk_hdr *)((char*)blk + lead);
+	rest->size_status = BLK_SIZE(blk) - lead;
+
+	//Keep the previous block's status in the slack's header
+	blk->size_status = lead + (blk->size_status & 2);
+	createFooter(blk);
+	insertFreeBlk(ar, blk);
+	ar->splits++;
+
+	return rest;
+}
+
+/*
+* Function that carves a block out of an arena
+* The caller must hold the arena's lock
+* Argument - ar: Arena to allocate from
+* Argument - size: Block size (header included, a multiple of ALIGNMENT, at least MIN_BLK_SIZE)
+* Argument - align: Alignment of the payload, a power of two of at least ALIGNMENT
+* Argument - zero: Non-zero to clear the payload
+* Returns the header of the allocated block, or NULL if the arena has no fit
+* - Look up the best free block which can accommodate the requested size in the bins
+* - For a larger alignment the block must have room for the leading slack as well
+* - Also, when allocating a block - split it into two blocks
+*/
+blk_hdr* allocBlk(arena_t *ar, blk_size_t size, size_t align, int zero) {
+	blk_hdr *best_blk = NULL;	//Pointer to best fit block
+	blk_hdr *next_blk;
+	blk_hdr *split_blk_hdr;		//Pointer to splitted block's header
+	blk_size_t best_size;		//Size of the best fitting block
+	blk_size_t size_diff;
+	blk_size_t pad = 0;			//Room for the leading slack of an aligned block
+	chunk_t *c;
+
+	if (align > ALIGNMENT) {
+		pad = (blk_size_t)align + MIN_BLK_SIZE;
+	}
+
+	//A block from the quick lists fits exactly and is marked busy already
+	if (pad == 0 && size <= QUICK_MAX_SIZE && ar->quick[size / ALIGNMENT] != NULL) {
+		best_blk = ar->quick[size / ALIGNMENT];
+		ar->quick[size / ALIGNMENT] = LINKS(best_blk)->next;
+		ar->quick_bytes -= size;
+		LINKS(best_blk)->prev = NULL;
+		if (zero) {
+			zeroBlk(best_blk, size);
+		}
+		return best_blk;
+	}
+
+	//Larger requests search the large bins, which parked blocks would split
+	//into many small pieces; merge the quick lists first
+	if (size + pad > QUICK_MAX_SIZE && ar->quick_bytes != 0) {
+		consolidateQuick(ar);
+	}
+
+	//Blocks on the quick lists may coalesce into a suitable one
+	best_blk = findFit(ar, size + pad);
+	if (best_blk == NULL && ar->quick_bytes != 0) {
+		consolidateQuick(ar);
+		best_blk = findFit(ar, size + pad);
+	}
+
+	//If no bin holds a suitable block; failure.
+	if (best_blk == NULL) {
+		return NULL;
+	}
+
+	removeFreeBlk(ar, best_blk);
+	if (pad != 0) {
+		best_blk = splitLead(ar, best_blk, align);
+	}
+	best_size = BLK_SIZE(best_blk);
+	size_diff = best_size - size;
+
+	//Begin allocation and splitting
+
+	//Splitting is unnecessary if the size of the splitted block would be too small;
+	//treat as a perfect fit
+	if (size_diff < MIN_BLK_SIZE) {
+
+		//Change last bit to indicate the block is busy
+		//The SLB still reflects the status of the previous block
+		best_blk->size_status += 1;
+
+		//Since the current block is a perfect fit, the immediate next block's SLB must be updated	
+		next_blk = (blk_hdr *)((char*)best_blk + best_size);
+		if (next_blk->size_status != 1) {
+			next_blk->size_status += 2;	//Change SLB to indicate the previous block is busy
+		}
+	}
+
+	//Splitting required
+	else {
+
+		//Split the block based on the free space left after allocation
+		//Update LSB to 1 to reflect busy status and keep the previous block's status
+		best_blk->size_status = size + 1 + (best_blk->size_status & 2);
+
+		//Move the split block header pointer to just after the newly allocated block
+		//Update its size_status to reflect its size/status and the previous block's busy status
+		split_blk_hdr = (blk_hdr *)((char*)best_blk + size);
+		split_blk_hdr->size_status = size_diff;
+		split_blk_hdr->size_status += 2;
+
+		//Create a footer for the split block and put it in its bin
+		createFooter(split_blk_hdr);
+		insertFreeBlk(ar, split_blk_hdr);
+		ar->splits++;
+	}
+	countBusy(ar, BLK_SIZE(best_blk), 1);
+
+	//Keep track of the memory that has never been handed out
+	c = CHUNK_OF(best_blk);
+	if (zero) {
+		zeroBlk(best_blk, BLK_SIZE(best_blk));
+	}
+	if ((char*)best_blk + BLK_SIZE(best_blk) > c->fresh) {
+		c->fresh = (char*)best_blk + BLK_SIZE(best_blk);
+	}
+
+	return best_blk;
+}
+
+
+/*
+* Function that returns the size of the chunk to map when an arena has no fit
+* Argument - size: Size of the block that did not fit
+*/
+size_t growSize(blk_size_t size) {
+	size_t chunk_size = size + CHUNK_HDR_SIZE + ALIGNMENT;
+	size_t unit = huge_pages_enabled ? HUGE_PAGE_SIZE : pagesize;
+
+	if (chunk_size < GROW_SIZE) {
+		chunk_size = GROW_SIZE;
+	}
+	return (chunk_size + unit - 1) / unit * unit;
+}
+
+/*
+* Function that gives a large request a page aligned mapping of its own
+* Argument - size: Requested payload size
+* Argument - align: Alignment of the payload, a power of two of at least ALIGNMENT
+* Returns the address of the payload, or NULL on failure
+* Alignments beyond the page size are met by over-mapping and unmapping
+* the pages around the aligned range
+*/
+void* mapLarge(size_t size, size_t align) {
+	size_t map_size;
+	size_t extra = 0;		//Over-mapping for alignments beyond the page size
+	char *space_ptr;
+	char *ptr;
+	char *base;
+	char *end;
+	blk_hdr *blk;
+
+	if (align > (size_t)pagesize) {
+		extra = align;
+	}
+
+	//Guard against overflow when rounding up
+	if (size > SIZE_MAX - MMAP_HDR_SIZE - pagesize - align - extra) {
+		atomic_fetch_add_explicit(&alloc_failures, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	map_size = (((MMAP_HDR_SIZE + align - 1) & ~(align - 1)) + size + extra + pagesize - 1) / pagesize * pagesize;
+	space_ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (space_ptr == MAP_FAILED) {
+		atomic_fetch_add_explicit(&alloc_failures, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	//Place the payload and give back the pages outside its range
+	ptr = (char*)(((uintptr_t)space_ptr + MMAP_HDR_SIZE + align - 1) & ~((uintptr_t)align - 1));
+	base = MMAP_BASE(ptr);
+	end = base + ((ptr - base) + size + pagesize - 1) / pagesize * pagesize;
+	if (base != space_ptr) {
+		munmap(space_ptr, base - space_ptr);
+	}
+	if (end != space_ptr + map_size) {
+		munmap(end, space_ptr + map_size - end);
+	}
+
+	//Remember the size for munmap and tag the header
+	MMAP_SIZE(ptr) = end - base;
+	blk = (blk_hdr*)(ptr - sizeof(blk_hdr));
+	blk->size_status = MMAPPED + 1;
+
+	atomic_fetch_add_explicit(&mapped_bytes, end - base, memory_order_relaxed);
+	atomic_fetch_add_explicit(&mapped_blocks, 1, memory_order_relaxed);
+
+	return ptr;
+}
+
+/*
+* Function that turns a requested payload size into a block size
+* Argument - size: Requested payload size (at most mmap_threshold)
+* Returns the block size, header included, a multiple of ALIGNMENT and at least MIN_BLK_SIZE
+*/
+blk_size_t blkSizeFor(size_t size) {
+	size += sizeof(blk_hdr);	//Block header is always used, therefore its size must be added
+
+	if (size % ALIGNMENT != 0) {	//Round size up to a multiple of ALIGNMENT
+		size += (ALIGNMENT - size % ALIGNMENT);
+	}
+
+	//The block must be able to hold the free list links once it is freed
+	if (size < MIN_BLK_SIZE) {
+		size = MIN_BLK_SIZE;
+	}
+	return (blk_size_t)size;
+}
+
+/*
+* Function that allocates a block from the heap
+* Argument - size: Block size (header included, a multiple of ALIGNMENT, at least MIN_BLK_SIZE)
+* Argument - align: Alignment of the payload, a power of two of at least ALIGNMENT
+* Argument - zero: Non-zero to clear the payload
+* Returns the header of the block, or NULL if the heap is exhausted
+* - Allocate from the calling thread's arena, growing it if it is full
+* - Use any other arena if the heap cannot grow
+*/
+blk_hdr* heapAlloc(blk_size_t size, size_t align, int zero) {
+	arena_t *ar;			//Arena of the calling thread
+	blk_hdr *blk = NULL;	//Allocated block
+	int i;
+
+	ar = threadArena();
+	pthread_mutex_lock(&ar->lock);
+	drainRemoteFrees(ar);
+	blk = allocBlk(ar, size, align, zero);
+
+	//The thread's own arena is full; map another chunk for it
+	if (blk == NULL && growArena(ar, growSize(size + (align > ALIGNMENT ? align + MIN_BLK_SIZE : 0))) == 0) {
+		blk = allocBlk(ar, size, align, zero);
+	}
+	pthread_mutex_unlock(&ar->lock);
+
+	//No memory left to map; try the other arenas before giving up
+	for (i = 0; blk == NULL && i < num_arenas; i++) {
+		if (&arenas[i] != ar) {
+			pthread_mutex_lock(&arenas[i].lock);
+			drainRemoteFrees(&arenas[i]);
+			blk = allocBlk(&arenas[i], size, align, zero);
+			pthread_mutex_unlock(&arenas[i].lock);
+		}
+	}
+
+	if (blk == NULL) {
+		atomic_fetch_add_explicit(&alloc_failures, 1, memory_order_relaxed);
+	}
+	return blk;
+}
+
+/*
+* Function that takes a block from the calling thread's cache
+* Argument - bin: Cache bin, the block size divided by ALIGNMENT
+* Returns the header of the block, or NULL if the bin is empty
+*/
+blk_hdr* tcachePop(int bin) {
+	blk_hdr *blk = tcache.entries[bin];
+
+	if (blk != NULL) {
+		tcache.entries[bin] = LINKS(blk)->next;
+		tcache.counts[bin]--;
+		atomic_store_explicit(&tcache.bytes, tcache.bytes - (size_t)bin * ALIGNMENT, memory_order_relaxed);
+
+		//Clear the key so the block is not mistaken for a cached one
+		LINKS(blk)->prev = NULL;
+	}
+	return blk;
+}
+
+/*
+* Function that refills an empty bin of the calling thread's cache
+* Takes the arena's lock once for TCACHE_REFILL blocks: parked blocks of
+* the size first, then a run carved out of a single free block
+* Argument - bin: Cache bin, the block size divided by ALIGNMENT
+* Returns the header of one of the blocks, the rest are cached
+* Returns NULL on failure
+*/
+blk_hdr* tcacheRefill(int bin) {
+	void *run[TCACHE_REFILL];
+	blk_size_t size = (blk_size_t)bin * ALIGNMENT;
+	blk_size_t blk_size;
+	arena_t *ar = threadArena();
+	blk_hdr *blk;
+	size_t n = 0;
+	size_t i;
+
+	pthread_mutex_lock(&ar->lock);
+	drainRemoteFrees(ar);
+	while (n < TCACHE_REFILL && ar->quick[bin] != NULL && (blk = allocBlk(ar, size, ALIGNMENT, 0)) != NULL) {
+		run[n++] = (char*)blk + sizeof(blk_hdr);
+	}
+	if (n < TCACHE_REFILL) {
+		n += carveBatch(ar, size, TCACHE_REFILL - n, run + n);
+	}
+	pthread_mutex_unlock(&ar->lock);
+
+	//The arena is full; let heapAlloc grow it or try the others
+	if (n == 0) {
+		return heapAlloc(size, ALIGNMENT, 0);
+	}
+
+	if (!tcache.registered) {
+		tcacheRegister();
+	}
+	for (i = n - 1; i > 0; i--) {
+		//The last block of a run may have taken a leftover too small to split off
+		blk = (blk_hdr *)((char*)run[i] - sizeof(blk_hdr));
+		blk_size = BLK_SIZE(blk);
+		if (blk_size > TCACHE_MAX_SIZE || tcache.counts[blk_size / ALIGNMENT] >= TCACHE_COUNT) {
+			Mem_Free(run[i]);
+			continue;
+		}
+		LINKS(blk)->next = tcache.entries[blk_size / ALIGNMENT];
+		LINKS(blk)->prev = tcache_key;
+		tcache.entries[blk_size / ALIGNMENT] = blk;
+		tcache.counts[blk_size / ALIGNMENT]++;
+		atomic_store_explicit(&tcache.bytes, tcache.bytes + blk_size, memory_order_relaxed);
+	}
+	return (blk_hdr *)((char*)run[0] - sizeof(blk_hdr));
+}
+
+/*
+* Function for allocating 'size' bytes
+* Returns address of allocated block on success
+* Returns NULL on failure
+* - Check for sanity of size - Return NULL when appropriate
+* - Sizes above mmap_threshold are mapped directly
+* - Round up size to a multiple of ALIGNMENT
+* - Small blocks are taken from the calling thread's cache, which is refilled
+*   TCACHE_REFILL blocks at a time when it runs empty
+* - Otherwise allocate from the heap
+*/
+void* Mem_Alloc(size_t size) {
+	blk_hdr *blk = NULL;	//Allocated block
+
+	if (size == 0 || num_arenas == 0) {	//Invalid size input or no heap; return NULL
+		return shared_heap != NULL ? sharedAlloc(size) : NULL;
+	}
+
+	//A single branch while the profiler is off
+	if (sample_interval != 0 && sampleDue(size)) {
+		return sampleAlloc(size, ALIGNMENT, 0, __builtin_return_address(0));
+	}
+
+	//Large requests get a mapping of their own
+	if (size > mmap_threshold) {
+		return mapLarge(size, ALIGNMENT);
+	}
+
+	size = blkSizeFor(size);
+
+	//Small blocks come straight from the thread cache, no lock needed
+	if (size <= TCACHE_MAX_SIZE) {
+		blk = tcachePop((int)(size / ALIGNMENT));
+		if (blk == NULL) {
+			blk = tcacheRefill((int)(size / ALIGNMENT));
+		}
+	}
+	else {
+		blk = heapAlloc((blk_size_t)size, ALIGNMENT, 0);
+	}
+	if (blk == NULL) {
+		return NULL;
+	}
+
+	//Return address right after block header
+	return (char*)blk + sizeof(blk_hdr);
+}
+
+/*
+* Function for allocating a small block of a size class worked out in
+* advance with MEM_SIZE_CLASS, which skips the checks and rounding of Mem_Alloc
+* Argument - size_class: Block size divided by ALIGNMENT; from
+*   MIN_BLK_SIZE / ALIGNMENT to TCACHE_MAX_SIZE / ALIGNMENT
+* Returns address of allocated block on success
+* Returns NULL on failure or if there is no such class
+*/
+void* Mem_AllocClass(int size_class) {
+	blk_size_t size = (blk_size_t)size_class * ALIGNMENT;
+	blk_hdr *blk;
+
+	if (size_class < (int)(MIN_BLK_SIZE / ALIGNMENT) || size > TCACHE_MAX_SIZE || num_arenas == 0) {
+		return NULL;
+	}
+	if (sample_interval != 0 && sampleDue(size - sizeof(blk_hdr))) {
+		return sampleAlloc(size - sizeof(blk_hdr), ALIGNMENT, 0, __builtin_return_address(0));
+	}
+
+	blk = tcachePop(size_class);
+	if (blk == NULL && (blk = tcacheRefill(size_class)) == NULL) {
+		return NULL;
+	}
+	return (char*)blk + sizeof(blk_hdr);
+}
+
+/*
+* Function for allocating 'size' bytes aligned to 'align'
+* Argument - align: Alignment of the payload, a power of two
+* Argument - size: Requested payload size
+* Returns address of allocated block on success
+* Returns NULL on failure or if align is not a power of two
+* - Alignments up to ALIGNMENT are met by every block
+* - Otherwise carve the aligned payload out of a free block with room for
+*   the leading slack, which becomes a free block of its own
+* - Large requests get a mapping of their own, aligned as asked
+*/
+void* Mem_AlignedAlloc(size_t align, size_t size) {
+	blk_hdr *blk;
+
+	if (align == 0 || (align & (align - 1)) != 0) {
+		return NULL;
+	}
+	if (align <= ALIGNMENT) {
+		return Mem_Alloc(size);
+	}
+	if (size == 0 || num_arenas == 0) {
+		return NULL;
+	}
+	if (sample_interval != 0 && sampleDue(size)) {
+		return sampleAlloc(size, align, 0, __builtin_return_address(0));
+	}
+
+	//Requests whose slack alone would need a large block are mapped
+	if (size > mmap_threshold || align > mmap_threshold - size) {
+		return mapLarge(size, align);
+	}
+
+	blk = heapAlloc(blkSizeFor(size), align, 0);
+	if (blk == NULL) {
+		return NULL;
+	}
+	return (char*)blk + sizeof(blk_hdr);
+}
+
+/*
+* Function that carves a run of busy blocks out of a single free block
+* The caller must hold the arena's lock
+* Argument - ar: Arena to allocate from
+* Argument - size: Size of every block (header included, a multiple of ALIGNMENT)
+* Argument - n: Number of blocks wanted
+* Argument - out: Where the payload addresses are stored
+* Returns the number of blocks carved, 0 if no free block holds even one
+* - A free block that holds all n blocks is preferred, otherwise the
+*   largest free block is used up
+* - Every block gets its header written once; only the leftover at the
+*   end of the run becomes a free block with a footer
+*/
+size_t carveBatch(arena_t *ar, blk_size_t size, size_t n, void **out) {
+	blk_hdr *free_blk = NULL;
+	blk_hdr *blk;
+	blk_hdr *next_blk;
+	blk_size_t free_size;
+	blk_size_t left;
+	blk_size_t prev_bit;
+	size_t count;
+	size_t i;
+	chunk_t *c;
+
+	if (n <= (size_t)((BLK_SIZE_MAX - MIN_BLK_SIZE) / size)) {
+		free_blk = findFit(ar, (blk_size_t)(n * size));
+	}
+	if (free_blk == NULL) {
+		free_blk = largestFree(ar);
+		if (free_blk == NULL || BLK_SIZE(free_blk) < size) {
+			return 0;
+		}
+	}
+	removeFreeBlk(ar, free_blk);
+
+	free_size = BLK_SIZE(free_blk);
+	count = free_size / size;
+	if (count > n) {
+		count = n;
+	}
+	left = free_size - (blk_size_t)(count * size);
+
+	//The first block keeps the previous block's status, all others follow a busy block
+	prev_bit = free_blk->size_status & 2;
+	blk = free_blk;
+	for (i = 0; i < count; i++) {
+		blk->size_status = size + 1 + prev_bit;
+		out[i] = (char*)blk + sizeof(blk_hdr);
+		prev_bit = 2;
+		blk = (blk_hdr *)((char*)blk + size);
+	}
+
+	if (left >= MIN_BLK_SIZE) {
+		//The leftover stays free; the block after it still sees a free block
+		blk->size_status = left + 2;
+		createFooter(blk);
+		insertFreeBlk(ar, blk);
+		ar->splits += count;
+		countBusy(ar, size, (int)count);
+	}
+	else {
+		//Too small to stand on its own; the last block takes it
+		blk = (blk_hdr *)((char*)blk - size);
+		blk->size_status += left;
+		next_blk = (blk_hdr *)((char*)blk + BLK_SIZE(blk));
+		if (next_blk->size_status != 1) {
+			next_blk->size_status += 2;	//Change SLB to indicate the previous block is busy
+		}
+		ar->splits += count - 1;
+		countBusy(ar, size, (int)count - 1);
+		countBusy(ar, BLK_SIZE(blk), 1);
+	}
+
+	//Keep track of the memory that has never been handed out
+	c = CHUNK_OF(free_blk);
+	if ((char*)free_blk + (free_size - left) > c->fresh) {
+		c->fresh = (char*)free_blk + (free_size - left);
+	}
+	return count;
+}
+
+/*
+* Function that allocates n blocks of the same size in one go
+* Argument - size: Requested payload size of every block
+* Argument - n: Number of blocks
+* Argument - out: Where the n payload addresses are stored
+* Returns the number of blocks allocated; less than n only if the heap is
+* exhausted. Every block can be freed on its own
+* The blocks come from the calling thread's arena under a single lock and
+* mostly from one free block, so they are neighbours in memory
+*/
+size_t Mem_AllocBatch(size_t size, size_t n, void **out) {
+	arena_t *ar;
+	blk_size_t blk_size;
+	size_t done = 0;
+	size_t count;
+	size_t want;
+
+	if (size == 0 || num_arenas == 0 || out == NULL) {
+		return 0;
+	}
+
+	//Large requests get mappings of their own anyway
+	if (size > mmap_threshold) {
+		while (done < n && (out[done] = mapLarge(size, ALIGNMENT)) != NULL) {
+			done++;
+		}
+		return done;
+	}
+
+	blk_size = blkSizeFor(size);
+	ar = threadArena();
+	pthread_mutex_lock(&ar->lock);
+	drainRemoteFrees(ar);
+	while (done < n) {
+		count = carveBatch(ar, blk_size, n - done, out + done);
+		if (count == 0) {
+			//Map a chunk large enough for the rest of the batch, within reason
+			want = n - done;
+			if (want > (size_t)((CHUNK_ALIGN / 2) / blk_size)) {
+				want = (size_t)((CHUNK_ALIGN / 2) / blk_size);
+			}
+			if (growArena(ar, growSize((blk_size_t)(want * blk_size))) != 0) {
+				break;
+			}
+			continue;
+		}
+		done += count;
+	}
+	pthread_mutex_unlock(&ar->lock);
+
+	//No memory left to map; let Mem_Alloc try the other arenas
+	while (done < n && (out[done] = Mem_Alloc(size)) != NULL) {
+		done++;
+	}
+	return done;
+}
+
+/*
+* Function for allocating an array of 'nmemb' elements of 'size' bytes each,
+* with all bytes set to zero
+* Returns address of allocated block on success
+* Returns NULL on failure or if the size of the array overflows
+* - Memory of a new mapping or never handed out before is zero already,
+*   so only the words the allocator itself wrote there are cleared
+* - Blocks from the thread cache are cleared in full
+*/
+void* Mem_Calloc(size_t nmemb, size_t size) {
+	void *ptr;
+	blk_hdr *blk;
+	size_t total;
+	int bin;
+
+	if (nmemb == 0 || size == 0 || (num_arenas == 0 && shared_heap == NULL)) {
+		return NULL;
+	}
+	if (nmemb > SIZE_MAX / size) {
+		return NULL;
+	}
+	total = nmemb * size;
+
+	//Blocks of the shared heap may have been used before
+	if (num_arenas == 0) {
+		ptr = sharedAlloc(total);
+		return ptr != NULL ? memset(ptr, 0, total) : NULL;
+	}
+	if (sample_interval != 0 && sampleDue(total)) {
+		return sampleAlloc(total, ALIGNMENT, 1, __builtin_return_address(0));
+	}
+
+	//A fresh mapping is zero-filled by the OS
+	if (total > mmap_threshold) {
+		return mapLarge(total, ALIGNMENT);
+	}
+
+	blk = NULL;
+	bin = (int)(blkSizeFor(total) / ALIGNMENT);
+	if (bin < TCACHE_BINS && (blk = tcachePop(bin)) != NULL) {
+		memset((char*)blk + sizeof(blk_hdr), 0, BLK_SIZE(blk) - sizeof(blk_hdr));
+	}
+	else {
+		blk = heapAlloc(blkSizeFor(total), ALIGNMENT, 1);
+		if (blk == NULL) {
+			return NULL;
+		}
+	}
+	return (char*)blk + sizeof(blk_hdr);
+}
+
+/*
+* Function that returns a busy block to its arena
+* The caller must hold the arena's lock
+* Argument - ar: Arena owning the block
+* Argument - free_blk: Header of the busy block
+* Returns 0 on success and -1 on failure
+* - Mark the block as free
+* - Coalesce if one or both of the immediate neighbours are free
+*/
+int freeBlk(arena_t *ar, blk_hdr *free_blk) {
+
+	blk_hdr *prev_blk = NULL;	//Block previous to the one to be freed
+	blk_hdr *prev_blk_ftr = NULL;	
+	blk_hdr *next_blk = NULL;	//Block following the one to be freed
+	int prev_blk_status = 0;	//Status of previous block
+	int next_blk_status = 0;	//Status of next block
+	blk_size_t free_size = 0;
+	blk_size_t prev_size = 0;
+	blk_size_t next_size = 0;
+
+	//Mask two LSBs to find the size of block
+	free_size = BLK_SIZE(free_blk);
+	countBusy(ar, free_size, -1);
+
+	//Check if previous block is allocated by bitmasking
+	if ((free_blk->size_status & 2) == 2) {
+		prev_blk_status = 1;	
+	}
+	else {
+		//Point to the footer of the previous block and get its size
+		prev_blk_ftr = free_blk - 1;
+		prev_size = prev_blk_ftr->size_status;	
+
+		//Point to the header of the previous block
+		prev_blk = (blk_hdr *)((char*)prev_blk_ftr - (prev_size - sizeof(blk_hdr)));	
+	}
+
+	//Determine status of next block
+	next_blk = (blk_hdr *)((char*)free_blk + free_size);
+	next_blk_status = (next_blk->size_status) & 1;
+	//Mask two LSBs to find the size of next block if block is free
+	next_size = BLK_SIZE(next_blk);
+	
+	//Coalescing
+
+	if ((next_blk_status == 1) && (prev_blk_status == 1)) {	
+		//Both neighbors are allocated so coalescing is unnecessary
+		//Simply set the LSB of the block's size status to 0 and the SLB to 1,
+		//freeing the block and indicating the previous block's allocation
+		free_blk->size_status = free_size + 2;
+
+		//Must also update the next block to reflect the current block's free status
+		next_blk->size_status = next_size + next_blk_status;
+		//Create a footer
+		createFooter(free_blk);
+		insertFreeBlk(ar, free_blk);
+
+	} else if ((next_blk_status == 1) && (prev_blk_status == 0)) {
+		//Only the previous block is free, and needs to be coalesced
+
+		//Update prev block's header & footer to indicate the new size after merging
+		//The merged block belongs to a different bin, so it is relinked
+		removeFreeBlk(ar, prev_blk);
+		prev_blk->size_status += free_size;
+		createFooter(prev_blk);
+
+		//Update middle block to ensure it cannot be read as allocated
+		//It lies in the merged block's payload now, where the tree links of
+		//a large block may be, so it is written before the block is inserted
+		free_blk->size_status = free_size + 2;
+		insertFreeBlk(ar, prev_blk);
+		ar->coalesces++;
+
+		//Update next block's size status to indicate the previous merged block is free
+		next_blk->size_status = next_size + next_blk_status;
+
+	} else if ((next_blk_status == 0) && (prev_blk_status == 1)) {
+		//Only the next block is free, and needs to be coalesced
+
+		//Update middle/freed block's header & footer to indicate merged size
+		//The next block is absorbed, so it must leave its bin
+		removeFreeBlk(ar, next_blk);
+		free_blk->size_status = free_size + next_size + 2;
+		createFooter(free_blk);
+		insertFreeBlk(ar, free_blk);
+		ar->coalesces++;
+
+	} else if ((next_blk_status == 0) && (prev_blk_status == 0)) {
+		//Both neighbors are free so all must be coalesced
+		removeFreeBlk(ar, prev_blk);
+		removeFreeBlk(ar, next_blk);
+		prev_blk->size_status += (free_size + next_size);
+		createFooter(prev_blk);
+
+		//Update middle block to ensure it cannot be read as allocated,
+		//before the tree links of the merged block are written
+		free_blk->size_status = free_size + 2;
+		insertFreeBlk(ar, prev_blk);
+		ar->coalesces += 2;
+	}
+
+	else {
+		printf("Error in Mem_Free.");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+* Function that frees every block on the quick lists of an arena, which
+* coalesces them with their neighbours and puts them in the bins
+* The caller must hold the arena's lock
+* Argument - ar: Arena whose quick lists to merge
+*/
+void consolidateQuick(arena_t *ar) {
+	blk_hdr *blk;
+	int bin;
+
+	for (bin = 0; bin < QUICK_BINS; bin++) {
+		while ((blk = ar->quick[bin]) != NULL) {
+			ar->quick[bin] = LINKS(blk)->next;
+			freeBlk(ar, blk);
+		}
+	}
+	ar->quick_bytes = 0;
+}
+
+/*
+* Function that tells whether a block is on one of the quick lists
+* The caller must hold the arena's lock
+* Argument - ar: Arena owning the block
+* Argument - blk: Busy block
+*/
+int onQuickList(arena_t *ar, blk_hdr *blk) {
+	blk_hdr *curr_blk;
+
+	if (LINKS(blk)->prev != quick_key || BLK_SIZE(blk) > QUICK_MAX_SIZE) {
+		return 0;
+	}
+	for (curr_blk = ar->quick[BLK_SIZE(blk) / ALIGNMENT]; curr_blk != NULL; curr_blk = LINKS(curr_blk)->next) {
+		if (curr_blk == blk) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+* Function that frees a busy block, parking it on a quick list if it is small
+* The caller must hold the arena's lock
+* Argument - ar: Arena owning the block
+* Argument - blk: Busy block to free
+*/
+void deferBlk(arena_t *ar, blk_hdr *blk) {
+	blk_size_t size = BLK_SIZE(blk);
+
+	//Full quick lists take no more blocks, rather than being merged all at once
+	if (defer_coalesce_enabled && size <= QUICK_MAX_SIZE && ar->quick_bytes + size <= QUICK_MAX_BYTES) {
+		LINKS(blk)->next = ar->quick[size / ALIGNMENT];
+		LINKS(blk)->prev = quick_key;
+		ar->quick[size / ALIGNMENT] = blk;
+		ar->quick_bytes += size;
+		return;
+	}
+
+	freeBlk(ar, blk);
+
+	//Large free blocks are worth more once their small neighbours join them
+	if (size >= QUICK_CONSOLIDATE_SIZE && ar->quick_bytes != 0) {
+		consolidateQuick(ar);
+	}
+}
+
+/*
+* Function that frees the blocks queued on an arena's remote_frees stack
+* The caller must hold the arena's lock
+* Argument - ar: Arena to drain
+*/
+void drainRemoteFrees(arena_t *ar) {
+	blk_hdr *blk;
+	blk_hdr *next_blk;
+
+	//Cheap check first; most of the time nothing is queued
+	if (atomic_load_explicit(&ar->remote_frees, memory_order_relaxed) == NULL) {
+		return;
+	}
+
+	//Take the whole stack at once; pushers only ever add to the head,
+	//so the detached list cannot change under us
+	blk = atomic_exchange_explicit(&ar->remote_frees, NULL, memory_order_acquire);
+	while (blk != NULL) {
+		next_blk = LINKS(blk)->next;
+		deferBlk(ar, blk);
+		blk = next_blk;
+	}
+}
+
+/*
+* Function that returns a busy block to its arena
+* Blocks of the calling thread's arena are freed right away under the lock
+* Blocks of other arenas are pushed onto that arena's remote_frees stack
+* Argument - ar: Arena owning the block
+* Argument - blk: Header of the block
+*/
+void releaseBlk(arena_t *ar, blk_hdr *blk) {
+	blk_hdr *head;
+
+	if (ar != thread_arena && remote_free_enabled) {
+		head = atomic_load_explicit(&ar->remote_frees, memory_order_relaxed);
+		do {
+			LINKS(blk)->next = head;
+		} while (!atomic_compare_exchange_weak_explicit(&ar->remote_frees, &head, blk,
+			memory_order_release, memory_order_relaxed));
+		return;
+	}
+
+	pthread_mutex_lock(&ar->lock);
+	deferBlk(ar, blk);
+	pthread_mutex_unlock(&ar->lock);
+}
+
+/*
+* Function that returns the blocks cached by the calling thread to their arenas
+*/
+void tcacheFlush() {
+	blk_hdr *blk;
+	int bin;
+
+	for (bin = 0; bin < TCACHE_BINS; bin++) {
+		while ((blk = tcache.entries[bin]) != NULL) {
+			tcache.entries[bin] = LINKS(blk)->next;
+			releaseBlk(arenaOf(blk), blk);
+		}
+		tcache.counts[bin] = 0;
+	}
+	atomic_store_explicit(&tcache.bytes, 0, memory_order_relaxed);
+}
+
+/*
+* Function that arms the exit hook of the calling thread's cache and
+* makes the cache known to Mem_GetStats
+*/
+void tcacheRegister() {
+	pthread_setspecific(tcache_exit_key, &tcache);
+	tcache.registered = 1;
+
+	pthread_mutex_lock(&tcache_list_lock);
+	tcache.prev = NULL;
+	tcache.next = tcache_list;
+	if (tcache_list != NULL) {
+		tcache_list->prev = &tcache;
+	}
+	tcache_list = &tcache;
+	pthread_mutex_unlock(&tcache_list_lock);
+}
+
+/*
+* Function that gives the older half of a full bin of the calling thread's
+* cache back to the arenas
+* Blocks of the thread's own arena are freed under a single lock, the others
+* once it is released, so no two arena locks are ever held together
+* Argument - bin: Cache bin to drain
+*/
+void tcacheDrain(int bin) {
+	blk_hdr *keep = tcache.entries[bin];	//Last block that stays cached
+	blk_hdr *blk;
+	blk_hdr *next;
+	blk_hdr *foreign = NULL;				//Blocks of other arenas
+	arena_t *ar = thread_arena;
+	int n = 0;
+	int i;
+
+	for (i = 1; i < TCACHE_COUNT / 2 && keep != NULL; i++) {
+		keep = LINKS(keep)->next;
+	}
+	if (keep == NULL) {
+		return;
+	}
+	blk = LINKS(keep)->next;
+	LINKS(keep)->next = NULL;
+
+	if (ar != NULL) {
+		pthread_mutex_lock(&ar->lock);
+	}
+	for (; blk != NULL; blk = next, n++) {
+		next = LINKS(blk)->next;
+		if (ar != NULL && arenaOf(blk) == ar) {
+			deferBlk(ar, blk);
+		}
+		else {
+			LINKS(blk)->next = foreign;
+			foreign = blk;
+		}
+	}
+	if (ar != NULL) {
+		pthread_mutex_unlock(&ar->lock);
+	}
+	for (blk = foreign; blk != NULL; blk = next) {
+		next = LINKS(blk)->next;
+		releaseBlk(arenaOf(blk), blk);
+	}
+
+	tcache.counts[bin] -= n;
+	atomic_store_explicit(&tcache.bytes, tcache.bytes - (size_t)n * bin * ALIGNMENT, memory_order_relaxed);
+}
+
+/*
+* Thread exit hook; gives the cached blocks of an exiting thread back
+* Argument - arg: Unused, set to the thread's cache
+* A later Mem_Free of the exiting thread arms the hook again
+*/
+void tcacheExit(void *arg) {
+	(void)arg;
+	tcacheFlush();
+
+	pthread_mutex_lock(&tcache_list_lock);
+	if (tcache.prev != NULL) {
+		tcache.prev->next = tcache.next;
+	}
+	else {
+		tcache_list = tcache.next;
+	}
+	if (tcache.next != NULL) {
+		tcache.next->prev = tcache.prev;
+	}
+	pthread_mutex_unlock(&tcache_list_lock);
+	tcache.registered = 0;
+}
+
+/*
+* Function for freeing up a previously allocated block
+* Argument - ptr: Address of the block to be freed up
+* Returns 0 on success
+* Returns -1 on failure
+* - Return -1 if ptr is NULL
+* - Return -1 if ptr is not ALIGNMENT byte aligned, not inside the heap or if the block is already freed
+* - Unmap blocks that have a mapping of their own
+* - Small blocks are parked in the calling thread's cache while it has room
+* - Otherwise the block goes back to its arena and is coalesced there,
+*   or is queued on the arena's remote_frees if it belongs to another thread's arena
+*/
+int Mem_Free(void *ptr) {
+	blk_hdr *free_blk = NULL;	//Block to be freed
+	blk_hdr *curr_blk;
+	arena_t *ar;				//Arena owning the block
+	blk_size_t free_size;
+	int bin;
+
+	//Return error if ptr is null or misaligned
+	if (ptr == NULL || ((uintptr_t)ptr % ALIGNMENT) != 0) {	
+		return -1;
+	}
+
+	//Forget the sample before the address can be handed out again
+	if (atomic_load_explicit(&sampled_live, memory_order_relaxed) != 0) {
+		sampleFree(ptr);
+	}
+
+	//Move pointer backwards to point to header 
+	free_blk = (blk_hdr *)((char *)ptr - sizeof(blk_hdr));
+
+	//Large blocks go straight back to the OS
+	//No heap block has a size_status this small
+	if (free_blk->size_status == MMAPPED + 1) {
+		atomic_fetch_sub_explicit(&mapped_bytes, MMAP_SIZE(ptr), memory_order_relaxed);
+		atomic_fetch_sub_explicit(&mapped_blocks, 1, memory_order_relaxed);
+		munmap(MMAP_BASE(ptr), MMAP_SIZE(ptr));
+		return 0;
+	}
+
+	//Return error if the block is outside of the heap or not busy
+	ar = arenaOf(free_blk);
+	if (ar == NULL && shared_heap != NULL) {
+		return sharedFree(ptr);
+	}
+	if (ar == NULL || ((free_blk->size_status) & 1) != 1) {
+		return -1;
+	}
+
+	//The key suggests the block is on a quick list; return error if it really is
+	if (LINKS(free_blk)->prev == quick_key) {
+		pthread_mutex_lock(&ar->lock);
+		bin = onQuickList(ar, free_blk);
+		pthread_mutex_unlock(&ar->lock);
+		if (bin) {
+			return -1;
+		}
+	}
+
+	free_size = BLK_SIZE(free_blk);
+	if (free_size <= TCACHE_MAX_SIZE) {
+		bin = (int)(free_size / ALIGNMENT);
+
+		//The key suggests the block is cached already; return error if it really is
+		if (LINKS(free_blk)->prev == tcache_key) {
+			for (curr_blk = tcache.entries[bin]; curr_blk != NULL; curr_blk = LINKS(curr_blk)->next) {
+				if (curr_blk == free_blk) {
+					return -1;
+				}
+			}
+		}
+
+		//A full bin gives back its older half at once
+		if (tcache.counts[bin] == TCACHE_COUNT) {
+			tcacheDrain(bin);
+		}
+		if (tcache.counts[bin] < TCACHE_COUNT) {
+			//Arm the exit hook so the cache is flushed when the thread ends
+			if (!tcache.registered) {
+				tcacheRegister();
+			}
+
+			LINKS(free_blk)->next = tcache.entries[bin];
+			LINKS(free_blk)->prev = tcache_key;
+			tcache.entries[bin] = free_blk;
+			tcache.counts[bin]++;
+			atomic_store_explicit(&tcache.bytes, tcache.bytes + free_size, memory_order_relaxed);
+			return 0;
+		}
+	}
+
+	releaseBlk(ar, free_blk);
+	return 0;
+}
+
+/*
+* Function that sorts pointers by address
+* Short arrays get an insertion sort. Longer ones get an LSD radix sort
+* over just the address bits that differ between the pointers, 8 bits per
+* pass; a batch of neighbouring blocks needs two or three passes
+* Argument - ptrs: Pointers to sort
+* Argument - n: Number of pointers
+* Argument - scratch: Room for n pointers
+*/
+void sortPtrs(void **ptrs, size_t n, void **scratch) {
+	size_t count[256];
+	uintptr_t min_addr = UINTPTR_MAX;
+	uintptr_t span = 0;			//Bits that differ from min_addr
+	void **src = ptrs;
+	void **dst = scratch;
+	void **tmp;
+	size_t i, j, sum, c;
+	int shift;
+
+	if (n <= 32) {
+		for (i = 1; i < n; i++) {
+			tmp = ptrs[i];
+			for (j = i; j > 0 && (uintptr_t)ptrs[j - 1] > (uintptr_t)tmp; j--) {
+				ptrs[j] = ptrs[j - 1];
+			}
+			ptrs[j] = tmp;
+		}
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((uintptr_t)ptrs[i] < min_addr) {
+			min_addr = (uintptr_t)ptrs[i];
+		}
+	}
+	for (i = 0; i < n; i++) {
+		span |= (uintptr_t)ptrs[i] - min_addr;
+	}
+	if (span == 0) {
+		return;
+	}
+
+	for (shift = lowBit64(span); shift <= highBit(span); shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++) {
+			count[(((uintptr_t)src[i] - min_addr) >> shift) & 255]++;
+		}
+		for (i = 0, sum = 0; i < 256; i++) {
+			c = count[i];
+			count[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++) {
+			dst[count[(((uintptr_t)src[i] - min_addr) >> shift) & 255]++] = src[i];
+		}
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+	if (src != ptrs) {
+		memcpy(ptrs, src, n * sizeof(void*));
+	}
+}
+
+/*
+* Function that frees n blocks in one go
+* Argument - ptrs: Blocks to free, in any order; NULL entries are skipped.
+* The array is sorted by address in place, in windows of FREE_BATCH_WINDOW
+* entries if no scratch space could be allocated for the whole batch
+* Argument - n: Number of entries
+* Returns 0 on success and -1 if any entry could not be freed, in which
+* case all the other entries are freed nonetheless
+* - Blocks of the same arena are freed under one lock
+* - A run of blocks that are neighbours in memory is merged into one busy
+*   block first, which is then freed and coalesced once
+* - The blocks bypass the thread cache
+*/
+#define FREE_BATCH_WINDOW 256
+
+int Mem_FreeBatch(void **ptrs, size_t n) {
+	void *stack_buf[FREE_BATCH_WINDOW];
+	void **scratch = stack_buf;		//Room for the radix sort
+	size_t window = FREE_BATCH_WINDOW;
+	size_t end;
+	arena_t *ar = NULL;		//Arena whose lock is held
+	arena_t *blk_ar;
+	blk_hdr *run_blk;		//First block of the current run
+	blk_hdr *blk;
+	blk_hdr *curr_blk;
+	blk_size_t run_size;
+	size_t i;
+	int ret = 0;
+
+	if (ptrs == NULL) {
+		return n == 0 ? 0 : -1;
+	}
+	if (atomic_load_explicit(&sampled_live, memory_order_relaxed) != 0) {
+		for (i = 0; i < n; i++) {
+			sampleFree(ptrs[i]);
+		}
+	}
+	if (n > window && n <= SIZE_MAX / sizeof(void*) && (scratch = Mem_Alloc(n * sizeof(void*))) != NULL) {
+		window = n;
+	}
+	else {
+		scratch = stack_buf;
+	}
+	for (i = 0, end = 0; i < n; ) {
+		if (i == end) {
+			end = n - i > window ? i + window : n;
+			sortPtrs(ptrs + i, end - i, scratch);
+		}
+		if (ptrs[i] == NULL) {
+			i++;
+			continue;
+		}
+
+		//Same checks as Mem_Free; large blocks are unmapped one by one
+		blk = (blk_hdr *)((char *)ptrs[i] - sizeof(blk_hdr));
+		if (((uintptr_t)ptrs[i] % ALIGNMENT) != 0 || blk->size_status == MMAPPED + 1) {
+			if (Mem_Free(ptrs[i++]) != 0) {
+				ret = -1;
+			}
+			continue;
+		}
+		blk_ar = arenaOf(blk);
+		if (blk_ar == NULL) {
+			ret = -1;
+			i++;
+			continue;
+		}
+		if (blk_ar != ar) {
+			if (ar != NULL) {
+				pthread_mutex_unlock(&ar->lock);
+			}
+			ar = blk_ar;
+			pthread_mutex_lock(&ar->lock);
+		}
+
+		//Blocks that are free already or sit in the thread cache or on a quick list are double frees
+		if ((blk->size_status & 1) != 1 || (i > 0 && ptrs[i - 1] == ptrs[i]) || onQuickList(ar, blk)) {
+			ret = -1;
+			i++;
+			continue;
+		}
+		if (BLK_SIZE(blk) <= TCACHE_MAX_SIZE && LINKS(blk)->prev == tcache_key) {
+			for (curr_blk = tcache.entries[BLK_SIZE(blk) / ALIGNMENT]; curr_blk != NULL && curr_blk != blk;
+				curr_blk = LINKS(curr_blk)->next) {
+			}
+			if (curr_blk == blk) {
+				ret = -1;
+				i++;
+				continue;
+			}
+		}
+
+		//Extend the run while the next entry is the next block in memory
+		run_blk = blk;
+		run_size = BLK_SIZE(blk);
+		countBusy(ar, run_size, -1);
+		for (i++; i < end && ptrs[i] == (char*)run_blk + run_size + sizeof(blk_hdr); i++) {
+			blk = (blk_hdr *)((char*)run_blk + run_size);
+			if ((blk->size_status & 1) != 1 || LINKS(blk)->prev == quick_key ||
+				(BLK_SIZE(blk) <= TCACHE_MAX_SIZE && LINKS(blk)->prev == tcache_key)) {
+				break;	//Free or possibly cached; leave it to the checks above
+			}
+			countBusy(ar, BLK_SIZE(blk), -1);
+			run_size += BLK_SIZE(blk);
+			ar->coalesces++;
+		}
+
+		//One busy block that covers the run, freed as a whole
+		run_blk->size_status = run_size + 1 + (run_blk->size_status & 2);
+		countBusy(ar, run_size, 1);
+		freeBlk(ar, run_blk);
+	}
+
+	if (ar != NULL) {
+		pthread_mutex_unlock(&ar->lock);
+	}
+	if (scratch != stack_buf) {
+		Mem_Free(scratch);
+	}
+	return ret;
+}
+
+/*
+* Function that returns the number of bytes a block can hold
+* Argument - ptr: Address of a busy block
+* Returns the usable size, which may exceed the size asked for
+* Returns 0 if ptr is NULL, misaligned or not a busy block
+*/
+size_t Mem_UsableSize(void *ptr) {
+	blk_hdr *blk;
+
+	if (ptr == NULL || ((uintptr_t)ptr % ALIGNMENT) != 0) {
+		return 0;
+	}
+
+	blk = (blk_hdr *)((char *)ptr - sizeof(blk_hdr));
+	if (blk->size_status == MMAPPED + 1) {
+		return MMAP_SIZE(ptr) - ((char*)ptr - MMAP_BASE(ptr));
+	}
+	if (arenaOf(blk) == NULL && shared_heap != NULL) {
+		blk = sharedBlk(ptr);
+		return blk != NULL ? BLK_SIZE(blk) - sizeof(blk_hdr) : 0;
+	}
+	if (arenaOf(blk) == NULL || ((blk->size_status) & 1) != 1) {
+		return 0;
+	}
+	return BLK_SIZE(blk) - sizeof(blk_hdr);
+}
+
+/*
+* Function that resizes a block that has a mapping of its own
+* The pages are moved by the kernel if the mapping cannot grow where it is,
+* so the payload is never copied
+* Argument - ptr: Payload of the block
+* Argument - size: New payload size
+* Returns the (possibly moved) payload, or NULL on failure
+*/
+void* remapLarge(void *ptr, size_t size) {
+	char *space_ptr = MMAP_BASE(ptr);
+	size_t old_map_size = MMAP_SIZE(ptr);
+	size_t lead = (char*)ptr - space_ptr;	//Offset of the payload into the mapping
+	size_t map_size;
+
+	//Guard against overflow when rounding up
+	if (size > SIZE_MAX - lead - pagesize) {
+		return NULL;
+	}
+
+	map_size = (size + lead + pagesize - 1) / pagesize * pagesize;
+	if (map_size == old_map_size) {
+		return ptr;
+	}
+
+#ifdef MREMAP_MAYMOVE
+	space_ptr = mremap(space_ptr, old_map_size, map_size, MREMAP_MAYMOVE);
+	if (space_ptr == MAP_FAILED) {
+		return NULL;
+	}
+#else
+	//Without mremap a mapping can only give back its tail
+	if (map_size > old_map_size) {
+		return NULL;
+	}
+	munmap(space_ptr + map_size, old_map_size - map_size);
+#endif
+
+	ptr = space_ptr + lead;
+	MMAP_SIZE(ptr) = map_size;
+	atomic_fetch_add_explicit(&mapped_bytes, map_size - old_map_size, memory_order_relaxed);
+	return ptr;
+}
+
+/*
+* Function that resizes a block in place, without moving its payload
+* The caller must hold the arena's lock
+* Argument - ar: Arena owning the block
+* Argument - blk: Header of the busy block
+* Argument - size: New block size (header included, a multiple of ALIGNMENT, at least MIN_BLK_SIZE)
+* Returns 0 on success and -1 if the block cannot grow where it is
+* - Shrink by splitting off the tail as a free block
+* - Grow by absorbing the next block if it is free and large enough,
+*   splitting off whatever is left over
+*/
+int resizeBlk(arena_t *ar, blk_hdr *blk, blk_size_t size) {
+	blk_hdr *next_blk;
+	blk_hdr *split_blk_hdr;		//Pointer to splitted block's header
+	blk_size_t blk_size = BLK_SIZE(blk);
+	blk_size_t next_size;
+
+	if (size <= blk_size) {
+		//Splitting is unnecessary if the tail would be too small; keep the block as it is
+		if (blk_size - size < MIN_BLK_SIZE) {
+			return 0;
+		}
+
+		//Shrink the block, keeping its busy bit and the previous block's status
+		blk->size_status = size + (blk->size_status & 3);
+		countBusy(ar, blk_size, -1);
+		countBusy(ar, size, 1);
+
+		//Turn the tail into a busy block of its own and free it, which
+		//coalesces it with the next block if that one is free
+		split_blk_hdr = (blk_hdr *)((char*)blk + size);
+		split_blk_hdr->size_status = (blk_size - size) + 2 + 1;
+		countBusy(ar, blk_size - size, 1);
+		ar->splits++;
+		return freeBlk(ar, split_blk_hdr);
+	}
+
+	//Growing needs a free next block that makes up the difference
+	next_blk = (blk_hdr *)((char*)blk + blk_size);
+	if ((next_blk->size_status & 1) != 0) {
+		return -1;
+	}
+	next_size = BLK_SIZE(next_blk);
+	if (blk_size + next_size < size) {
+		return -1;
+	}
+
+	//The next block is absorbed, so it must leave its bin
+	removeFreeBlk(ar, next_blk);
+	countBusy(ar, blk_size, -1);
+	ar->coalesces++;
+	blk_size += next_size;
+
+	if (blk_size - size < MIN_BLK_SIZE) {
+		//Take the whole next block; the block after it sees a busy block now
+		blk->size_status = blk_size + (blk->size_status & 3);
+		next_blk = (blk_hdr *)((char*)blk + blk_size);
+		if (next_blk->size_status != 1) {
+			next_blk->size_status += 2;	//Change SLB to indicate the previous block is busy
+		}
+	}
+	else {
+		//Split off the rest; the block after it still sees a free block
+		blk->size_status = size + (blk->size_status & 3);
+		split_blk_hdr = (blk_hdr *)((char*)blk + size);
+		split_blk_hdr->size_status = (blk_size - size) + 2;
+		createFooter(split_blk_hdr);
+		insertFreeBlk(ar, split_blk_hdr);
+		ar->splits++;
+	}
+	countBusy(ar, BLK_SIZE(blk), 1);
+
+	//Keep track of the memory that has never been handed out
+	if ((char*)blk + BLK_SIZE(blk) > CHUNK_OF(blk)->fresh) {
+		CHUNK_OF(blk)->fresh = (char*)blk + BLK_SIZE(blk);
+	}
+	return 0;
+}
+
+/*
+* Function for resizing a previously allocated block
+* Argument - ptr: Address of the block, or NULL to allocate a new one
+* Argument - size: New size of the block in bytes
+* Returns the address of the resized block, which may differ from ptr
+* Returns NULL on failure; the old block is left untouched then
+* - A size of 0 frees the block and returns NULL
+* - Blocks with a mapping of their own are remapped
+* - Heap blocks shrink in place, and grow in place if the next block is free
+* - Otherwise allocate a new block, copy the payload over and free the old block
+*/
+void* Mem_Realloc(void *ptr, size_t size) {
+	blk_hdr *blk;			//Block to be resized
+	arena_t *ar;			//Arena owning the block
+	size_t copy_size;		//Payload bytes to carry over when moving
+	void *new_ptr;
+	int resized;
+
+	if (ptr == NULL) {
+		return Mem_Alloc(size);
+	}
+	if (size == 0) {
+		Mem_Free(ptr);
+		return NULL;
+	}
+
+	//A resized object is no longer profiled; it may move in ways Mem_Free never sees
+	if (atomic_load_explicit(&sampled_live, memory_order_relaxed) != 0) {
+		sampleFree(ptr);
+	}
+
+	//Return error if ptr is misaligned
+	if (((uintptr_t)ptr % ALIGNMENT) != 0) {
+		return NULL;
+	}
+
+	blk = (blk_hdr *)((char *)ptr - sizeof(blk_hdr));
+
+	if (blk->size_status == MMAPPED + 1) {
+		//Large blocks keep their own mapping; small ones move back to the heap
+		if (size > mmap_threshold) {
+			new_ptr = remapLarge(ptr, size);
+			if (new_ptr != NULL) {
+				return new_ptr;
+			}
+		}
+		copy_size = MMAP_SIZE(ptr) - ((char*)ptr - MMAP_BASE(ptr));
+	}
+	else {
+		//Return error if the block is outside of the heap or not busy
+		ar = arenaOf(blk);
+		if (ar == NULL && shared_heap != NULL) {
+			return sharedRealloc(ptr, size);
+		}
+		if (ar == NULL || ((blk->size_status) & 1) != 1) {
+			return NULL;
+		}
+
+		if (size <= mmap_threshold) {
+			pthread_mutex_lock(&ar->lock);
+			resized = resizeBlk(ar, blk, blkSizeFor(size));
+			pthread_mutex_unlock(&ar->lock);
+			if (resized == 0) {
+				return ptr;
+			}
+		}
+		copy_size = BLK_SIZE(blk) - sizeof(blk_hdr);
+	}
+
+	//Move the payload to a new block
+	new_ptr = Mem_Alloc(size);
+	if (new_ptr == NULL) {
+		return NULL;
+	}
+	memcpy(new_ptr, ptr, copy_size < size ? copy_size : size);
+	Mem_Free(ptr);
+	return new_ptr;
+}
+
+/*
+* Bump pointer arenas (Mem_Arena)
+* An arena hands out objects from the current one of its blocks by moving
+* cur forward; a block is taken from the heap with Mem_Alloc once the
+* current one is full. Objects larger than a quarter of a block get a heap
+* block of their own, so a block never wastes more than a quarter
+* Mem_ArenaReset keeps the blocks for reuse and makes the current block
+* empty again; apart from the large objects this is O(1), however many
+* objects the arena holds
+*/
+#define REGION_BLOCK_SIZE (64 * 1024)
+#define REGION_MIN_BLOCK_SIZE 1024
+
+typedef struct region_blk region_blk;
+
+struct region_blk {
+	region_blk *next;
+	char *end;				//End of the block's payload
+};
+
+#define REGION_HDR_SIZE ((sizeof(region_blk) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+struct Mem_Arena {
+	char *cur;				//Next free byte of the current block
+	char *end;				//End of the current block
+	region_blk *blocks;		//Blocks in use, the current one first
+	region_blk *last;		//Block in use the longest, where the list ends
+	region_blk *spare;		//Blocks given back by Mem_ArenaReset
+	region_blk *large;		//Blocks holding a single large object
+	size_t block_size;
+};
+
+/*
+* Function that creates an empty arena
+* Argument - block_size: Size of the blocks taken from the heap, 0 for the
+* default of 64 KB
+* Returns the arena, or NULL if the heap is exhausted
+*/
+Mem_Arena* Mem_ArenaCreate(size_t block_size) {
+	Mem_Arena *arena;
+
+	if (block_size == 0) {
+		block_size = REGION_BLOCK_SIZE;
+	}
+	if (block_size < REGION_MIN_BLOCK_SIZE) {
+		block_size = REGION_MIN_BLOCK_SIZE;
+	}
+
+	arena = Mem_Alloc(sizeof(Mem_Arena));
+	if (arena == NULL) {
+		return NULL;
+	}
+	arena->cur = NULL;
+	arena->end = NULL;
+	arena->blocks = NULL;
+	arena->last = NULL;
+	arena->spare = NULL;
+	arena->large = NULL;
+	arena->block_size = block_size;
+	return arena;
+}
+
+/*
+* Function that serves an arena allocation the current block has no room for
+* Argument - arena: Arena to allocate from
+* Argument - size: Size of the object, a multiple of ALIGNMENT
+* Returns the address of the object, or NULL if the heap is exhausted
+*/
+void* regionRefill(Mem_Arena *arena, size_t size) {
+	region_blk *blk;
+
+	//Large objects would leave too much of a block unused
+	if (size > arena->block_size / 4) {
+		if (size > SIZE_MAX - REGION_HDR_SIZE) {
+			return NULL;
+		}
+		blk = Mem_Alloc(REGION_HDR_SIZE + size);
+		if (blk == NULL) {
+			return NULL;
+		}
+		blk->end = (char*)blk + REGION_HDR_SIZE + size;
+		blk->next = arena->large;
+		arena->large = blk;
+		return (char*)blk + REGION_HDR_SIZE;
+	}
+
+	//Start a new block; the rest of the current one is left unused
+	if (arena->spare != NULL) {
+		blk = arena->spare;
+		arena->spare = blk->next;
+	}
+	else {
+		blk = Mem_Alloc(arena->block_size);
+		if (blk == NULL) {
+			return NULL;
+		}
+		blk->end = (char*)blk + arena->block_size;
+	}
+	blk->next = arena->blocks;
+	arena->blocks = blk;
+	if (arena->last == NULL) {
+		arena->last = blk;
+	}
+
+	arena->cur = (char*)blk + REGION_HDR_SIZE + size;
+	arena->end = blk->end;
+	return (char*)blk + REGION_HDR_SIZE;
+}
+
+/*
+* Function that allocates an object from an arena
+* Argument - arena: Arena to allocate from
+* Argument - size: Size of the object in bytes
+* Returns the address of the object, aligned like Mem_Alloc's, or NULL if
+* size is 0 or the heap is exhausted
+* The object lives until the arena is reset or destroyed
+*/
+void* Mem_ArenaAlloc(Mem_Arena *arena, size_t size) {
+	void *ptr;
+
+	if (size == 0 || size > SIZE_MAX - ALIGNMENT) {
+		return NULL;
+	}
+	size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+	if (size <= (size_t)(arena->end - arena->cur)) {
+		ptr = arena->cur;
+		arena->cur += size;
+		return ptr;
+	}
+	return regionRefill(arena, size);
+}
+
+/*
+* Function that frees all objects of an arena at once
+* Argument - arena: Arena to reset
+* The blocks stay with the arena and are reused by later allocations
+*/
+void Mem_ArenaReset(Mem_Arena *arena) {
+	region_blk *blk;
+
+	while (arena->large != NULL) {
+		blk = arena->large;
+		arena->large = blk->next;
+		Mem_Free(blk);
+	}
+
+	if (arena->blocks == NULL) {
+		return;
+	}
+
+	//Keep the current block and move all the others to the spares in one go
+	if (arena->blocks != arena->last) {
+		arena->last->next = arena->spare;
+		arena->spare = arena->blocks->next;
+		arena->blocks->next = NULL;
+		arena->last = arena->blocks;
+	}
+	arena->cur = (char*)arena->blocks + REGION_HDR_SIZE;
+}
+
+/*
+* Function that frees an arena along with all its objects and blocks
+* Argument - arena: Arena to destroy, may be NULL
+*/
+void Mem_ArenaDestroy(Mem_Arena *arena) {
+	region_blk *blk;
+
+	if (arena == NULL) {
+		return;
+	}
+
+	Mem_ArenaReset(arena);
+	if (arena->blocks != NULL) {
+		Mem_Free(arena->blocks);
+	}
+	while (arena->spare != NULL) {
+		blk = arena->spare;
+		arena->spare = blk->next;
+		Mem_Free(blk);
+	}
+	Mem_Free(arena);
+}
+
+/*
+* Shared heap, see Mem_InitShared
+* The heap is a single file mapping shared by every process that maps it.
+* It starts with a shared_hdr and is laid out in blocks like the chunks,
+* with the same headers, footers and status bits. Sizes are relative and
+* free list links are offsets from the start of the mapping, so each
+* process may map the file at any address
+* A process shared, robust mutex in the header guards the heap. The lock
+* holder sets dirty while it changes the heap; if it dies with the lock
+* held, the next process to take the lock rebuilds the free lists from the
+* block headers. Every change keeps the headers walkable: a split writes
+* the remainder's header before it shrinks the block, and a merge only
+* grows a header
+* Objects of a process that dies are not freed
+*/
+#define SHARED_MAGIC 0x31445248534d454dULL	//"MEMSHRD1"
+
+struct shared_hdr {
+	uint64_t magic;				//SHARED_MAGIC once the heap is laid out
+	uint32_t alignment;			//Layout of the build that laid it out
+	uint32_t hdr_size;
+	uint64_t size;				//Bytes of the whole mapping
+	pthread_mutex_t lock;
+	int dirty;					//Set while the lock holder changes the heap
+	uint64_t bins[NUM_BINS];	//Offset of the first free block of every bin, 0 if empty
+	uint64_t bin_map;
+	uint64_t root;				//Offset of the root object, 0 if there is none
+};
+
+typedef struct shared_links {
+	uint64_t next;				//Offsets of the neighbours in the bin, 0 if none
+	uint64_t prev;
+} shared_links;
+
+#define SHARED_FIRST (((sizeof(shared_hdr) + sizeof(blk_hdr) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)) - sizeof(blk_hdr))
+#define SHARED_MIN_BLK_SIZE ((blk_size_t)((2 * sizeof(blk_hdr) + sizeof(shared_links) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)))
+#define SHARED_BLK(off) ((blk_hdr *)((char *)shared_heap + (off)))
+#define SHARED_OFF(blk) ((uint64_t)((char *)(blk) - (char *)shared_heap))
+#define SHARED_LINKS(blk) ((shared_links *)((char *)(blk) + sizeof(blk_hdr)))
+#define SHARED_END() ((blk_hdr *)((char *)shared_heap + shared_heap->size - sizeof(blk_hdr)))
+
+
+/* Function that puts a free block of the shared heap on its bin */
+void sharedInsert(blk_hdr *blk) {
+	int bin = binIndex(BLK_SIZE(blk));
+	uint64_t head = shared_heap->bins[bin];
+
+	SHARED_LINKS(blk)->next = head;
+	SHARED_LINKS(blk)->prev = 0;
+	if (head != 0) {
+		SHARED_LINKS(SHARED_BLK(head))->prev = SHARED_OFF(blk);
+	}
+	shared_heap->bins[bin] = SHARED_OFF(blk);
+	shared_heap->bin_map |= (uint64_t)1 << bin;
+}
+
+/* Function that takes a free block of the shared heap off its bin */
+void sharedRemove(blk_hdr *blk) {
+	int bin = binIndex(BLK_SIZE(blk));
+	shared_links *links = SHARED_LINKS(blk);
+
+	if (links->prev != 0) {
+		SHARED_LINKS(SHARED_BLK(links->prev))->next = links->next;
+	}
+	else {
+		shared_heap->bins[bin] = links->next;
+		if (links->next == 0) {
+			shared_heap->bin_map &= ~((uint64_t)1 << bin);
+		}
+	}
+	if (links->next != 0) {
+		SHARED_LINKS(SHARED_BLK(links->next))->prev = links->prev;
+	}
+}
+
+/*
+* Function that finds the best fit in the shared heap, like findBestFit
+* Returns the header of the block, or NULL if no free block is large enough
+*/
+blk_hdr* sharedFindFit(blk_size_t size) {
+	int bin = binIndex(size);
+	uint64_t candidates;
+	uint64_t off;
+	blk_hdr *best_blk = NULL;
+	blk_hdr *curr_blk;
+
+	//Only the bin of the request holds blocks that may be too small
+	for (off = shared_heap->bins[bin]; off != 0; off = SHARED_LINKS(curr_blk)->next) {
+		curr_blk = SHARED_BLK(off);
+		if (BLK_SIZE(curr_blk) >= size && (best_blk == NULL || BLK_SIZE(curr_blk) < BLK_SIZE(best_blk))) {
+			best_blk = curr_blk;
+		}
+	}
+	if (best_blk != NULL || bin + 1 == NUM_BINS) {
+		return best_blk;
+	}
+
+	candidates = shared_heap->bin_map & (~(uint64_t)0 << (bin + 1));
+	if (candidates == 0) {
+		return NULL;
+	}
+	for (off = shared_heap->bins[lowBit64(candidates)]; off != 0; off = SHARED_LINKS(curr_blk)->next) {
+		curr_blk = SHARED_BLK(off);
+		if (best_blk == NULL || BLK_SIZE(curr_blk) < BLK_SIZE(best_blk)) {
+			best_blk = curr_blk;
+		}
+	}
+	return best_blk;
+}
+
+/*
+* Function that rebuilds the free lists of the shared heap from its block
+* headers, after a process died while changing it
+* Neighbouring free blocks are merged and the prev-busy bits set again
+*/
+void sharedRebuild() {
+	blk_hdr *blk = SHARED_BLK(SHARED_FIRST);
+	blk_hdr *free_blk = NULL;	//Free block that is being extended
+	blk_hdr *end = SHARED_END();
+	blk_size_t prev_bit = 2;
+
+	memset(shared_heap->bins, 0, sizeof(shared_heap->bins));
+	shared_heap->bin_map = 0;
+
+	while (blk < end) {
+		if (blk->size_status & 1) {
+			if (free_blk != NULL) {
+				createFooter(free_blk);
+				sharedInsert(free_blk);
+				free_blk = NULL;
+			}
+			blk->size_status = (blk->size_status & ~(blk_size_t)2) | prev_bit;
+			prev_bit = 2;
+		}
+		else if (free_blk != NULL) {
+			free_blk->size_status += BLK_SIZE(blk);
+		}
+		else {
+			free_blk = blk;
+			blk->size_status = BLK_SIZE(blk) | prev_bit;
+			prev_bit = 0;
+		}
+		blk = (blk_hdr *)((char *)blk + BLK_SIZE(blk));
+	}
+	if (free_blk != NULL) {
+		createFooter(free_blk);
+		sharedInsert(free_blk);
+	}
+}
+
+/*
+* Functions that take and release the lock of the shared heap
+* A lock left behind by a dead process is taken over, after a rebuild if
+* the process was changing the heap
+* sharedLock returns 0 once the lock is held and -1 if it cannot be taken,
+* e.g. when the mutex is no longer recoverable
+*/
+int sharedLock() {
+	int err = pthread_mutex_lock(&shared_heap->lock);
+
+	if (err == EOWNERDEAD) {
+		if (shared_heap->dirty) {
+			sharedRebuild();
+		}
+		pthread_mutex_consistent(&shared_heap->lock);
+	}
+	else if (err != 0) {
+		return -1;
+	}
+	shared_heap->dirty = 1;
+	return 0;
+}
+
+void sharedUnlock() {
+	shared_heap->dirty = 0;
+	pthread_mutex_unlock(&shared_heap->lock);
+}
+
+/*
+* Function that allocates from the shared heap, for Mem_Alloc
+* Returns the payload address, or NULL on failure
+*/
+void* sharedAlloc(size_t size) {
+	blk_hdr *blk;
+	blk_hdr *next_blk;
+	blk_size_t blk_size;
+
+	if (size == 0 || size > shared_heap->size) {
+		return NULL;
+	}
+	blk_size = blkSizeFor(size);
+	if (blk_size < SHARED_MIN_BLK_SIZE) {
+		blk_size = SHARED_MIN_BLK_SIZE;
+	}
+
+	if (sharedLock() != 0) {
+		return NULL;
+	}
+	blk = sharedFindFit(blk_size);
+	if (blk == NULL) {
+		sharedUnlock();
+		return NULL;
+	}
+	sharedRemove(blk);
+
+	if (BLK_SIZE(blk) - blk_size >= SHARED_MIN_BLK_SIZE) {
+		//The remainder is laid out before the block shrinks
+		next_blk = (blk_hdr *)((char *)blk + blk_size);
+		next_blk->size_status = (BLK_SIZE(blk) - blk_size) + 2;
+		createFooter(next_blk);
+		blk->size_status = blk_size + 1 + (blk->size_status & 2);
+		sharedInsert(next_blk);
+	}
+	else {
+		blk->size_status += 1;
+		next_blk = (blk_hdr *)((char *)blk + BLK_SIZE(blk));
+		if (next_blk->size_status != 1) {
+			next_blk->size_status += 2;
+		}
+	}
+	sharedUnlock();
+	return (char *)blk + sizeof(blk_hdr);
+}
+
+/*
+* Function that returns the header of a busy block of the shared heap
+* Returns NULL if ptr is not the payload of such a block
+*/
+blk_hdr* sharedBlk(void *ptr) {
+	blk_hdr *blk = (blk_hdr *)((char *)ptr - sizeof(blk_hdr));
+
+	if (blk < SHARED_BLK(SHARED_FIRST) || blk >= SHARED_END() || ((uintptr_t)ptr % ALIGNMENT) != 0 ||
+		(blk->size_status & 1) != 1) {
+		return NULL;
+	}
+	return blk;
+}
+
+/*
+* Function that frees a block of the shared heap and coalesces it with
+* its free neighbours, for Mem_Free
+* Returns 0 on success and -1 if ptr is not a busy block of the heap
+*/
+int sharedFree(void *ptr) {
+	blk_hdr *blk;
+	blk_hdr *next_blk;
+	blk_hdr *prev_blk;
+
+	if (sharedLock() != 0) {
+		return -1;
+	}
+	blk = sharedBlk(ptr);
+	if (blk == NULL) {
+		sharedUnlock();
+		return -1;
+	}
+
+	next_blk = (blk_hdr *)((char *)blk + BLK_SIZE(blk));
+	if (next_blk->size_status != 1 && (next_blk->size_status & 1) == 0) {
+		sharedRemove(next_blk);
+		blk->size_status += BLK_SIZE(next_blk);
+	}
+	blk->size_status -= 1;
+
+	if ((blk->size_status & 2) == 0) {
+		prev_blk = (blk_hdr *)((char *)blk - BLK_SIZE((blk_hdr *)((char *)blk - sizeof(blk_hdr))));
+		sharedRemove(prev_blk);
+		prev_blk->size_status += BLK_SIZE(blk);
+		blk = prev_blk;
+	}
+	createFooter(blk);
+	sharedInsert(blk);
+
+	next_blk = (blk_hdr *)((char *)blk + BLK_SIZE(blk));
+	if (next_blk->size_status != 1) {
+		next_blk->size_status &= ~(blk_size_t)2;
+	}
+	sharedUnlock();
+	return 0;
+}
+
+/*
+* Function that resizes a block of the shared heap, for Mem_Realloc
+* Blocks that are large enough already stay where they are
+* Returns the address of the block, or NULL on failure
+*/
+void* sharedRealloc(void *ptr, size_t size) {
+	blk_hdr *blk;
+	size_t usable;
+	void *new_ptr;
+
+	if (sharedLock() != 0) {
+		return NULL;
+	}
+	blk = sharedBlk(ptr);
+	usable = blk != NULL ? BLK_SIZE(blk) - sizeof(blk_hdr) : 0;
+	sharedUnlock();
+	if (blk == NULL) {
+		return NULL;
+	}
+	if (size <= usable) {
+		return ptr;
+	}
+
+	new_ptr = sharedAlloc(size);
+	if (new_ptr != NULL) {
+		memcpy(new_ptr, ptr, usable);
+		sharedFree(ptr);
+	}
+	return new_ptr;
+}
+
+/*
+* Function used to set up the allocator on a heap shared between processes,
+* in place of Mem_Init
+* Argument - path: File backing the heap, e.g. /dev/shm/<name> for a shared
+*   memory segment; created if it does not exist
+* Argument - size: Size of a new heap in bytes, rounded up to the page size;
+*   ignored when the file holds a heap already
+* Returns 0 on success and -1 on failure, or if the file holds something
+*   other than a heap laid out by a build with the same block layout
+* A file whose creator died before it finished the layout holds no heap
+* yet and is laid out again
+* An existing heap is attached as it is, live objects and all. From then on
+* Mem_Alloc, Mem_Calloc, Mem_Free, Mem_Realloc and Mem_UsableSize work on
+* the shared heap; it does not grow, and has no thread caches, arenas or
+* statistics. Pointers stored inside it must be offsets (Mem_SharedOffset),
+* and Mem_SharedRoot finds a well known object again after a restart
+*/
+int Mem_InitShared(const char *path, size_t size) {
+	pthread_mutexattr_t attr;
+	struct stat st;
+	shared_hdr *heap;
+	blk_hdr *blk;
+	uint64_t magic = 0;
+	int fresh;
+	int fd;
+
+	if (shared_heap != NULL || num_arenas != 0 || path == NULL) {
+		return -1;
+	}
+	pagesize = (int)sysconf(_SC_PAGESIZE);
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		return -1;
+	}
+
+	//Only one process lays out a new heap; the others wait for it
+	if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+		close(fd);
+		return -1;
+	}
+	//magic is written last, so a file without it was never laid out: its creator died first
+	fresh = st.st_size == 0 || (pread(fd, &magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && magic == 0);
+	if (fresh) {
+		if (size > (size_t)BLK_SIZE_MAX || size > SIZE_MAX - pagesize) {
+			close(fd);
+			return -1;
+		}
+		size = (size + pagesize - 1) & ~((size_t)pagesize - 1);
+		if (size < SHARED_FIRST + SHARED_MIN_BLK_SIZE + sizeof(blk_hdr) || ftruncate(fd, size) == -1) {
+			close(fd);
+			return -1;
+		}
+	}
+	else {
+		size = (size_t)st.st_size;
+	}
+
+	heap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (heap == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	if (!fresh) {
+		if (heap->magic != SHARED_MAGIC || heap->alignment != ALIGNMENT || heap->hdr_size != sizeof(blk_hdr) ||
+			heap->size != size) {
+			munmap(heap, size);
+			close(fd);
+			return -1;
+		}
+	}
+	else {
+		memset(heap, 0, sizeof(shared_hdr));
+		heap->alignment = ALIGNMENT;
+		heap->hdr_size = sizeof(blk_hdr);
+		heap->size = size;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&heap->lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+
+		//One free block from the header to the end mark
+		shared_heap = heap;
+		blk = SHARED_BLK(SHARED_FIRST);
+		blk->size_status = (blk_size_t)(size - SHARED_FIRST - sizeof(blk_hdr)) + 2;
+		createFooter(blk);
+		SHARED_END()->size_status = 1;
+		sharedInsert(blk);
+		heap->magic = SHARED_MAGIC;
+		msync(heap, size, MS_ASYNC);
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+	shared_heap = heap;
+	return 0;
+}
+
+/*
+* Functions that convert between pointers into the shared heap and offsets,
+* which stay valid in every process and across restarts
+* Mem_SharedOffset returns 0 for NULL or a pointer outside of the heap,
+* and Mem_SharedPtr returns NULL for offset 0
+*/
+size_t Mem_SharedOffset(void *ptr) {
+	if (shared_heap == NULL || ptr == NULL || (char *)ptr < (char *)shared_heap ||
+		(char *)ptr >= (char *)shared_heap + shared_heap->size) {
+		return 0;
+	}
+	return (size_t)((char *)ptr - (char *)shared_heap);
+}
+
+void* Mem_SharedPtr(size_t offset) {
+	if (shared_heap == NULL || offset == 0 || offset >= shared_heap->size) {
+		return NULL;
+	}
+	return (char *)shared_heap + offset;
+}
+
+/*
+* Functions that get and set the root object of the shared heap, from which
+* a process that attaches finds the rest of the data
+*/
+void* Mem_SharedRoot() {
+	return shared_heap != NULL ? Mem_SharedPtr((size_t)shared_heap->root) : NULL;
+}
+
+int Mem_SharedSetRoot(void *ptr) {
+	if (shared_heap == NULL || (ptr != NULL && Mem_SharedOffset(ptr) == 0)) {
+		return -1;
+	}
+	if (sharedLock() != 0) {
+		return -1;
+	}
+	shared_heap->root = Mem_SharedOffset(ptr);
+	sharedUnlock();
+	return 0;
+}
+
+/*
+* Function that maps memory aligned to CHUNK_ALIGN
+* Argument - size: Size of the mapping (a multiple of the page size, at most CHUNK_ALIGN)
+* Returns the start of the mapping, or NULL on failure
+*/
+void* mapAligned(size_t size) {
+	char *space_ptr;
+	char *aligned_ptr;
+	size_t lead;
+
+	//Over-map by CHUNK_ALIGN and cut away what lies outside the aligned range
+	space_ptr = mmap(NULL, size + CHUNK_ALIGN, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (space_ptr == MAP_FAILED) {
+		return NULL;
+	}
+
+	aligned_ptr = (char*)(((uintptr_t)space_ptr + CHUNK_ALIGN - 1) & ~((uintptr_t)CHUNK_ALIGN - 1));
+	lead = aligned_ptr - space_ptr;
+	if (lead != 0) {
+		munmap(space_ptr, lead);
+	}
+	if (CHUNK_ALIGN - lead != 0) {
+		munmap(aligned_ptr + size, CHUNK_ALIGN - lead);
+	}
+
+#ifdef MADV_HUGEPAGE
+	//Only a hint; the kernel may not have transparent huge pages
+	if (huge_pages_enabled) {
+		madvise(aligned_ptr, size, MADV_HUGEPAGE);
+	}
+#endif
+	return aligned_ptr;
+}
+
+/*
+* Function that maps a new chunk and adds it to an arena
+* The caller must hold the arena's lock (or be the only thread around)
+* Argument - ar: Arena to grow
+* Argument - size: Size of the chunk (a multiple of the page size, at most CHUNK_ALIGN)
+* Returns 0 on success and -1 on failure
+*/
+int growArena(arena_t *ar, size_t size) {
+	chunk_t *c;
+	blk_hdr *first_blk;
+	blk_hdr* end_mark;
+	blk_size_t alloc_size;
+	int slot;
+
+	c = (chunk_t*)mapAligned(size);
+	if (c == NULL) {
+		return -1;
+	}
+	c->next = NULL;
+	c->arena = ar;
+	c->size = size;
+	c->fresh = (char*)CHUNK_FIRST_BLK(c);
+
+	// Leave room for the chunk header, and for the pad word and end mark
+	alloc_size = (blk_size_t)(size - CHUNK_HDR_SIZE - ALIGNMENT);
+
+	// To begin with there is only one big free block
+	// initialize the chunk so that the first payload meets 
+	// the ALIGNMENT requirement
+	first_blk = CHUNK_FIRST_BLK(c);
+	end_mark = (blk_hdr*)((char*)first_blk + alloc_size); // changed from void to char
+
+														  // Setting up the header
+	first_blk->size_status = alloc_size;
+
+	// Marking the previous block as busy
+	first_blk->size_status += 2;
+
+	// Setting up the end mark and marking it as busy
+	end_mark->size_status = 1;
+
+	// Setting up the footer
+	blk_hdr *footer = (blk_hdr*)((char*)first_blk + alloc_size - sizeof(blk_hdr));
+	footer->size_status = alloc_size;
+
+	// Register the chunk so Mem_Free can find it
+	pthread_mutex_lock(&chunk_lock);
+	if (num_chunks >= CHUNK_TABLE_SIZE / 2) {
+		pthread_mutex_unlock(&chunk_lock);
+		munmap(c, size);
+		return -1;
+	}
+	for (slot = chunkSlot((uintptr_t)c); atomic_load_explicit(&chunk_table[slot], memory_order_relaxed) != NULL;
+		slot = (slot + 1) & (CHUNK_TABLE_SIZE - 1)) {
+	}
+	atomic_store_explicit(&chunk_table[slot], c, memory_order_release);
+	num_chunks++;
+	pthread_mutex_unlock(&chunk_lock);
+
+	// Append the chunk to the arena; its only block is free
+	if (ar->last_chunk == NULL) {
+		ar->chunks = c;
+	}
+	else {
+		ar->last_chunk->next = c;
+	}
+	ar->last_chunk = c;
+	ar->heap_bytes += alloc_size;
+	insertFreeBlk(ar, first_blk);
+
+	return 0;
+}
+
+/*
+* Function that sets up an empty arena
+* Argument - ar: Arena to set up
+*/
+void initArena(arena_t *ar) {
+	pthread_mutex_init(&ar->lock, NULL);
+	ar->chunks = NULL;
+	ar->last_chunk = NULL;
+	memset(ar->bins, 0, sizeof(ar->bins));
+	ar->bin_map = 0;
+	memset(ar->rovers, 0, sizeof(ar->rovers));
+	memset(ar->trees, 0, sizeof(ar->trees));
+	atomic_init(&ar->remote_frees, NULL);
+	memset(ar->quick, 0, sizeof(ar->quick));
+	ar->quick_bytes = 0;
+	ar->heap_bytes = 0;
+	ar->busy_bytes = 0;
+	ar->splits = 0;
+	ar->coalesces = 0;
+	memset(ar->busy_hist, 0, sizeof(ar->busy_hist));
+	memset(ar->free_hist, 0, sizeof(ar->free_hist));
+}
+
+/*
+* Body of a periodic thread; runs the task every interval_ms milliseconds
+* Argument - arg: The periodic_t
+*/
+void* periodicThread(void *arg) {
+	periodic_t *p = arg;
+	struct timespec deadline;
+	void (*task)(void *arg);
+	void *task_arg;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->running) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += p->interval_ms / 1000;
+		deadline.tv_nsec += (p->interval_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		//Woken early only to stop or to pick up a new interval
+		if (pthread_cond_timedwait(&p->cond, &p->lock, &deadline) == 0 || !p->running) {
+			continue;
+		}
+		task = p->task;
+		task_arg = p->arg;
+		pthread_mutex_unlock(&p->lock);
+		task(task_arg);
+		pthread_mutex_lock(&p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/*
+* Function that starts, changes or stops a periodic thread
+* Argument - p: The thread
+* Argument - interval_ms: Time between two runs of the task; 0 stops the thread
+* Argument - task: Function to run, with arg as its argument
+* Returns 0 on success and -1 on failure
+*/
+int periodicSet(periodic_t *p, long interval_ms, void (*task)(void *arg), void *arg) {
+	int running;
+
+	if (interval_ms < 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	running = p->running;
+	if (interval_ms == 0) {
+		p->running = 0;
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		if (running) {
+			pthread_join(p->thread, NULL);
+		}
+		return 0;
+	}
+
+	p->interval_ms = interval_ms;
+	p->task = task;
+	p->arg = arg;
+	if (running) {
+		pthread_cond_signal(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+		return 0;
+	}
+	p->running = 1;
+	if (pthread_create(&p->thread, NULL, periodicThread, p) != 0) {
+		p->running = 0;
+		pthread_mutex_unlock(&p->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+/*
+* Function that forgets a periodic thread in a forked child, which does
+* not inherit the thread; the thread may have held the lock
+*/
+void periodicForkChild(periodic_t *p) {
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	p->running = 0;
+}
+
+/*
+* Function that gives the free pages of an arena back to the OS
+* Only the interior of a free block is released; its header, links and
+* footer stay where they are, so the heap needs no change. A released
+* page reads as zero when touched again, which calloc relies on anyway
+* The caller must hold the arena's lock
+* Argument - ar: Arena to trim
+* Returns the number of bytes released
+*/
+size_t trimArena(arena_t *ar) {
+	uintptr_t unit = huge_pages_enabled ? HUGE_PAGE_SIZE : pagesize;
+	uintptr_t start;
+	uintptr_t end;
+	uint64_t candidates;
+	blk_hdr *blk;
+	size_t released = 0;
+	int bin;
+
+	//Blocks of the bins below the one of a page are all too small
+	candidates = ar->bin_map & ~(((uint64_t)1 << binIndex((blk_size_t)unit)) - 1);
+	while (candidates != 0) {
+		bin = lowBit64(candidates);
+		candidates &= candidates - 1;
+
+		for (blk = ar->bins[bin]; blk != NULL; blk = LINKS(blk)->next) {
+			start = ((uintptr_t)LINKS(blk) + FREE_LINKS_SIZE + unit - 1) & ~(unit - 1);
+			end = ((uintptr_t)blk + BLK_SIZE(blk) - sizeof(blk_hdr)) & ~(unit - 1);
+			if (end > start && madvise((void*)start, end - start, MADV_DONTNEED) == 0) {
+				released += end - start;
+			}
+		}
+	}
+	return released;
+}
+
+/*
+* Function that gives the free memory of the heap back to the OS
+* Blocks freed by other threads and the quick lists are merged first, so
+* the free blocks are as large as they get
+* Returns the number of bytes released; pages released by an earlier trim
+* and never touched since are counted again
+* The heap keeps its address space; released pages come back on demand
+*/
+size_t Mem_Trim() {
+	size_t released = 0;
+	int i;
+
+	tcacheFlush();
+	for (i = 0; i < num_arenas; i++) {
+		pthread_mutex_lock(&arenas[i].lock);
+		drainRemoteFrees(&arenas[i]);
+		consolidateQuick(&arenas[i]);
+		released += trimArena(&arenas[i]);
+		pthread_mutex_unlock(&arenas[i].lock);
+	}
+	return released;
+}
+
+/* Task of the trim thread, see MEM_OPT_TRIM_INTERVAL */
+void trimTask(void *arg) {
+	(void)arg;
+	Mem_Trim();
+}
+
+/*
+* Fork hooks
+* A child process starts with just the thread that called fork, so every
+* lock must be free then; the parent takes them all before forking and
+* both sides release them afterwards
+*/
+void forkPrepare() {
+	int i;
+
+	for (i = 0; i < num_arenas; i++) {
+		pthread_mutex_lock(&arenas[i].lock);
+	}
+	pthread_mutex_lock(&chunk_lock);
+	pthread_mutex_lock(&tcache_list_lock);
+	pthread_mutex_lock(&sample_lock);
+}
+
+void forkParent() {
+	int i;
+
+	pthread_mutex_unlock(&sample_lock);
+	pthread_mutex_unlock(&tcache_list_lock);
+	pthread_mutex_unlock(&chunk_lock);
+	for (i = num_arenas - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&arenas[i].lock);
+	}
+}
+
+void forkChild() {
+	//The caches of the other threads are gone along with the threads
+	if (tcache.registered) {
+		tcache.next = NULL;
+		tcache.prev = NULL;
+		tcache_list = &tcache;
+	}
+	else {
+		tcache_list = NULL;
+	}
+
+	//Nor are the periodic threads
+	periodicForkChild(&stats_periodic);
+	periodicForkChild(&trim_periodic);
+	forkParent();
+}
+
+/*
+* Function used to initialize the memory allocator
+* Not intended to be called more than once by a program
+* Argument - sizeOfRegion: Specifies the size of the region to map up front
+* Returns 0 on success and -1 on failure
+* The region is split evenly between the arenas; there are ARENAS_PER_CPU
+* arenas per online CPU, but no more than MAX_ARENAS and none smaller than MIN_ARENA_SIZE
+* The heap grows beyond the region on demand, so it need not cover the peak usage
 */
-void* Mem_Alloc(int size) {
-	int best_size = INT_MAX;	//Variable to hold the size of the best fitting block
-	blk_hdr *best_blk = NULL;	//Pointer to best fit block
-	blk_hdr *curr_blk = first_blk;	//Pointer to current block
-	blk_hdr *next_blk;
-	blk_hdr *split_blk_hdr;		//Pointer to splitted block's header
-	int curr_blk_size;			//Size of current block
-	int curr_blk_status;		//Status of current block (0 = free, 1 = allocated)
-	int prev_blk_status = 0;	//Status of block previous to best block
-	int size_diff;
+int Mem_Init(size_t sizeOfRegion) {
+	size_t padsize;
+	size_t alloc_size;
+	size_t arena_size;		//Share of the region for every arena
+	size_t chunk_size;
+	size_t unit;
+	long ncpus;
+	int i;
+	static int allocated_once = 0;
 
-	if (size < 1 || size > MAXSIZE) {	//Invalid size input; return NULL
-		return NULL;
+	if (0 != allocated_once) {
+		fprintf(stderr,
+			"Error:mem.c: Mem_Init has allocated space during a previous call\n");
+		return -1;
+	}
+	if (sizeOfRegion == 0) {
+		fprintf(stderr, "Error:mem.c: Requested block size is not positive\n");
+		return -1;
 	}
 
-	size += sizeof(blk_hdr);	//Block header is always used, therefore its size must be added
+	// Get the pagesize
+	pagesize = (int)sysconf(_SC_PAGESIZE);
 
-	if (size % 8 != 0) {	//Round size up to a multiple of 8
-		size += (8 - size % 8);
-	}
+	// Calculate padsize as the padding required to round up sizeOfRegion 
+	// to a multiple of pagesize
+	padsize = sizeOfRegion % pagesize;
+	padsize = (pagesize - padsize) % pagesize;
 
-	//Search for a suitable mark until the end of the heap is reached
-	while (curr_blk->size_status != 1) {
+	alloc_size = sizeOfRegion + padsize;
 
-		//Mask the 2 least significant bits to get the size of the current block
-		curr_blk_size = (curr_blk->size_status) & 0xFFFFFFFC;
-		//Mask everything except the LSB to determine whether the block is free
-		curr_blk_status = (curr_blk->size_status) & 1;
+	allocated_once = 1;
 
-		//Determine if the current block is a new best by checking if it is:
-		// - large enough to accomodate
-		// - smaller than the current best
-		// - free
-		if ((curr_blk_size >= size) && (curr_blk_size < best_size) && (curr_blk_status == 0)) {
-			best_blk = curr_blk;
-			best_size = curr_blk_size;
+	// Decide on the number of arenas
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1) {
+		ncpus = 1;
+	}
+	num_arenas = (int)(ncpus * ARENAS_PER_CPU);
+	if (num_arenas > MAX_ARENAS) {
+		num_arenas = MAX_ARENAS;
+	}
+	if ((size_t)num_arenas > alloc_size / MIN_ARENA_SIZE) {
+		num_arenas = (int)(alloc_size / MIN_ARENA_SIZE);
+	}
+	if (num_arenas < 1) {
+		num_arenas = 1;
+	}
 
-			//Remember previous block's status
-			if (((best_blk->size_status) & 2) == 2) {
-				prev_blk_status = 1;
-			}
+	// Every share is a whole number of pages, or of huge pages
+	unit = huge_pages_enabled ? HUGE_PAGE_SIZE : pagesize;
+	arena_size = (alloc_size / num_arenas + unit - 1) / unit * unit;
 
-			//No need to continue searching if block size is perfect fit
-			if (best_size == size) {
-				break;
+	for (i = 0; i < num_arenas; i++) {
+		initArena(&arenas[i]);
+
+		// Shares larger than CHUNK_ALIGN take more than one chunk
+		for (alloc_size = arena_size; alloc_size > 0; alloc_size -= chunk_size) {
+			chunk_size = alloc_size < CHUNK_ALIGN ? alloc_size : CHUNK_ALIGN;
+			if (growArena(&arenas[i], chunk_size) == -1) {
+				fprintf(stderr, "Error:mem.c: Cannot map the region\n");
+				return -1;
 			}
 		}
-		//Move to the next block
-		curr_blk = (blk_hdr *)((char*)curr_blk + curr_blk_size);
-	}
-
-	//If best_size is unchanged, no suitable block found; failure.
-	if (best_size == INT_MAX) {
-		return NULL;
 	}
 
-	size_diff = best_size - size;
+	// Key marking cached blocks; any value a payload is unlikely to hold will do
+	tcache_key = (blk_hdr*)((uintptr_t)&tcache_key ^ ((uintptr_t)time(NULL) << 4));
+	quick_key = (blk_hdr*)((uintptr_t)&quick_key ^ ((uintptr_t)time(NULL) << 4));
+	pthread_key_create(&tcache_exit_key, tcacheExit);
 
-	//Begin allocation and splitting
+	pthread_atfork(forkPrepare, forkParent, forkChild);
 
-	//Splitting is unnecessary if the size of the splitted block would be too small;
-	//treat as a perfect fit
-	if (size_diff < MIN_BLK_SIZE) {
+	return 0;
+}
 
-		best_blk->size_status = size;
-		best_blk->size_status += 1;	//Change last bit to indicate the block is busy
+/*
+* Function that changes a tuning option of the allocator
+* Argument - option: One of the MEM_OPT_* constants from memLibrary.h
+* Argument - value: New value of the option
+* Returns 0 on success and -1 if the option is unknown
+*/
+int sampleSetInterval(long interval);
 
-		//If previous block was busy, update best block's size_status
-		if (prev_blk_status == 1) {
-			best_blk->size_status += 2;
+int Mem_SetOption(int option, long value) {
+	switch (option) {
+	case MEM_OPT_REMOTE_FREE:
+		remote_free_enabled = (value != 0);
+		return 0;
+	case MEM_OPT_MMAP_THRESHOLD:
+		//Heap blocks must stay well below the chunk size
+		if (value < 0 || value > MAX_MMAP_THRESHOLD) {
+			return -1;
 		}
-
-		//Since the current block is a perfect fit, the immediate next block's SLB must be updated	
-		next_blk = (blk_hdr *)((char*)best_blk + best_size);
-		if (next_blk->size_status != 1) {
-			next_blk->size_status += 2;	//Change SLB to indicate the previous block is busy
+		mmap_threshold = (size_t)value;
+		return 0;
+	case MEM_OPT_DEFER_COALESCE:
+		defer_coalesce_enabled = (value != 0);
+		return 0;
+	case MEM_OPT_TRIM_INTERVAL:
+		return periodicSet(&trim_periodic, value, trimTask, NULL);
+	case MEM_OPT_HUGE_PAGES:
+		huge_pages_enabled = (value != 0);
+		return 0;
+	case MEM_OPT_PLACEMENT:
+		//The policy shapes the heap, so it cannot change once there is one
+		if (num_arenas != 0 || value < MEM_PLACE_BEST || value > MEM_PLACE_GOOD) {
+			return -1;
 		}
+		placement = (int)value;
+		return 0;
+	case MEM_OPT_SAMPLE_INTERVAL:
+		return sampleSetInterval(value);
+	default:
+		return -1;
 	}
+}
 
-	//Splitting required
-	else {
+/*
+* Function that returns the smallest block size that maps to a bin
+* Argument - bin: Bin index
+*/
+size_t binLowest(int bin) {
+	int log2;
+	size_t lowest;
 
-		//Split the block based on the free space left after allocation
-		//Update LSB to 1 to reflect busy status
-		best_blk->size_status = size;
-		best_blk->size_status += 1;
-		//If previous block was busy, update best block's size_status
-		if (prev_blk_status == 1) {
-			best_blk->size_status += 2;
+	if (bin < FIRST_LARGE_BIN) {
+		return (size_t)bin * ALIGNMENT;
+	}
+	log2 = highBit(SMALL_BIN_MAX) + (bin - FIRST_LARGE_BIN) / 2;
+	lowest = ((size_t)1 << log2) + ((bin - FIRST_LARGE_BIN) & 1) * ((size_t)1 << (log2 - 1));
+	return lowest > SMALL_BIN_MAX ? lowest : SMALL_BIN_MAX + ALIGNMENT;
+}
+
+/*
+* Function that takes a snapshot of the allocator's statistics
+* Argument - stats: Where to store the snapshot
+* Returns 0 on success and -1 if stats is NULL
+* The counters are kept up to date as blocks change state, so a snapshot
+* costs one lock per arena and a walk of the largest free bin, never a
+* walk of the heap. Every arena is consistent in itself, but the arenas
+* are locked one after the other
+*/
+int Mem_GetStats(Mem_Stats *stats) {
+	arena_t *ar;
+	tcache_t *tc;
+	blk_hdr *curr_blk;
+	int i;
+	int bin;
+
+	if (stats == NULL) {
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < num_arenas; i++) {
+		ar = &arenas[i];
+		pthread_mutex_lock(&ar->lock);
+		stats->heap_bytes += ar->heap_bytes;
+		stats->busy_bytes += ar->busy_bytes;
+		stats->deferred_bytes += ar->quick_bytes;
+		stats->splits += ar->splits;
+		stats->coalesces += ar->coalesces;
+		for (bin = 0; bin < NUM_BINS; bin++) {
+			stats->busy_hist[bin] += ar->busy_hist[bin];
+			stats->free_hist[bin] += ar->free_hist[bin];
 		}
 
-		//Move the split block header pointer to just after the newly allocated block
-		//Update its size_status to reflect its size/status and the previous block's busy status
-		split_blk_hdr = (blk_hdr *)((char*)best_blk + size);
-		split_blk_hdr->size_status = size_diff;
-		split_blk_hdr->size_status += 2;
+		curr_blk = largestFree(ar);
+		if (curr_blk != NULL && (size_t)BLK_SIZE(curr_blk) > stats->largest_free) {
+			stats->largest_free = BLK_SIZE(curr_blk);
+		}
+		pthread_mutex_unlock(&ar->lock);
+	}
 
-		//Create a footer for the split block
-		createFooter(split_blk_hdr);
+	for (bin = 0; bin < NUM_BINS; bin++) {
+		stats->class_size[bin] = binLowest(bin);
+		stats->busy_blocks += stats->busy_hist[bin];
+		stats->free_blocks += stats->free_hist[bin];
 	}
+	stats->free_bytes = stats->heap_bytes - stats->busy_bytes;
 
-	//Return address right after block header
-	return (char*)best_blk + sizeof(blk_hdr);
+	pthread_mutex_lock(&tcache_list_lock);
+	for (tc = tcache_list; tc != NULL; tc = tc->next) {
+		stats->cached_bytes += atomic_load_explicit(&tc->bytes, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&tcache_list_lock);
+
+	pthread_mutex_lock(&chunk_lock);
+	stats->chunks = num_chunks;
+	pthread_mutex_unlock(&chunk_lock);
+
+	stats->mapped_bytes = atomic_load_explicit(&mapped_bytes, memory_order_relaxed);
+	stats->mapped_blocks = atomic_load_explicit(&mapped_blocks, memory_order_relaxed);
+	stats->alloc_failures = atomic_load_explicit(&alloc_failures, memory_order_relaxed);
+	return 0;
 }
 
 /*
-* Function for freeing up a previously allocated block
-* Argument - ptr: Address of the block to be freed up
-* Returns 0 on success
-* Returns -1 on failure
-* - Return -1 if ptr is NULL
-* - Return -1 if ptr is not 8 byte aligned or if the block is already freed
-* - Mark the block as free
-* - Coalesce if one or both of the immediate neighbours are free
+* Function that writes a snapshot of the statistics as one line of JSON
+* Argument - out: Stream to write to
+* Returns 0 on success and -1 on failure
+* Only the size classes that hold any blocks are listed, as
+* [class_size, busy blocks, free blocks]
 */
-int Mem_Free(void *ptr) {
-
-	blk_hdr *free_blk = NULL;	//Block to be freed
-	blk_hdr *prev_blk = NULL;	//Block previous to the one to be freed
-	blk_hdr *prev_blk_ftr = NULL;	
-	blk_hdr *next_blk = NULL;	//Block following the one to be freed
-	int free_blk_status = 0;	//Status of block to be freed
-	int prev_blk_status = 0;	//Status of previous block
-	int next_blk_status = 0;	//Status of next block
-	int free_size = 0;
-	int prev_size = 0;
-	int next_size = 0;
+int Mem_StatsJson(FILE *out) {
+	Mem_Stats stats;
+	struct timespec now;
+	int bin;
+	int first = 1;
 
-	//Return error if ptr is null or misaligned
-	if (ptr == NULL || ((int) ptr % 8) != 0) {	
+	//Take the snapshot first; printing may allocate
+	if (out == NULL || Mem_GetStats(&stats) != 0) {
 		return -1;
 	}
+	clock_gettime(CLOCK_REALTIME, &now);
 
-	//Move pointer backwards to point to header 
-	free_blk = (blk_hdr *)((char *)ptr - sizeof(blk_hdr));
+	fprintf(out, "{\"time\":%ld.%03ld,\"heap_bytes\":%zu,\"busy_bytes\":%zu,\"free_bytes\":%zu,"
+		"\"cached_bytes\":%zu,\"deferred_bytes\":%zu,\"largest_free\":%zu,\"busy_blocks\":%zu,\"free_blocks\":%zu,"
+		"\"mapped_bytes\":%zu,\"mapped_blocks\":%zu,\"chunks\":%zu,\"alloc_failures\":%zu,"
+		"\"splits\":%zu,\"coalesces\":%zu,\"classes\":[",
+		(long)now.tv_sec, now.tv_nsec / 1000000, stats.heap_bytes, stats.busy_bytes, stats.free_bytes,
+		stats.cached_bytes, stats.deferred_bytes, stats.largest_free, stats.busy_blocks, stats.free_blocks,
+		stats.mapped_bytes, stats.mapped_blocks, stats.chunks, stats.alloc_failures,
+		stats.splits, stats.coalesces);
+	for (bin = 0; bin < MEM_STATS_CLASSES; bin++) {
+		if (stats.busy_hist[bin] == 0 && stats.free_hist[bin] == 0) {
+			continue;
+		}
+		fprintf(out, "%s[%zu,%zu,%zu]", first ? "" : ",", stats.class_size[bin], stats.busy_hist[bin], stats.free_hist[bin]);
+		first = 0;
+	}
+	fprintf(out, "]}\n");
+	return fflush(out) == 0 ? 0 : -1;
+}
 
-	//Return error if block is not busy
-	free_blk_status = (free_blk->size_status) & 1;
-	if (free_blk_status != 1) {
+/* Task of the statistics thread; arg is the stream to write to */
+void statsTask(void *arg) {
+	Mem_StatsJson(arg);
+}
+
+/*
+* Function that starts, changes or stops a thread writing the statistics
+* as JSON lines (see Mem_StatsJson) at a fixed interval
+* Argument - out: Stream to write to
+* Argument - interval_ms: Time between two lines; 0 stops the thread
+* Returns 0 on success and -1 on failure
+*/
+int Mem_StatsPeriodic(FILE *out, long interval_ms) {
+	if (interval_ms > 0 && out == NULL) {
 		return -1;
 	}
-	
-	//Mask two LSBs to find the size of block
-	free_size = (free_blk->size_status) & 0xFFFFFFFC;
+	return periodicSet(&stats_periodic, interval_ms, statsTask, out);
+}
 
-	//Check if previous block is allocated by bitmasking
-	if ((free_blk->size_status & 2) == 2) {
-		prev_blk_status = 1;	
+/*
+* Function that tells whether an allocation of the calling thread is to be
+* sampled, counting its bytes against the thread's gap to the next sample
+* Argument - size: Requested bytes
+* Returns 1 if the allocation is sampled, 0 if not
+*/
+int sampleDue(size_t size) {
+	if (sample_busy) {
+		return 0;
+	}
+	sample_left -= size < (size_t)LONG_MAX ? (long)size : LONG_MAX;
+	if (sample_left > 0) {
+		return 0;
 	}
-	else {
-		//Point to the footer of the previous block and get its size
-		prev_blk_ftr = free_blk - 1;
-		prev_size = prev_blk_ftr->size_status;	
 
-		//Point to the header of the previous block
-		prev_blk = (blk_hdr *)((char*)prev_blk_ftr - (prev_size - sizeof(blk_hdr)));	
+	//A thread's first allocation only starts its countdown, at a random point
+	if (sample_seed == 0) {
+		sample_seed = ((uint64_t)(uintptr_t)&sample_seed ^ (uint64_t)time(NULL) << 32) | 1;
+		sample_left = sampleGap();
+		return 0;
 	}
+	return 1;
+}
 
-	//Determine status of next block
-	next_blk = (blk_hdr *)((char*)free_blk + free_size);
-	next_blk_status = (next_blk->size_status) & 1;
-	//Mask two LSBs to find the size of next block if block is free
-	next_size = (next_blk->size_status) & 0xFFFFFFFC;
-	
-	//Coalescing
+/*
+* Function that draws the bytes until the next sample of the calling thread
+* Uniform from 1 to 2 * sample_interval, from a xorshift64* generator
+*/
+long sampleGap() {
+	long interval = sample_interval;
 
-	if ((next_blk_status == 1) && (prev_blk_status == 1)) {	
-		//Both neighbors are allocated so coalescing is unnecessary
-		//Simply set the LSB of the block's size status to 0 and the SLB to 1,
-		//freeing the block and indicating the previous block's allocation
-		free_blk->size_status = free_size + 2;
+	sample_seed ^= sample_seed >> 12;
+	sample_seed ^= sample_seed << 25;
+	sample_seed ^= sample_seed >> 27;
+	if (interval <= 0) {
+		return LONG_MAX;
+	}
+	return 1 + (long)((sample_seed * 0x2545F4914F6CDD1DULL) % (2 * (uint64_t)interval));
+}
 
-		//Must also update the next block to reflect the current block's free status
-		next_blk->size_status = next_size + next_blk_status;
-		//Create a footer
-		createFooter(free_blk);
+/* Function that hashes an address for sample_objs and sample_filter */
+size_t samplePtrHash(void *ptr) {
+	return (size_t)(((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL >> 32);
+}
 
-	} else if ((next_blk_status == 1) && (prev_blk_status == 0)) {
-		//Only the previous block is free, and needs to be coalesced
+/*
+* Function that finds the call site of a stack, adding it if it is new
+* The caller must hold sample_lock
+* Returns the index in sample_sites, or -1 if the table is full
+*/
+int sampleSite(void **frames, int depth) {
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+	size_t n;
+	int k;
 
-		//Update prev block's header & footer to indicate the new size after merging
-		prev_blk->size_status += free_size;
-		createFooter(prev_blk);
+	for (k = 0; k < depth; k++) {
+		hash = (hash ^ (uintptr_t)frames[k]) * 1099511628211ULL;
+	}
+	i = (size_t)(hash >> 20) & (SAMPLE_SITES - 1);
+	for (n = 0; n < SAMPLE_SITES; n++, i = (i + 1) & (SAMPLE_SITES - 1)) {
+		if (sample_sites[i].depth == 0) {
+			memcpy(sample_sites[i].frames, frames, depth * sizeof(void*));
+			sample_sites[i].depth = depth;
+			return (int)i;
+		}
+		if (sample_sites[i].depth == depth && memcmp(sample_sites[i].frames, frames, depth * sizeof(void*)) == 0) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
 
-		//Update next block's size status to indicate the previous merged block is free
-		next_blk->size_status = next_size + next_blk_status;
+/*
+* Function that performs an allocation picked by sampleDue and records the
+* call stack that made it
+* Argument - size: Requested bytes
+* Argument - align: Alignment asked for
+* Argument - zero: 1 for Mem_Calloc
+* Argument - caller: Return address of the Mem_* call; the recorded stack
+*   starts there, whether or not the compiler kept the frames in between
+* Returns what the allocation returned
+*/
+void* sampleAlloc(size_t size, size_t align, int zero, void *caller) {
+	void *frames[SAMPLE_DEPTH + SAMPLE_SLACK];
+	void *ptr;
+	size_t weight;		//Bytes the sample stands for
+	size_t objs;
+	size_t i;
+	int first = 0;		//Frame of the caller
+	int depth = 0;
+	int site;
 
-		//Update middle block to ensure it cannot be read as allocated
-		free_blk->size_status = free_size + 2;
+	sample_left = sampleGap();
 
-	} else if ((next_blk_status == 0) && (prev_blk_status == 1)) {
-		//Only the next block is free, and needs to be coalesced
+	//Neither the allocation nor backtrace, which may allocate, is sampled again
+	sample_busy = 1;
+	ptr = zero ? Mem_Calloc(size, 1) : Mem_AlignedAlloc(align, size);
+	if (ptr != NULL) {
+		depth = backtrace(frames, SAMPLE_DEPTH + SAMPLE_SLACK);
+		for (first = 0; first < depth && frames[first] != caller; first++);
 
-		//Update middle/freed block's header & footer to indicate merged size
-		free_blk->size_status = free_size + next_size + 2;
-		createFooter(free_blk);
+		//Without the caller on the stack only this function's frame is dropped
+		first = first < depth ? first : 1;
+		depth = depth - first < SAMPLE_DEPTH ? depth - first : SAMPLE_DEPTH;
+	}
+	sample_busy = 0;
+	if (depth <= 0) {
+		return ptr;
+	}
 
-	} else if ((next_blk_status == 0) && (prev_blk_status == 0)) {
-		//Both neighbors are free so all must be coalesced
-		prev_blk->size_status += (free_size + next_size);
-		createFooter(prev_blk);
+	weight = size > (size_t)sample_interval ? size : (size_t)sample_interval;
+	objs = weight / size;
 
-		//Update middle block to ensure it cannot be read as allocated
-		free_blk->size_status = free_size + 2;
+	pthread_mutex_lock(&sample_lock);
+	site = sampleSite(frames + first, depth);
+	if (site < 0 || atomic_load_explicit(&sampled_live, memory_order_relaxed) >= SAMPLE_OBJS / 2) {
+		sample_dropped++;
+		pthread_mutex_unlock(&sample_lock);
+		return ptr;
 	}
+	sample_sites[site].alloc_bytes += weight;
+	sample_sites[site].alloc_objs += objs;
+	sample_sites[site].live_bytes += weight;
+	sample_sites[site].live_objs += objs;
 
-	else {
-		printf("Error in Mem_Free.");
-		return -1;
+	//Linear probing; the table is kept at most half full
+	for (i = samplePtrHash(ptr) & (SAMPLE_OBJS - 1); sample_objs[i].ptr != NULL; i = (i + 1) & (SAMPLE_OBJS - 1));
+	sample_objs[i].ptr = ptr;
+	sample_objs[i].bytes = weight;
+	sample_objs[i].objs = objs;
+	sample_objs[i].site = site;
+	atomic_fetch_add_explicit(&sample_filter[samplePtrHash(ptr) & (SAMPLE_FILTER - 1)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&sampled_live, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&sample_lock);
+	return ptr;
+}
+
+/*
+* Function that drops the sample of an object that is freed, if it has one
+* Argument - ptr: Payload address given to Mem_Free
+*/
+void sampleFree(void *ptr) {
+	size_t hash = samplePtrHash(ptr);
+	size_t i;
+	size_t j;
+	size_t home;
+	sample_site *site;
+
+	if (atomic_load_explicit(&sample_filter[hash & (SAMPLE_FILTER - 1)], memory_order_relaxed) == 0) {
+		return;
 	}
 
-	return 0;
+	pthread_mutex_lock(&sample_lock);
+	for (i = hash & (SAMPLE_OBJS - 1); sample_objs[i].ptr != NULL && sample_objs[i].ptr != ptr; i = (i + 1) & (SAMPLE_OBJS - 1));
+	if (sample_objs[i].ptr == NULL) {
+		pthread_mutex_unlock(&sample_lock);
+		return;
+	}
+	site = &sample_sites[sample_objs[i].site];
+	site->live_bytes -= sample_objs[i].bytes;
+	site->live_objs -= sample_objs[i].objs;
+
+	//Shift later entries of the probe sequence back into the hole
+	for (j = (i + 1) & (SAMPLE_OBJS - 1); sample_objs[j].ptr != NULL; j = (j + 1) & (SAMPLE_OBJS - 1)) {
+		home = samplePtrHash(sample_objs[j].ptr) & (SAMPLE_OBJS - 1);
+		if (((j - home) & (SAMPLE_OBJS - 1)) >= ((j - i) & (SAMPLE_OBJS - 1))) {
+			sample_objs[i] = sample_objs[j];
+			i = j;
+		}
+	}
+	sample_objs[i].ptr = NULL;
+	atomic_fetch_sub_explicit(&sample_filter[hash & (SAMPLE_FILTER - 1)], 1, memory_order_relaxed);
+	atomic_fetch_sub_explicit(&sampled_live, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&sample_lock);
 }
 
 /*
-* Function used to initialize the memory allocator
-* Not intended to be called more than once by a program
-* Argument - sizeOfRegion: Specifies the size of the chunk which needs to be allocated
+* Function that turns the profiler on, off, or changes its interval
+* The tables are mapped when it is first turned on and kept from then on,
+* so turning it off and on again keeps the profile
+* Argument - interval: Average bytes between samples; 0 turns sampling off
 * Returns 0 on success and -1 on failure
 */
-int Mem_Init(int sizeOfRegion) {
-	int pagesize;
-	int padsize;
-	int alloc_size;
-	void* space_ptr;
-	blk_hdr* end_mark;
-	static int allocated_once = 0;
+int sampleSetInterval(long interval) {
+	void *frames[1];
+	char *tables;
+	size_t sites_size = SAMPLE_SITES * sizeof(sample_site);
+	size_t objs_size = SAMPLE_OBJS * sizeof(sample_obj);
 
-	if (0 != allocated_once) {
-		fprintf(stderr,
-			"Error:mem.c: Mem_Init has allocated space during a previous call\n");
-		return -1;
-	}
-	if (sizeOfRegion <= 0) {
-		fprintf(stderr, "Error:mem.c: Requested block size is not positive\n");
+	if (interval < 0) {
 		return -1;
 	}
 
-	// Get the pagesize
-	pagesize = 4024;
+	pthread_mutex_lock(&sample_lock);
+	if (interval != 0 && sample_sites == NULL) {
+		tables = mmap(NULL, sites_size + objs_size + SAMPLE_FILTER * sizeof(atomic_ushort),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (tables == MAP_FAILED) {
+			pthread_mutex_unlock(&sample_lock);
+			return -1;
+		}
+		sample_sites = (sample_site*)tables;
+		sample_objs = (sample_obj*)(tables + sites_size);
+		sample_filter = (atomic_ushort*)(tables + sites_size + objs_size);
+		clock_gettime(CLOCK_MONOTONIC, &sample_start);
+	}
+	pthread_mutex_unlock(&sample_lock);
 
-	// Calculate padsize as the padding required to round up sizeOfRegion 
-	// to a multiple of pagesize
-	padsize = sizeOfRegion % pagesize;
-	padsize = (pagesize - padsize) % pagesize;
+	//backtrace loads its unwinder on first use, which allocates
+	if (interval != 0) {
+		sample_busy = 1;
+		backtrace(frames, 1);
+		sample_busy = 0;
+	}
+	sample_interval = interval;
+	return 0;
+}
 
-	alloc_size = sizeOfRegion + padsize;
+/*
+* Function that writes a frame of a call stack as function+offset,
+* falling back to the object file or the bare address
+*/
+void sampleWriteFrame(FILE *out, void *frame) {
+	Dl_info info;
+	const char *name;
 
-	space_ptr = malloc(alloc_size);
+	//A return address points past the call; look up the call itself
+	if (dladdr((char*)frame - 1, &info) != 0) {
+		if (info.dli_sname != NULL) {
+			fprintf(out, "%s+0x%lx", info.dli_sname, (unsigned long)((char*)frame - (char*)info.dli_saddr));
+			return;
+		}
+		if (info.dli_fname != NULL) {
+			name = strrchr(info.dli_fname, '/');
+			fprintf(out, "%s+0x%lx", name != NULL ? name + 1 : info.dli_fname, (unsigned long)((char*)frame - (char*)info.dli_fbase));
+			return;
+		}
+	}
+	fprintf(out, "%p", frame);
+}
 
-	allocated_once = 1;
+/* Function that orders call sites by live bytes, largest first, for qsort */
+int sampleCompare(const void *a, const void *b) {
+	const sample_site *x = a;
+	const sample_site *y = b;
 
-	// for double word alignement and end mark
-	alloc_size -= 8;
+	return (x->live_bytes < y->live_bytes) - (x->live_bytes > y->live_bytes);
+}
 
-	// To begin with there is only one big free block
-	// initialize heap so that first block meets 
-	// double word alignement requirement
-	first_blk = (blk_hdr*)space_ptr + 1;
-	end_mark = (blk_hdr*)((char*)first_blk + alloc_size); // changed from void to char
+/*
+* Function that writes the profile gathered by the sampling profiler
+* Argument - out: Stream to write to
+* Argument - format: One of the MEM_PROFILE_* formats
+* Returns 0 on success and -1 on failure or if sampling was never turned on
+* The call sites are copied under sample_lock and written without it, so
+* the stream is free to allocate
+*/
+int Mem_ProfileDump(FILE *out, int format) {
+	sample_site *sites;
+	sample_site total;
+	struct timespec now;
+	double seconds;
+	char buf[4096];
+	ssize_t len;
+	size_t sites_size = SAMPLE_SITES * sizeof(sample_site);
+	size_t n = 0;
+	size_t i;
+	int k;
+	int fd;
 
-														  // Setting up the header
-	first_blk->size_status = alloc_size;
+	if (out == NULL || format < MEM_PROFILE_PPROF || format > MEM_PROFILE_TEXT || sample_sites == NULL) {
+		return -1;
+	}
+	sites = mmap(NULL, sites_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (sites == MAP_FAILED) {
+		return -1;
+	}
 
-	// Marking the previous block as busy
-	first_blk->size_status += 2;
+	memset(&total, 0, sizeof(total));
+	pthread_mutex_lock(&sample_lock);
+	for (i = 0; i < SAMPLE_SITES; i++) {
+		if (sample_sites[i].depth != 0) {
+			sites[n] = sample_sites[i];
+			total.live_bytes += sites[n].live_bytes;
+			total.live_objs += sites[n].live_objs;
+			total.alloc_bytes += sites[n].alloc_bytes;
+			total.alloc_objs += sites[n].alloc_objs;
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&sample_lock);
+	qsort(sites, n, sizeof(sample_site), sampleCompare);
 
-	// Setting up the end mark and marking it as busy
-	end_mark->size_status = 1;
+	switch (format) {
+	case MEM_PROFILE_PPROF:
+		//The counts are scaled up already; heapprofile tells pprof not to scale them
+		fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heapprofile\n",
+			total.live_objs, total.live_bytes, total.alloc_objs, total.alloc_bytes);
+		for (i = 0; i < n; i++) {
+			fprintf(out, "%zu: %zu [%zu: %zu] @", sites[i].live_objs, sites[i].live_bytes, sites[i].alloc_objs, sites[i].alloc_bytes);
+			for (k = 0; k < sites[i].depth; k++) {
+				fprintf(out, " %p", sites[i].frames[k]);
+			}
+			fprintf(out, "\n");
+		}
 
-	// Setting up the footer
-	blk_hdr *footer = (blk_hdr*)((char*)first_blk + alloc_size - 4);
-	footer->size_status = alloc_size;
+		//pprof maps the addresses to the binaries with these
+		fprintf(out, "\nMAPPED_LIBRARIES:\n");
+		fflush(out);
+		fd = open("/proc/self/maps", O_RDONLY);
+		while (fd >= 0 && (len = read(fd, buf, sizeof(buf))) > 0) {
+			fwrite(buf, 1, len, out);
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+		break;
+	case MEM_PROFILE_FOLDED:
+		for (i = 0; i < n && sites[i].live_bytes != 0; i++) {
+			for (k = sites[i].depth - 1; k >= 0; k--) {
+				sampleWriteFrame(out, sites[i].frames[k]);
+				fputc(k > 0 ? ';' : ' ', out);
+			}
+			fprintf(out, "%zu\n", sites[i].live_bytes);
+		}
+		break;
+	default:
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		seconds = (now.tv_sec - sample_start.tv_sec) + (now.tv_nsec - sample_start.tv_nsec) / 1e9;
+		if (seconds <= 0) {
+			seconds = 1e-9;
+		}
+		fprintf(out, "sample interval %ld bytes, %.1f s, %zu samples dropped\n", sample_interval, seconds, sample_dropped);
+		fprintf(out, "%14s %12s %12s %12s  %s\n", "live bytes", "live objs", "alloc MB/s", "allocs/s", "call site");
+		for (i = 0; i < n; i++) {
+			fprintf(out, "%14zu %12zu %12.2f %12.0f  ", sites[i].live_bytes, sites[i].live_objs,
+				sites[i].alloc_bytes / seconds / (1024 * 1024), sites[i].alloc_objs / seconds);
+			for (k = 0; k < sites[i].depth && k < 4; k++) {
+				sampleWriteFrame(out, sites[i].frames[k]);
+				fprintf(out, k + 1 < sites[i].depth && k < 3 ? " < " : "\n");
+			}
+		}
+		break;
+	}
 
-	return 0;
+	munmap(sites, sites_size);
+	return fflush(out) == 0 ? 0 : -1;
 }
 
 /*
@@ -371,6 +4061,8 @@ int Mem_Init(int sizeOfRegion) {
 * t_Begin  : address of the first byte in the block (this is where the header starts)
 * t_End    : address of the last byte in the block
 * t_Size   : size of the block (as stored in the block header) (including the header/footer)
+* The arenas are listed one after the other, each chunk by chunk
+* Blocks cached by other threads are listed as busy
 */
 void Mem_Dump() {
 	int counter;
@@ -378,13 +4070,15 @@ void Mem_Dump() {
 	char p_status[5];
 	char *t_begin = NULL;
 	char *t_end = NULL;
-	int t_size;
+	blk_size_t t_size;
+	int i;
 
-	blk_hdr *current = first_blk;
+	chunk_t *chunk;
+	blk_hdr *current;
 	counter = 1;
 
-	int busy_size = 0;
-	int free_size = 0;
+	size_t busy_size = 0;
+	size_t free_size = 0;
 	int is_busy = -1;
 
 	fprintf(stdout, "************************************Block list***\
@@ -393,50 +4087,64 @@ void Mem_Dump() {
 	fprintf(stdout, "-------------------------------------------------\
 					                    --------------------------------\n");
 
-	while (current->size_status != 1) {
-		t_begin = (char*)current;
-		t_size = current->size_status;
+	// The calling thread's cached blocks would show up as busy otherwise
+	tcacheFlush();
 
-		if (t_size & 1) {
-			// LSB = 1 => busy block
-			strcpy_s(status, 5, "Busy");
-			is_busy = 1;
-			t_size = t_size - 1;
-		}
-		else {
-			strcpy_s(status, 5, "Free");
-			is_busy = 0;
-		}
+	for (i = 0; i < num_arenas; i++) {
+		pthread_mutex_lock(&arenas[i].lock);
+		drainRemoteFrees(&arenas[i]);
+		consolidateQuick(&arenas[i]);
 
-		if (t_size & 2) {
-			strcpy_s(p_status, 5, "Busy");
-			t_size = t_size - 2;
-		}
-		else {
-			strcpy_s(p_status, 5, "Free");
-		}
+		for (chunk = arenas[i].chunks; chunk != NULL; chunk = chunk->next) {
+			current = CHUNK_FIRST_BLK(chunk);
+
+			while (current->size_status != 1) {
+				t_begin = (char*)current;
+				t_size = current->size_status;
+
+				if (t_size & 1) {
+					// LSB = 1 => busy block
+					strcpy(status, "Busy");
+					is_busy = 1;
+					t_size = t_size - 1;
+				}
+				else {
+					strcpy(status, "Free");
+					is_busy = 0;
+				}
+
+				if (t_size & 2) {
+					strcpy(p_status, "Busy");
+					t_size = t_size - 2;
+				}
+				else {
+					strcpy(p_status, "Free");
+				}
 
-		if (is_busy)
-			busy_size += t_size;
-		else
-			free_size += t_size;
+				if (is_busy)
+					busy_size += t_size;
+				else
+					free_size += t_size;
 
-		t_end = t_begin + t_size - 1;
+				t_end = t_begin + t_size - 1;
 
-		fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%d\n", counter, status,
-			p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
+				fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%lu\n", counter, status,
+					p_status, (unsigned long int)t_begin, (unsigned long int)t_end, (unsigned long int)t_size);
 
-		current = (blk_hdr*)((char*)current + t_size);
-		counter = counter + 1;
+				current = (blk_hdr*)((char*)current + t_size);
+				counter = counter + 1;
+			}
+		}
+		pthread_mutex_unlock(&arenas[i].lock);
 	}
 
 	fprintf(stdout, "---------------------------------------------------\
 					                    ------------------------------\n");
 	fprintf(stdout, "***************************************************\
 					                    ******************************\n");
-	fprintf(stdout, "Total busy size = %d\n", busy_size);
-	fprintf(stdout, "Total free size = %d\n", free_size);
-	fprintf(stdout, "Total size = %d\n", busy_size + free_size);
+	fprintf(stdout, "Total busy size = %lu\n", (unsigned long int)busy_size);
+	fprintf(stdout, "Total free size = %lu\n", (unsigned long int)free_size);
+	fprintf(stdout, "Total size = %lu\n", (unsigned long int)(busy_size + free_size));
 	fprintf(stdout, "***************************************************\
 					                    ******************************\n");
 	fflush(stdout);
@@ -444,7 +4152,13 @@ void Mem_Dump() {
 	return;
 }
 
-int _tmain(int argc, _TCHAR* argv[])
+/*
+* Random allocation driver
+* Leave it out with -DMEM_LIBRARY_ONLY when linking the allocator into
+* another program, e.g. memBench.c
+*/
+#ifndef MEM_LIBRARY_ONLY
+int main(int argc, char* argv[])
 {
 
 	if (Mem_Init(600 * 1024) == -1) {
@@ -519,3 +4233,4 @@ int _tmain(int argc, _TCHAR* argv[])
 
 	Mem_Dump();
 }
+#endif
@@ -0,0 +1,168 @@
+#ifndef MEM_LIBRARY_H
+#define MEM_LIBRARY_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+* Public interface of the allocator implemented in memLibrary.c
+*
+* Mem_Init must be called once before any other function. Mem_InitShared
+* takes its place for a heap shared between processes, see memLibrary.c
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+* Options for Mem_SetOption
+* MEM_OPT_REMOTE_FREE: 1 (default) queues blocks freed by a thread of another
+*                      arena without taking that arena's lock, 0 frees them
+*                      under the lock right away
+* MEM_OPT_MMAP_THRESHOLD: requests larger than this many bytes get a mapping
+*                      of their own (default 128 KB, at most 16 MB)
+* MEM_OPT_DEFER_COALESCE: 1 (default) parks small freed blocks on per-size
+*                      quick lists and coalesces them later, 0 coalesces
+*                      every freed block right away
+* MEM_OPT_TRIM_INTERVAL: runs Mem_Trim every this many milliseconds on a
+*                      thread of its own (default 0, no trimming); set it
+*                      after Mem_Init
+* MEM_OPT_HUGE_PAGES:  1 backs the chunks mapped from then on with
+*                      transparent huge pages where the kernel allows it
+*                      (default 0); set it before Mem_Init to cover the region
+* MEM_OPT_PLACEMENT:   how a free block is picked for a request, one of the
+*                      MEM_PLACE_* policies below (default MEM_PLACE_BEST);
+*                      can only be set before Mem_Init
+* MEM_OPT_SAMPLE_INTERVAL: records the call stack of about one allocation
+*                      per this many bytes for Mem_ProfileDump (default 0,
+*                      no sampling); can be changed at any time
+*/
+#define MEM_OPT_REMOTE_FREE 1
+#define MEM_OPT_MMAP_THRESHOLD 2
+#define MEM_OPT_DEFER_COALESCE 3
+#define MEM_OPT_TRIM_INTERVAL 4
+#define MEM_OPT_HUGE_PAGES 5
+#define MEM_OPT_PLACEMENT 6
+#define MEM_OPT_SAMPLE_INTERVAL 7
+
+/*
+* Placement policies for MEM_OPT_PLACEMENT
+* MEM_PLACE_BEST:  the smallest free block that is large enough
+* MEM_PLACE_FIRST: the first free block found that is large enough
+* MEM_PLACE_NEXT:  like MEM_PLACE_FIRST, but every search resumes where
+*                  the previous one stopped (a roving pointer)
+* MEM_PLACE_GOOD:  the smallest of the first few blocks that are large
+*                  enough, or the first one that is nearly exact
+*/
+#define MEM_PLACE_BEST 0
+#define MEM_PLACE_FIRST 1
+#define MEM_PLACE_NEXT 2
+#define MEM_PLACE_GOOD 3
+
+/*
+* Statistics of the allocator, see Mem_GetStats
+* Heap figures count whole blocks, headers included; blocks with a mapping
+* of their own are counted separately
+* Blocks parked in thread caches or quick lists, or queued for a remote
+* free, still count as busy; cached_bytes and deferred_bytes tell how much
+* of busy_bytes sits in thread caches and quick lists
+* The histograms count blocks per size class; class i holds the blocks of
+* at least class_size[i] bytes and less than class_size[i + 1]
+*/
+#define MEM_STATS_CLASSES 64
+
+typedef struct Mem_Stats {
+	size_t heap_bytes;			//Bytes of all heap blocks, busy or free
+	size_t busy_bytes;			//Bytes of busy heap blocks
+	size_t free_bytes;			//Bytes of free heap blocks
+	size_t cached_bytes;		//Bytes of the busy blocks held in thread caches
+	size_t deferred_bytes;		//Bytes of the busy blocks waiting on quick lists
+	size_t largest_free;		//Size of the largest free heap block
+	size_t busy_blocks;
+	size_t free_blocks;
+	size_t mapped_bytes;		//Bytes of the blocks with a mapping of their own
+	size_t mapped_blocks;
+	size_t chunks;				//Chunks mapped for the heap
+	size_t alloc_failures;		//Allocations that returned NULL for lack of memory
+	size_t splits;				//Free blocks split to satisfy a request
+	size_t coalesces;			//Free blocks merged with a neighbour
+	size_t class_size[MEM_STATS_CLASSES];
+	size_t busy_hist[MEM_STATS_CLASSES];
+	size_t free_hist[MEM_STATS_CLASSES];
+} Mem_Stats;
+
+/*
+* Formats of Mem_ProfileDump
+* MEM_PROFILE_PPROF:  heap profile in the legacy text format pprof reads
+* MEM_PROFILE_FOLDED: one line of folded stacks per call site with its
+*                     live bytes, as flamegraph.pl reads them
+* MEM_PROFILE_TEXT:   table of the call sites by live bytes, with their
+*                     allocation rates since sampling was turned on
+*/
+#define MEM_PROFILE_PPROF 0
+#define MEM_PROFILE_FOLDED 1
+#define MEM_PROFILE_TEXT 2
+
+/*
+* Size classes of small blocks, for Mem_AllocClass
+* A block holds the payload and a MEM_HDR_SIZE byte header, rounded up to a
+* multiple of MEM_ALIGNMENT and no smaller than MEM_MIN_BLOCK. Blocks of up
+* to MEM_CLASS_MAX bytes have a class per size, the size over MEM_ALIGNMENT
+* MEM_SIZE_CLASS(size) is the class of a request of size bytes, or 0 if it
+* is too large for one; for a constant size it is a constant expression
+* The layout must match the build of memLibrary.c, MEM_COMPACT_HDR included
+*/
+#ifdef MEM_COMPACT_HDR
+#define MEM_ALIGNMENT 8
+#define MEM_HDR_SIZE 4
+#else
+#define MEM_ALIGNMENT 16
+#define MEM_HDR_SIZE 8
+#endif
+#define MEM_MIN_BLOCK ((2 * MEM_HDR_SIZE + 2 * sizeof(void*) + MEM_ALIGNMENT - 1) / MEM_ALIGNMENT * MEM_ALIGNMENT)
+#define MEM_CLASS_MAX (32 * MEM_ALIGNMENT)
+#define MEM_BLOCK_SIZE(size) (((size) + MEM_HDR_SIZE + MEM_ALIGNMENT - 1) / MEM_ALIGNMENT * MEM_ALIGNMENT)
+#define MEM_SIZE_CLASS(size) ((size) > MEM_CLASS_MAX - MEM_HDR_SIZE ? 0 : \
+	(MEM_BLOCK_SIZE(size) < MEM_MIN_BLOCK ? MEM_MIN_BLOCK : MEM_BLOCK_SIZE(size)) / MEM_ALIGNMENT)
+
+/*
+* Bump pointer arenas for objects that die together, see Mem_ArenaCreate
+* An arena carves its objects out of large blocks taken from the heap;
+* its objects cannot be given to Mem_Free or Mem_Realloc, and an arena
+* must not be used by two threads at once
+*/
+typedef struct Mem_Arena Mem_Arena;
+
+int Mem_Init(size_t sizeOfRegion);
+int Mem_InitShared(const char *path, size_t size);
+size_t Mem_SharedOffset(void *ptr);
+void* Mem_SharedPtr(size_t offset);
+void* Mem_SharedRoot();
+int Mem_SharedSetRoot(void *ptr);
+void* Mem_Alloc(size_t size);
+void* Mem_AllocClass(int size_class);
+int Mem_Free(void *ptr);
+void* Mem_Realloc(void *ptr, size_t size);
+void* Mem_AlignedAlloc(size_t align, size_t size);
+void* Mem_Calloc(size_t nmemb, size_t size);
+size_t Mem_AllocBatch(size_t size, size_t n, void **out);
+int Mem_FreeBatch(void **ptrs, size_t n);
+size_t Mem_UsableSize(void *ptr);
+Mem_Arena* Mem_ArenaCreate(size_t block_size);
+void* Mem_ArenaAlloc(Mem_Arena *arena, size_t size);
+void Mem_ArenaReset(Mem_Arena *arena);
+void Mem_ArenaDestroy(Mem_Arena *arena);
+int Mem_SetOption(int option, long value);
+size_t Mem_Trim();
+int Mem_GetStats(Mem_Stats *stats);
+int Mem_StatsJson(FILE *out);
+int Mem_StatsPeriodic(FILE *out, long interval_ms);
+int Mem_ProfileDump(FILE *out, int format);
+void Mem_Dump();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,439 @@
+/*
+* memRecord.c - Records the allocations of a running program as a trace
+*
+* Wraps the glibc allocator and writes every allocation, reallocation and
+* free to a trace in the format of memTrace.h, for memReplay to play back
+*
+* Build:
+*   gcc -O2 -fPIC -shared -pthread -fvisibility=hidden -ftls-model=initial-exec \
+*       memRecord.c -o libmemrecord.so
+*
+* Usage:
+*   MEM_TRACE=sort.%p.trace LD_PRELOAD=./libmemrecord.so sort big.txt
+*
+* MEM_TRACE names the trace file; %p is replaced with the process id, which
+* keeps the traces of programs that start others apart (default memtrace.%p)
+* Events of all threads go into one trace in the order they happened
+* Bookkeeping lives in memory mapped directly, so the recorder never calls
+* the allocator it is watching
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "memTrace.h"
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+/* The glibc allocator, under the names it exports for wrappers like this */
+extern void* __libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void *ptr, size_t size);
+extern void* __libc_memalign(size_t align, size_t size);
+
+#define OUT_BUF_SIZE (1024 * 1024)
+#define MAP_INIT_CAP (1 << 16)
+#define NO_ID UINT64_MAX
+
+/*
+* Map from the address of a live object to its id
+* Open addressing with linear probing; a key of 0 marks an empty slot
+*/
+typedef struct map_entry {
+	uintptr_t key;
+	uint64_t id;
+} map_entry;
+
+static map_entry *map = NULL;
+static size_t map_cap = 0;
+static size_t map_count = 0;
+
+/* Ids of freed objects, handed out again before new ones */
+static uint64_t *free_ids = NULL;
+static size_t free_ids_cap = 0;
+static size_t num_free_ids = 0;
+static uint64_t next_id = 0;
+
+static unsigned char out_buf[OUT_BUF_SIZE];
+static size_t out_len = 0;
+static int out_fd = -1;
+static int recording = 1;
+
+/* Guards all of the above and keeps the events in order */
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+* Function that maps zeroed memory for the bookkeeping
+* Returns NULL on failure
+*/
+static void* mapZeroed(size_t size) {
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/* Function that returns the first slot to probe for an address */
+static size_t mapSlot(uintptr_t key) {
+	return (size_t)((key >> 4) * 0x9E3779B97F4A7C15ull) & (map_cap - 1);
+}
+
+/*
+* Function that records the id of a new object
+* The map doubles once it is half full
+* Returns 0 on success and -1 if no memory could be mapped
+*/
+static int mapInsert(uintptr_t key, uint64_t id) {
+	map_entry *old_map = map;
+	size_t old_cap = map_cap;
+	size_t slot;
+	size_t i;
+
+	if (2 * (map_count + 1) > map_cap) {
+		map_cap = old_cap ? 2 * old_cap : MAP_INIT_CAP;
+		map = mapZeroed(map_cap * sizeof(map_entry));
+		if (map == NULL) {
+			map = old_map;
+			map_cap = old_cap;
+			return -1;
+		}
+		for (i = 0; i < old_cap; i++) {
+			if (old_map[i].key != 0) {
+				for (slot = mapSlot(old_map[i].key); map[slot].key != 0; slot = (slot + 1) & (map_cap - 1)) {
+				}
+				map[slot] = old_map[i];
+			}
+		}
+		if (old_map != NULL) {
+			munmap(old_map, old_cap * sizeof(map_entry));
+		}
+	}
+
+	for (slot = mapSlot(key); map[slot].key != 0 && map[slot].key != key; slot = (slot + 1) & (map_cap - 1)) {
+	}
+	if (map[slot].key == 0) {
+		map_count++;
+	}
+	map[slot].key = key;
+	map[slot].id = id;
+	return 0;
+}
+
+/*
+* Function that forgets an object
+* Returns its id, or NO_ID if the address was never recorded
+* Deletion shifts the following entries back, so no tombstones are needed
+*/
+static uint64_t mapRemove(uintptr_t key) {
+	size_t slot;
+	size_t next;
+	size_t home;
+	uint64_t id;
+
+	if (map_cap == 0) {
+		return NO_ID;
+	}
+	for (slot = mapSlot(key); map[slot].key != key; slot = (slot + 1) & (map_cap - 1)) {
+		if (map[slot].key == 0) {
+			return NO_ID;
+		}
+	}
+	id = map[slot].id;
+	map_count--;
+
+	//Move back every entry whose probe sequence passes the hole
+	for (next = (slot + 1) & (map_cap - 1); map[next].key != 0; next = (next + 1) & (map_cap - 1)) {
+		home = mapSlot(map[next].key);
+		if (((next - home) & (map_cap - 1)) >= ((next - slot) & (map_cap - 1))) {
+			map[slot] = map[next];
+			slot = next;
+		}
+	}
+	map[slot].key = 0;
+	return id;
+}
+
+/* Function that hands out the id for a new object */
+static uint64_t newId() {
+	if (num_free_ids > 0) {
+		return free_ids[--num_free_ids];
+	}
+	return next_id++;
+}
+
+/* Function that returns the id of a freed object for reuse */
+static void releaseId(uint64_t id) {
+	uint64_t *old_ids = free_ids;
+	size_t old_cap = free_ids_cap;
+
+	if (num_free_ids == free_ids_cap) {
+		free_ids_cap = old_cap ? 2 * old_cap : 4096;
+		free_ids = mapZeroed(free_ids_cap * sizeof(uint64_t));
+		if (free_ids == NULL) {
+			//Just never reuse the id
+			free_ids = old_ids;
+			free_ids_cap = old_cap;
+			return;
+		}
+		if (old_ids != NULL) {
+			memcpy(free_ids, old_ids, old_cap * sizeof(uint64_t));
+			munmap(old_ids, old_cap * sizeof(uint64_t));
+		}
+	}
+	free_ids[num_free_ids++] = id;
+}
+
+/*
+* Function that opens the trace file, named after MEM_TRACE
+* Returns the file descriptor, or -1 on failure
+*/
+static int openTrace() {
+	char path[4096];
+	const char *name = getenv("MEM_TRACE");
+	size_t len = 0;
+	int fd;
+
+	if (name == NULL || name[0] == '\0') {
+		name = "memtrace.%p";
+	}
+	for (; *name != '\0' && len < sizeof(path) - 24; name++) {
+		if (name[0] == '%' && name[1] == 'p') {
+			len += snprintf(path + len, sizeof(path) - len, "%ld", (long)getpid());
+			name++;
+		}
+		else {
+			path[len++] = *name;
+		}
+	}
+	path[len] = '\0';
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0 && write(fd, TRACE_MAGIC, TRACE_MAGIC_SIZE) != TRACE_MAGIC_SIZE) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/*
+* Function that writes the buffered events out
+* The caller must hold rec_lock
+*/
+static void flushTrace() {
+	size_t done = 0;
+	ssize_t n;
+
+	if (out_len == 0) {
+		return;
+	}
+	if (out_fd < 0) {
+		out_fd = openTrace();
+		if (out_fd < 0) {
+			recording = 0;
+			out_len = 0;
+			return;
+		}
+	}
+	while (done < out_len) {
+		n = write(out_fd, out_buf + done, out_len - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	out_len = 0;
+}
+
+/*
+* Function that appends one event to the buffer
+* The caller must hold rec_lock
+*/
+static void emitEvent(int op, uint64_t id, uint64_t size, uint64_t align) {
+	if (out_len + TRACE_MAX_EVENT > OUT_BUF_SIZE) {
+		flushTrace();
+	}
+	out_len += tracePutEvent(out_buf + out_len, op, id, size, align);
+}
+
+/* Function that records a new object */
+static void recordNew(int op, void *ptr, size_t size, size_t align) {
+	uint64_t id;
+
+	if (ptr == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&rec_lock);
+	if (recording) {
+		id = newId();
+		if (mapInsert((uintptr_t)ptr, id) == 0) {
+			emitEvent(op, id, size, align);
+		}
+	}
+	pthread_mutex_unlock(&rec_lock);
+}
+
+/* Function that records the end of an object; objects never seen are skipped */
+static void recordFree(void *ptr) {
+	uint64_t id;
+
+	pthread_mutex_lock(&rec_lock);
+	if (recording) {
+		id = mapRemove((uintptr_t)ptr);
+		if (id != NO_ID) {
+			releaseId(id);
+			emitEvent(TRACE_FREE, id, 0, 0);
+		}
+	}
+	pthread_mutex_unlock(&rec_lock);
+}
+
+/* Fork hooks; a child records nothing, the parent's trace is not its own */
+static void forkPrepare() {
+	pthread_mutex_lock(&rec_lock);
+}
+
+static void forkParent() {
+	pthread_mutex_unlock(&rec_lock);
+}
+
+static void forkChild() {
+	recording = 0;
+	out_len = 0;
+	out_fd = -1;
+	pthread_mutex_unlock(&rec_lock);
+}
+
+__attribute__((constructor))
+static void recordStart() {
+	pthread_atfork(forkPrepare, forkParent, forkChild);
+}
+
+__attribute__((destructor))
+static void recordStop() {
+	pthread_mutex_lock(&rec_lock);
+	flushTrace();
+	recording = 0;
+	if (out_fd >= 0) {
+		close(out_fd);
+		out_fd = -1;
+	}
+	pthread_mutex_unlock(&rec_lock);
+}
+
+SHIM_EXPORT void* malloc(size_t size) {
+	void *ptr = __libc_malloc(size);
+
+	recordNew(TRACE_ALLOC, ptr, size, 0);
+	return ptr;
+}
+
+SHIM_EXPORT void free(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	//Record first; once freed, the address may be handed out again by now
+	recordFree(ptr);
+	__libc_free(ptr);
+}
+
+SHIM_EXPORT void* calloc(size_t nmemb, size_t size) {
+	void *ptr = __libc_calloc(nmemb, size);
+
+	recordNew(TRACE_CALLOC, ptr, nmemb * size, 0);
+	return ptr;
+}
+
+SHIM_EXPORT void* realloc(void *ptr, size_t size) {
+	void *new_ptr;
+	uint64_t id;
+
+	if (ptr == NULL) {
+		return malloc(size);
+	}
+	if (size == 0) {
+		recordFree(ptr);
+		return __libc_realloc(ptr, 0);
+	}
+
+	//The lock is held across the call, so no other thread can be handed
+	//the old address before the map has forgotten it
+	pthread_mutex_lock(&rec_lock);
+	new_ptr = __libc_realloc(ptr, size);
+	if (new_ptr != NULL && recording) {
+		id = mapRemove((uintptr_t)ptr);
+		if (id != NO_ID) {
+			if (mapInsert((uintptr_t)new_ptr, id) == 0) {
+				emitEvent(TRACE_REALLOC, id, size, 0);
+			}
+		}
+		else {
+			id = newId();
+			if (mapInsert((uintptr_t)new_ptr, id) == 0) {
+				emitEvent(TRACE_ALLOC, id, size, 0);
+			}
+		}
+	}
+	pthread_mutex_unlock(&rec_lock);
+	return new_ptr;
+}
+
+SHIM_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+	void *ptr;
+
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+		return EINVAL;
+	}
+	ptr = __libc_memalign(alignment, size);
+	if (ptr == NULL) {
+		return ENOMEM;
+	}
+	recordNew(TRACE_ALIGNED, ptr, size, alignment);
+	*memptr = ptr;
+	return 0;
+}
+
+/*
+* Function behind memalign and friends: glibc takes any alignment and
+* rounds it up, so the trace gets the rounded one, a power of two no
+* smaller than sizeof(void*)
+*/
+SHIM_EXPORT void* memalign(size_t alignment, size_t size) {
+	size_t align = sizeof(void*);
+	void *ptr;
+
+	if (alignment > SIZE_MAX / 2 + 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (align < alignment) {
+		align <<= 1;
+	}
+	ptr = __libc_memalign(align, size);
+	recordNew(TRACE_ALIGNED, ptr, size, align);
+	return ptr;
+}
+
+SHIM_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+	return memalign(alignment, size);
+}
+
+SHIM_EXPORT void* valloc(size_t size) {
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+SHIM_EXPORT void* pvalloc(size_t size) {
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	return memalign(pagesize, (size + pagesize - 1) / pagesize * pagesize);
+}
@@ -0,0 +1,654 @@
+/*
+* memReplay.c - Replays allocation traces against the allocator in memLibrary.c
+*
+* Build:
+*   gcc -O2 -pthread -DMEM_LIBRARY_ONLY memLibrary.c memReplay.c -o memReplay
+*
+* Usage: memReplay [options] <workload>...
+*   A workload is a trace file written by memRecord.c, or one of the built in
+*   workloads:
+*     steady      a fixed population of mixed size objects, replaced at random
+*     ramp        populations built up and torn down again, growing every cycle
+*     bimodal     many tiny short lived objects next to large long lived ones
+*   Options:
+*     -n ops      number of operations of the built in workloads (default 2000000)
+*     -s bytes    region handed to Mem_Init (default 16 MB)
+*     -o file     write the (last) built in workload out as a trace
+*     -l          replay against the C library's malloc instead
+*     -O opt=val  Mem_SetOption before the replay; opt is one of
+*                 remote_free, mmap_threshold, defer_coalesce, placement;
+*                 placement takes best, first, next or good
+*
+* Every operation is timed on its own. The report gives
+*   Mops/s      operations per second of time spent inside the allocator
+*   p50..p999   latency percentiles in nanoseconds (within 1/16 of the value)
+*   peak live   largest total of requested bytes live at one time
+*   peak RSS    largest growth of the resident set during the replay
+*   frag        share of that growth not holding requested bytes,
+*               i.e. headers, padding, free blocks and free pages; n/a
+*               when the growth is smaller than peak live, because the
+*               heap was already resident before the replay
+*
+* Run one workload per process for RSS figures that do not carry over
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "memLibrary.h"
+#include "memTrace.h"
+
+#define DEFAULT_OPS 2000000
+#define DEFAULT_HEAP_SIZE (16 * 1024 * 1024)
+
+/* Log-linear latency histogram: 16 buckets per power of two */
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+/* A live object of the replay */
+typedef struct slot {
+	void *ptr;
+	size_t size;
+} slot_t;
+
+/* A trace held in memory */
+typedef struct trace {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+	int mapped;		//Mapped from a file rather than built in memory
+} trace_t;
+
+/* The allocator under test */
+static int use_libc = 0;
+
+static uint64_t hist[HIST_BUCKETS];
+
+/* Function that returns a monotonic timestamp in nanoseconds */
+static uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Function that returns the histogram bucket of a latency */
+static int histBucket(uint64_t ns) {
+	int log2;
+
+	if (ns < HIST_SUB) {
+		return (int)ns;
+	}
+	log2 = 63 - __builtin_clzll(ns);
+	return (log2 - 3) * HIST_SUB + (int)((ns >> (log2 - 4)) & (HIST_SUB - 1));
+}
+
+/* Function that returns the smallest latency falling into a bucket */
+static uint64_t bucketValue(int bucket) {
+	int log2;
+
+	if (bucket < HIST_SUB) {
+		return bucket;
+	}
+	log2 = bucket / HIST_SUB + 3;
+	return ((uint64_t)HIST_SUB + bucket % HIST_SUB) << (log2 - 4);
+}
+
+/*
+* Function that returns a latency percentile from the histogram
+* Argument - total: Number of samples
+* Argument - fraction: Percentile as a fraction, e.g. 0.99
+*/
+static uint64_t percentile(uint64_t total, double fraction) {
+	uint64_t rank = (uint64_t)(fraction * total);
+	uint64_t seen = 0;
+	int b;
+
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen > rank) {
+			return bucketValue(b);
+		}
+	}
+	return bucketValue(HIST_BUCKETS - 1);
+}
+
+/*
+* Function that reads a field of /proc/self/status, in KB
+* Argument - field: Name of the field including the colon, e.g. "VmHWM:"
+* Returns 0 if the field cannot be read
+*/
+static long procStatus(const char *field) {
+	char line[256];
+	long value = 0;
+	FILE *f = fopen("/proc/self/status", "r");
+
+	if (f == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, field, strlen(field)) == 0) {
+			value = atol(line + strlen(field));
+			break;
+		}
+	}
+	fclose(f);
+	return value;
+}
+
+/* Function that resets the peak resident set size (VmHWM) to the current one */
+static void resetPeakRss() {
+	int fd = open("/proc/self/clear_refs", O_WRONLY);
+
+	if (fd >= 0) {
+		if (write(fd, "5", 1) != 1) {
+			fprintf(stderr, "cannot reset the peak RSS; figures include earlier runs\n");
+		}
+		close(fd);
+	}
+}
+
+/* Function that appends an event to a trace being built */
+static void traceAppend(trace_t *t, int op, uint64_t id, uint64_t size, uint64_t align) {
+	if (t->len + TRACE_MAX_EVENT > t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 1 << 20;
+		t->data = realloc(t->data, t->cap);
+		if (t->data == NULL) {
+			fprintf(stderr, "out of memory building the workload\n");
+			exit(1);
+		}
+	}
+	t->len += tracePutEvent(t->data + t->len, op, id, size, align);
+}
+
+/* Function that returns a pseudo random number; deterministic across runs */
+static uint64_t nextRand(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/* Function that returns a size drawn from a mix of small, medium and large */
+static uint64_t mixedSize(uint64_t *rng) {
+	uint64_t r = nextRand(rng) % 100;
+
+	if (r < 70) {
+		return 16 + nextRand(rng) % 113;
+	}
+	if (r < 95) {
+		return 128 + nextRand(rng) % 897;
+	}
+	return 1024 + nextRand(rng) % 15361;
+}
+
+/*
+* steady - Builds a population of 100000 objects, then replaces random
+* members one at a time; every 20th replacement is a realloc to a new
+* size instead
+*/
+static void buildSteady(trace_t *t, long ops) {
+	const uint64_t live = 100000;
+	uint64_t rng = 354;
+	uint64_t id;
+	long n;
+
+	for (id = 0; id < live; id++) {
+		traceAppend(t, TRACE_ALLOC, id, mixedSize(&rng), 0);
+	}
+	for (n = live; n < ops; n += 2) {
+		id = nextRand(&rng) % live;
+		if (nextRand(&rng) % 20 == 0) {
+			traceAppend(t, TRACE_REALLOC, id, mixedSize(&rng), 0);
+			n--;
+		}
+		else {
+			traceAppend(t, TRACE_FREE, id, 0, 0);
+			traceAppend(t, TRACE_ALLOC, id, mixedSize(&rng), 0);
+		}
+	}
+	for (id = 0; id < live; id++) {
+		traceAppend(t, TRACE_FREE, id, 0, 0);
+	}
+}
+
+/*
+* ramp - Allocates a population, then frees all of it in random order
+* Every cycle the objects are twice as large as in the one before, starting
+* over after six cycles, so the heap must reuse the holes of the previous
+* cycle with other sizes
+*/
+static void buildRamp(trace_t *t, long ops) {
+	const uint64_t live = 50000;
+	uint64_t *order = malloc(live * sizeof(uint64_t));
+	uint64_t rng = 354;
+	uint64_t i, j, tmp;
+	long n;
+	int cycle;
+
+	for (n = 0, cycle = 0; n < ops; n += 2 * live, cycle++) {
+		for (i = 0; i < live; i++) {
+			traceAppend(t, TRACE_ALLOC, i, (16 << (cycle % 6)) + nextRand(&rng) % (32 << (cycle % 6)), 0);
+			order[i] = i;
+		}
+		for (i = live - 1; i > 0; i--) {
+			j = nextRand(&rng) % (i + 1);
+			tmp = order[i];
+			order[i] = order[j];
+			order[j] = tmp;
+		}
+		for (i = 0; i < live; i++) {
+			traceAppend(t, TRACE_FREE, order[i], 0, 0);
+		}
+	}
+	free(order);
+}
+
+/*
+* bimodal - 90% of the allocations are tiny and freed again within a few
+* hundred operations; the rest are 8 to 64 KB and replace a random member
+* of a population of 2000
+*/
+static void buildBimodal(trace_t *t, long ops) {
+	const uint64_t large_live = 2000;
+	const uint64_t fifo_len = 256;
+	uint64_t fifo_head = 0;		//Tiny objects use ids large_live.., freed in FIFO order
+	uint64_t fifo_tail = 0;
+	uint64_t rng = 354;
+	uint64_t id;
+	long n;
+
+	for (id = 0; id < large_live; id++) {
+		traceAppend(t, TRACE_ALLOC, id, 8192 + nextRand(&rng) % 57345, 0);
+	}
+	for (n = large_live; n < ops; n += 2) {
+		if (nextRand(&rng) % 10 != 0) {
+			if (fifo_head - fifo_tail == fifo_len) {
+				traceAppend(t, TRACE_FREE, large_live + fifo_tail++ % fifo_len, 0, 0);
+			}
+			else {
+				n--;
+			}
+			traceAppend(t, TRACE_ALLOC, large_live + fifo_head++ % fifo_len, 8 + nextRand(&rng) % 41, 0);
+		}
+		else {
+			id = nextRand(&rng) % large_live;
+			traceAppend(t, TRACE_FREE, id, 0, 0);
+			traceAppend(t, TRACE_ALLOC, id, 8192 + nextRand(&rng) % 57345, 0);
+		}
+	}
+	while (fifo_tail != fifo_head) {
+		traceAppend(t, TRACE_FREE, large_live + fifo_tail++ % fifo_len, 0, 0);
+	}
+	for (id = 0; id < large_live; id++) {
+		traceAppend(t, TRACE_FREE, id, 0, 0);
+	}
+}
+
+/*
+* Function that maps a trace file into memory
+* Returns 0 on success and -1 if the file cannot be read or is not a trace
+*/
+static int loadTrace(trace_t *t, const char *path) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < TRACE_MAGIC_SIZE) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	t->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (t->data == MAP_FAILED || memcmp(t->data, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+		return -1;
+	}
+	t->len = st.st_size;
+	t->mapped = 1;
+	return 0;
+}
+
+/* Function that writes a trace built in memory out to a file */
+static int saveTrace(trace_t *t, const char *path) {
+	FILE *f = fopen(path, "wb");
+
+	if (f == NULL) {
+		return -1;
+	}
+	fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, f);
+	fwrite(t->data, 1, t->len, f);
+	return fclose(f);
+}
+
+/*
+* Function that touches a new block the way a program filling it would,
+* one byte per page, so the resident set reflects the heap's layout
+*/
+static void touchBlock(char *ptr, size_t size) {
+	size_t off;
+
+	for (off = 0; off < size; off += 4096) {
+		ptr[off] = (char)off;
+	}
+	ptr[size - 1] = 1;
+}
+
+/*
+* Function that replays a trace and prints one line of results
+* Argument - name: Name of the workload for the report
+* Argument - start: First event
+* Argument - end: End of the events
+* Returns 0 on success and -1 if the trace is malformed
+*/
+static int replay(const char *name, const unsigned char *start, const unsigned char *end) {
+	const unsigned char *pos = start;
+	slot_t *slots = NULL;
+	slot_t *new_slots;
+	size_t num_slots = 0;
+	uint64_t id, size, align;
+	uint64_t t0, t1;
+	uint64_t alloc_ns = 0;
+	uint64_t ops = 0;
+	uint64_t failures = 0;
+	size_t live = 0, peak_live = 0;
+	long base_rss, peak_rss;
+	void *ptr;
+	int op;
+
+	memset(hist, 0, sizeof(hist));
+	resetPeakRss();
+	base_rss = procStatus("VmRSS:");
+
+	while (pos < end) {
+		op = *pos++;
+		align = 0;
+		size = 0;
+		if (traceGetVarint(&pos, end, &id) != 0
+			|| (op == TRACE_ALIGNED && traceGetVarint(&pos, end, &align) != 0)
+			|| (op != TRACE_FREE && traceGetVarint(&pos, end, &size) != 0)) {
+			fprintf(stderr, "%s: trace cut off at byte %ld\n", name, (long)(pos - start));
+			free(slots);
+			return -1;
+		}
+		//Ids stay below the number of objects, and every object takes an event of 3 bytes or more
+		if (id >= (uint64_t)(end - start)) {
+			fprintf(stderr, "%s: bad object id %lu at byte %ld\n", name, (unsigned long)id, (long)(pos - start));
+			free(slots);
+			return -1;
+		}
+		if (op == TRACE_ALIGNED && (align == 0 || (align & (align - 1)) != 0)) {
+			fprintf(stderr, "%s: bad alignment %lu at byte %ld\n", name, (unsigned long)align, (long)(pos - start));
+			free(slots);
+			return -1;
+		}
+
+		if (id >= num_slots) {
+			size_t old = num_slots;
+			size_t want = id + 1 > 2 * num_slots ? id + 1 : 2 * num_slots;
+			new_slots = realloc(slots, want * sizeof(slot_t));
+			if (new_slots == NULL) {
+				fprintf(stderr, "%s: out of memory for %lu objects\n", name, (unsigned long)want);
+				free(slots);
+				return -1;
+			}
+			slots = new_slots;
+			num_slots = want;
+			memset(slots + old, 0, (num_slots - old) * sizeof(slot_t));
+		}
+
+		ptr = NULL;
+		switch (op) {
+		case TRACE_ALLOC:
+		case TRACE_CALLOC:
+		case TRACE_ALIGNED:
+			if (slots[id].ptr != NULL) {
+				fprintf(stderr, "%s: object %lu allocated twice\n", name, (unsigned long)id);
+				free(slots);
+				return -1;
+			}
+			t0 = nowNs();
+			if (use_libc) {
+				ptr = op == TRACE_ALLOC ? malloc(size) : op == TRACE_CALLOC ? calloc(size, 1) : aligned_alloc(align, (size + align - 1) / align * align);
+			}
+			else {
+				//malloc(0) hands out a unique block, Mem_Alloc(0) fails
+				ptr = op == TRACE_ALLOC ? Mem_Alloc(size ? size : 1) : op == TRACE_CALLOC ? Mem_Calloc(size ? size : 1, 1)
+					: Mem_AlignedAlloc(align, size ? size : 1);
+			}
+			t1 = nowNs();
+			break;
+		case TRACE_REALLOC:
+			if (slots[id].ptr == NULL) {
+				continue;
+			}
+			t0 = nowNs();
+			ptr = use_libc ? realloc(slots[id].ptr, size) : Mem_Realloc(slots[id].ptr, size);
+			t1 = nowNs();
+			if (ptr != NULL) {
+				live -= slots[id].size;
+				slots[id].ptr = NULL;
+			}
+			break;
+		case TRACE_FREE:
+			if (slots[id].ptr == NULL) {
+				continue;
+			}
+			t0 = nowNs();
+			if (use_libc) {
+				free(slots[id].ptr);
+			}
+			else {
+				Mem_Free(slots[id].ptr);
+			}
+			t1 = nowNs();
+			live -= slots[id].size;
+			slots[id].ptr = NULL;
+			break;
+		default:
+			fprintf(stderr, "%s: bad op 0x%02x at byte %ld\n", name, op, (long)(pos - start - 1));
+			free(slots);
+			return -1;
+		}
+
+		alloc_ns += t1 - t0;
+		hist[histBucket(t1 - t0)]++;
+		ops++;
+
+		if (op != TRACE_FREE) {
+			if (ptr == NULL) {
+				failures++;
+				continue;
+			}
+			if (size > 0) {
+				touchBlock(ptr, size);
+			}
+			slots[id].ptr = ptr;
+			slots[id].size = size;
+			live += size;
+			if (live > peak_live) {
+				peak_live = live;
+			}
+		}
+	}
+
+	peak_rss = procStatus("VmHWM:") - base_rss;
+
+	printf("%-10s %10lu %9.2f %7lu %7lu %7lu %12.1f %12.1f",
+		name, (unsigned long)ops, ops * 1e3 / (alloc_ns ? alloc_ns : 1),
+		(unsigned long)percentile(ops, 0.5), (unsigned long)percentile(ops, 0.99),
+		(unsigned long)percentile(ops, 0.999), peak_live / 1048576.0, peak_rss / 1024.0);
+	//Pages resident before the replay hold live bytes without growing the RSS
+	if (peak_rss > 0 && peak_rss * 1024.0 >= peak_live) {
+		printf(" %7.1f%%", 100.0 * (1.0 - peak_live / (peak_rss * 1024.0)));
+	}
+	else {
+		printf(" %8s", "n/a");
+	}
+	if (failures > 0) {
+		printf("  (%lu allocations failed)", (unsigned long)failures);
+	}
+	printf("\n");
+
+	//Free whatever the trace left live
+	for (id = 0; id < num_slots; id++) {
+		if (slots[id].ptr != NULL) {
+			if (use_libc) {
+				free(slots[id].ptr);
+			}
+			else {
+				Mem_Free(slots[id].ptr);
+			}
+		}
+	}
+	free(slots);
+	return 0;
+}
+
+/* Names of the options -O accepts */
+static const struct {
+	const char *name;
+	int option;
+} option_names[] = {
+	{ "remote_free", MEM_OPT_REMOTE_FREE },
+	{ "mmap_threshold", MEM_OPT_MMAP_THRESHOLD },
+	{ "defer_coalesce", MEM_OPT_DEFER_COALESCE },
+	{ "placement", MEM_OPT_PLACEMENT },
+};
+
+/* Names of the placement policies, accepted as values */
+static const struct {
+	const char *name;
+	long value;
+} value_names[] = {
+	{ "best", MEM_PLACE_BEST },
+	{ "first", MEM_PLACE_FIRST },
+	{ "next", MEM_PLACE_NEXT },
+	{ "good", MEM_PLACE_GOOD },
+};
+
+/*
+* Function that applies an option given as name=value
+* Returns 0 on success and -1 if the option is unknown or the value rejected
+*/
+static int setOption(const char *arg) {
+	const char *eq = strchr(arg, '=');
+	long value;
+	size_t i;
+
+	if (eq == NULL) {
+		return -1;
+	}
+	value = strtol(eq + 1, NULL, 0);
+	for (i = 0; i < sizeof(value_names) / sizeof(value_names[0]); i++) {
+		if (strcmp(eq + 1, value_names[i].name) == 0) {
+			value = value_names[i].value;
+		}
+	}
+	for (i = 0; i < sizeof(option_names) / sizeof(option_names[0]); i++) {
+		if (strlen(option_names[i].name) == (size_t)(eq - arg) &&
+			strncmp(arg, option_names[i].name, eq - arg) == 0) {
+			return Mem_SetOption(option_names[i].option, value);
+		}
+	}
+	return -1;
+}
+
+/* Function that prints how to use the program */
+static int usage(char *prog) {
+	fprintf(stderr, "Usage: %s [-n ops] [-s heap_bytes] [-o out.trace] [-l] [-O opt=val] <trace file|steady|ramp|bimodal>...\n", prog);
+	return 1;
+}
+
+int main(int argc, char* argv[]) {
+	long ops = DEFAULT_OPS;
+	size_t heap_size = DEFAULT_HEAP_SIZE;
+	const char *out_path = NULL;
+	const char *options[16];
+	int num_options = 0;
+	trace_t t;
+	int opt;
+	int status = 0;
+	int i;
+
+	while ((opt = getopt(argc, argv, "n:s:o:lO:")) != -1) {
+		switch (opt) {
+		case 'n':
+			ops = atol(optarg);
+			break;
+		case 's':
+			heap_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'l':
+			use_libc = 1;
+			break;
+		case 'O':
+			if (num_options == 16) {
+				return usage(argv[0]);
+			}
+			options[num_options++] = optarg;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (optind >= argc) {
+		return usage(argv[0]);
+	}
+
+	//Options are set before Mem_Init, so they can shape the heap from the start
+	for (i = 0; i < num_options; i++) {
+		if (setOption(options[i]) != 0) {
+			fprintf(stderr, "bad option %s\n", options[i]);
+			return 1;
+		}
+	}
+	if (!use_libc && Mem_Init(heap_size) == -1) {
+		fprintf(stderr, "Mem_Init failed\n");
+		return 1;
+	}
+
+	printf("%-10s %10s %9s %7s %7s %7s %12s %12s %8s\n", "workload", "ops", "Mops/s",
+		"p50 ns", "p99 ns", "p999 ns", "peak live MB", "peak RSS MB", "frag");
+	for (i = optind; i < argc; i++) {
+		memset(&t, 0, sizeof(t));
+		if (strcmp(argv[i], "steady") == 0) {
+			buildSteady(&t, ops);
+		}
+		else if (strcmp(argv[i], "ramp") == 0) {
+			buildRamp(&t, ops);
+		}
+		else if (strcmp(argv[i], "bimodal") == 0) {
+			buildBimodal(&t, ops);
+		}
+		else if (loadTrace(&t, argv[i]) != 0) {
+			fprintf(stderr, "%s: not a trace file\n", argv[i]);
+			status = 1;
+			continue;
+		}
+
+		if (t.mapped) {
+			status |= replay(argv[i], t.data + TRACE_MAGIC_SIZE, t.data + t.len) != 0;
+			munmap(t.data, t.len);
+		}
+		else {
+			status |= replay(argv[i], t.data, t.data + t.len) != 0;
+			if (out_path != NULL && saveTrace(&t, out_path) != 0) {
+				fprintf(stderr, "cannot write %s\n", out_path);
+				status = 1;
+			}
+			free(t.data);
+		}
+	}
+	return status;
+}
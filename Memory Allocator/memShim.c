@@ -0,0 +1,361 @@
+/*
+* memShim.c - Runs unmodified programs on the allocator in memLibrary.c
+*
+* Exports the C allocation functions on top of the Mem_* calls, so the
+* allocator can be slipped under any dynamically linked program:
+*
+* Build:
+*   gcc -O2 -fPIC -shared -pthread -fvisibility=hidden -ftls-model=initial-exec \
+*       -DMEM_LIBRARY_ONLY memLibrary.c memShim.c -o libmemshim.so
+*
+* Usage:
+*   LD_PRELOAD=./libmemshim.so <program> [args]
+*
+* The heap is set up by the first allocation, which may well happen inside
+* the dynamic loader or another library's constructor, long before main
+* MEM_HEAP_SIZE in the environment sets the region handed to Mem_Init
+* (default 4 MB; the heap grows past it on demand)
+*
+* Anything allocated while Mem_Init itself runs comes from a small static
+* bootstrap buffer; such blocks are never given back
+*
+* MEM_STATS_INTERVAL=<ms> writes the allocator statistics as a JSON line
+* every <ms> milliseconds, to stderr or to the file named by MEM_STATS_FILE
+* MEM_TRIM_INTERVAL=<ms> gives free memory back to the OS every <ms>
+* milliseconds, and MEM_HUGE_PAGES=1 backs the heap with huge pages
+*
+* MEM_SAMPLE_INTERVAL=<bytes> turns on the sampling profiler; the profile
+* is written at exit to the file named by MEM_PROFILE_FILE (default
+* stderr), in the format named by MEM_PROFILE_FORMAT: pprof (default),
+* folded or text
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "memLibrary.h"
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+#define DEFAULT_HEAP_SIZE (4 * 1024 * 1024)
+
+/*
+* Bootstrap buffer
+* Every block is preceded by BOOT_HDR_SIZE bytes holding its size, which
+* keeps the payloads aligned like Mem_Alloc's
+*/
+#define BOOT_SIZE (64 * 1024)
+#define BOOT_HDR_SIZE 16
+
+static char boot_buf[BOOT_SIZE] __attribute__((aligned(BOOT_HDR_SIZE)));
+static atomic_size_t boot_used = 0;
+
+/* States of the heap */
+#define SHIM_UNINIT 0
+#define SHIM_INITIALIZING 1
+#define SHIM_READY 2
+#define SHIM_FAILED 3
+
+static atomic_int shim_state = SHIM_UNINIT;
+
+/* Set while the calling thread runs Mem_Init */
+static _Thread_local int shim_in_init = 0;
+
+/* Function that tells whether ptr came from the bootstrap buffer */
+static int isBoot(void *ptr) {
+	return (char*)ptr >= boot_buf && (char*)ptr < boot_buf + BOOT_SIZE;
+}
+
+/*
+* Function that carves a block out of the bootstrap buffer
+* Argument - size: Requested payload size
+* Returns the address of the payload, or NULL once the buffer is used up
+*/
+static void* bootAlloc(size_t size) {
+	size_t need;
+	size_t off;
+
+	if (size > BOOT_SIZE) {
+		return NULL;
+	}
+	need = BOOT_HDR_SIZE + (size + BOOT_HDR_SIZE - 1) / BOOT_HDR_SIZE * BOOT_HDR_SIZE;
+	off = atomic_fetch_add(&boot_used, need);
+	if (off + need > BOOT_SIZE) {
+		return NULL;
+	}
+	*(size_t*)(boot_buf + off) = size;
+	return boot_buf + off + BOOT_HDR_SIZE;
+}
+
+/* Function that returns the payload size of a bootstrap block */
+static size_t bootSize(void *ptr) {
+	return *(size_t*)((char*)ptr - BOOT_HDR_SIZE);
+}
+
+/*
+* Function that sets up the heap on first use
+* Returns 1 once the heap is ready, and 0 if the caller must fall back to
+* the bootstrap buffer: when called from inside Mem_Init, or if Mem_Init failed
+* Threads arriving while another one runs Mem_Init wait for it to finish
+*/
+static int shimInit() {
+	int state = atomic_load_explicit(&shim_state, memory_order_acquire);
+	int expected = SHIM_UNINIT;
+	size_t heap_size = DEFAULT_HEAP_SIZE;
+	char *env;
+
+	if (state == SHIM_READY) {
+		return 1;
+	}
+	if (shim_in_init) {
+		return 0;
+	}
+
+	if (atomic_compare_exchange_strong(&shim_state, &expected, SHIM_INITIALIZING)) {
+		shim_in_init = 1;
+
+		//getenv and strtoul do not allocate
+		env = getenv("MEM_HEAP_SIZE");
+		if (env != NULL && strtoul(env, NULL, 0) > 0) {
+			heap_size = strtoul(env, NULL, 0);
+		}
+		env = getenv("MEM_HUGE_PAGES");
+		if (env != NULL) {
+			Mem_SetOption(MEM_OPT_HUGE_PAGES, strtol(env, NULL, 0));
+		}
+		state = Mem_Init(heap_size) == 0 ? SHIM_READY : SHIM_FAILED;
+
+		shim_in_init = 0;
+		atomic_store_explicit(&shim_state, state, memory_order_release);
+		return state == SHIM_READY;
+	}
+
+	while ((state = atomic_load_explicit(&shim_state, memory_order_acquire)) == SHIM_INITIALIZING) {
+		sched_yield();
+	}
+	return state == SHIM_READY;
+}
+
+/*
+* Write the heap profile at exit, if the profiler was turned on
+*/
+__attribute__((destructor))
+static void shimDestructor() {
+	FILE *out = stderr;
+	int format = MEM_PROFILE_PPROF;
+	char *env;
+
+	env = getenv("MEM_SAMPLE_INTERVAL");
+	if (env == NULL || strtol(env, NULL, 0) <= 0) {
+		return;
+	}
+	env = getenv("MEM_PROFILE_FORMAT");
+	if (env != NULL && strcmp(env, "folded") == 0) {
+		format = MEM_PROFILE_FOLDED;
+	}
+	else if (env != NULL && strcmp(env, "text") == 0) {
+		format = MEM_PROFILE_TEXT;
+	}
+	env = getenv("MEM_PROFILE_FILE");
+	if (env != NULL && (out = fopen(env, "w")) == NULL) {
+		return;
+	}
+	Mem_ProfileDump(out, format);
+	if (out != stderr) {
+		fclose(out);
+	}
+}
+
+/*
+* Set up the heap before main, in case nothing allocated earlier, and start
+* the profiler and the trim and statistics threads if asked to
+*/
+__attribute__((constructor))
+static void shimConstructor() {
+	FILE *out = stderr;
+	char *env;
+	long interval_ms;
+
+	if (!shimInit()) {
+		return;
+	}
+
+	env = getenv("MEM_TRIM_INTERVAL");
+	if (env != NULL && (interval_ms = strtol(env, NULL, 0)) > 0) {
+		Mem_SetOption(MEM_OPT_TRIM_INTERVAL, interval_ms);
+	}
+
+	env = getenv("MEM_SAMPLE_INTERVAL");
+	if (env != NULL && strtol(env, NULL, 0) > 0) {
+		Mem_SetOption(MEM_OPT_SAMPLE_INTERVAL, strtol(env, NULL, 0));
+	}
+
+	env = getenv("MEM_STATS_INTERVAL");
+	if (env == NULL || (interval_ms = strtol(env, NULL, 0)) <= 0) {
+		return;
+	}
+	env = getenv("MEM_STATS_FILE");
+	if (env != NULL && (out = fopen(env, "a")) == NULL) {
+		return;
+	}
+	Mem_StatsPeriodic(out, interval_ms);
+}
+
+SHIM_EXPORT void* malloc(size_t size) {
+	void *ptr;
+
+	if (!shimInit()) {
+		ptr = bootAlloc(size);
+	}
+	else {
+		//malloc(0) must return a unique pointer
+		ptr = Mem_Alloc(size != 0 ? size : 1);
+	}
+	if (ptr == NULL) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+SHIM_EXPORT void free(void *ptr) {
+	if (ptr == NULL || isBoot(ptr)) {
+		return;
+	}
+	Mem_Free(ptr);
+}
+
+SHIM_EXPORT void* calloc(size_t nmemb, size_t size) {
+	void *ptr;
+
+	if (!shimInit()) {
+		//The bootstrap buffer is static, so it is zero until handed out
+		if (size != 0 && nmemb > SIZE_MAX / size) {
+			ptr = NULL;
+		}
+		else {
+			ptr = bootAlloc(nmemb * size);
+		}
+	}
+	else if (nmemb == 0 || size == 0) {
+		ptr = Mem_Alloc(1);
+		if (ptr != NULL) {
+			memset(ptr, 0, 1);
+		}
+	}
+	else {
+		ptr = Mem_Calloc(nmemb, size);
+	}
+	if (ptr == NULL) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+SHIM_EXPORT void* realloc(void *ptr, size_t size) {
+	void *new_ptr;
+	size_t old_size;
+
+	if (ptr == NULL) {
+		return malloc(size);
+	}
+
+	//Bootstrap blocks cannot grow; move them to the heap (or another bootstrap block)
+	if (isBoot(ptr)) {
+		new_ptr = malloc(size != 0 ? size : 1);
+		if (new_ptr != NULL) {
+			old_size = bootSize(ptr);
+			memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+		}
+		return new_ptr;
+	}
+
+	new_ptr = Mem_Realloc(ptr, size);
+	if (new_ptr == NULL && size != 0) {
+		errno = ENOMEM;
+	}
+	return new_ptr;
+}
+
+SHIM_EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+	void *ptr;
+
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) {
+		return EINVAL;
+	}
+	if (!shimInit()) {
+		return ENOMEM;
+	}
+
+	ptr = Mem_AlignedAlloc(alignment, size != 0 ? size : 1);
+	if (ptr == NULL) {
+		return ENOMEM;
+	}
+	*memptr = ptr;
+	return 0;
+}
+
+/*
+* Function behind aligned_alloc, memalign, valloc and pvalloc
+* Like glibc, any alignment is accepted: it is rounded up to a power of two
+* and to at least MEM_ALIGNMENT
+*/
+static void* shimAlignedAlloc(size_t alignment, size_t size) {
+	size_t align = MEM_ALIGNMENT;
+	void *ptr;
+
+	if (alignment > SIZE_MAX / 2 + 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	while (align < alignment) {
+		align <<= 1;
+	}
+	if (!shimInit()) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ptr = Mem_AlignedAlloc(align, size != 0 ? size : 1);
+	if (ptr == NULL) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+SHIM_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+	return shimAlignedAlloc(alignment, size);
+}
+
+SHIM_EXPORT void* memalign(size_t alignment, size_t size) {
+	return shimAlignedAlloc(alignment, size);
+}
+
+SHIM_EXPORT void* valloc(size_t size) {
+	return shimAlignedAlloc(sysconf(_SC_PAGESIZE), size);
+}
+
+SHIM_EXPORT void* pvalloc(size_t size) {
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	if (size > SIZE_MAX - (pagesize - 1)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return shimAlignedAlloc(pagesize, (size + pagesize - 1) / pagesize * pagesize);
+}
+
+SHIM_EXPORT size_t malloc_usable_size(void *ptr) {
+	if (ptr == NULL) {
+		return 0;
+	}
+	if (isBoot(ptr)) {
+		return bootSize(ptr);
+	}
+	return Mem_UsableSize(ptr);
+}
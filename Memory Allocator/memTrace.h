@@ -0,0 +1,99 @@
+#ifndef MEM_TRACE_H
+#define MEM_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+* Binary format of allocation traces
+* Written by memRecord.c (and by memReplay.c for its built in workloads),
+* read by memReplay.c
+*
+* A trace is the TRACE_MAGIC bytes followed by events. Every event is one
+* op byte followed by its arguments, each an unsigned LEB128 varint:
+*   TRACE_ALLOC   id size          malloc
+*   TRACE_CALLOC  id size          calloc, size is nmemb * size
+*   TRACE_ALIGNED id align size    posix_memalign and friends, align a power of two
+*   TRACE_REALLOC id size          realloc of a live object, which keeps its id
+*   TRACE_FREE    id               free
+*
+* Ids name objects rather than addresses. The id of a freed object is
+* handed out again, so ids stay below the peak number of live objects and
+* most events take 3 or 4 bytes
+*/
+#define TRACE_MAGIC "MEMTRC01"
+#define TRACE_MAGIC_SIZE 8
+
+#define TRACE_ALLOC 'a'
+#define TRACE_CALLOC 'c'
+#define TRACE_ALIGNED 'm'
+#define TRACE_REALLOC 'r'
+#define TRACE_FREE 'f'
+
+/* Longest encoding of an event: op byte and three 64-bit varints */
+#define TRACE_MAX_EVENT (1 + 3 * 10)
+
+/*
+* Function that appends a varint to a buffer
+* Argument - buf: Where to write; must have room for 10 bytes
+* Argument - value: Value to encode
+* Returns the number of bytes written
+*/
+static inline int tracePutVarint(unsigned char *buf, uint64_t value) {
+	int n = 0;
+
+	while (value >= 0x80) {
+		buf[n++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	buf[n++] = (unsigned char)value;
+	return n;
+}
+
+/*
+* Function that reads a varint from a buffer
+* Argument - pos: Read position, advanced past the varint
+* Argument - end: End of the buffer
+* Argument - value: Decoded value
+* Returns 0 on success and -1 if the varint is cut off or too long
+*/
+static inline int traceGetVarint(const unsigned char **pos, const unsigned char *end, uint64_t *value) {
+	const unsigned char *p = *pos;
+	uint64_t v = 0;
+	int shift;
+
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		v |= (uint64_t)(*p & 0x7F) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*pos = p;
+			*value = v;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+* Function that encodes one event
+* Argument - buf: Where to write; must have room for TRACE_MAX_EVENT bytes
+* Argument - op: One of the TRACE_* ops
+* Argument - id: Object the event applies to
+* Argument - size: Size argument, ignored for TRACE_FREE
+* Argument - align: Alignment, only used for TRACE_ALIGNED
+* Returns the number of bytes written
+*/
+static inline int tracePutEvent(unsigned char *buf, int op, uint64_t id, uint64_t size, uint64_t align) {
+	int n = 0;
+
+	buf[n++] = (unsigned char)op;
+	n += tracePutVarint(buf + n, id);
+	if (op == TRACE_ALIGNED) {
+		n += tracePutVarint(buf + n, align);
+	}
+	if (op != TRACE_FREE) {
+		n += tracePutVarint(buf + n, size);
+	}
+	return n;
+}
+
+#endif